@@ -17,11 +17,21 @@
 # include "config.h"
 #endif
 
+#include <ctype.h>
+
 #include "p_build.h"
 
 extern int gnumake_install(build_context_t *ctx);
 extern int gnumake_clean(build_context_t *ctx);
 extern int gnumake_build(build_context_t *ctx);
+extern int gnumake_products(build_context_t *ctx, int run, build_defn_t **products);
+
+/* The state files (in ctx->statedir) which record the digest of what
+ * autoreconf last consumed, and the fingerprint of the last successful
+ * configure run
+ */
+#define AUTOCONF_PREPARE_STATE          "prepare"
+#define AUTOCONF_CONFIG_STATE           "config"
 
 char *
 autoconf_locate(build_context_t *ctx, int *res)
@@ -97,6 +107,8 @@ autoconf_chdir(build_context_t *ctx)
 int
 autoconf_detect(build_context_t *ctx)
 {
+	static char *witness;
+	char *dir;
 	int r;
 	
 	if(ctx->project && !S_ISDIR(ctx->sbuf.st_mode))
@@ -112,8 +124,18 @@ autoconf_detect(build_context_t *ctx)
 			return -1;
 		}
 	}
-	if(autoconf_locate(ctx, &r))
+	if((dir = autoconf_locate(ctx, &r)))
 	{
+		free(witness);
+		if((witness = malloc(strlen(dir) + 16)))
+		{
+			sprintf(witness, "%s/configure.ac", dir);
+			if(access(witness, R_OK))
+			{
+				sprintf(witness, "%s/configure.in", dir);
+			}
+		}
+		ctx->detected = witness;
 		return 1;
 	}
 	if(r == -1)
@@ -123,12 +145,86 @@ autoconf_detect(build_context_t *ctx)
 	return 0;
 }
 
+static const char *const autoconf_ignore[] = { ".build", ".git", ".hg", ".svn", "autom4te.cache", NULL };
+
+/* Check whether a file in the source tree is one which autoreconf
+ * consumes: configure.ac (or configure.in), a Makefile.am, or a macro
+ * file
+ */
+static int
+autoconf_digest_wanted(const char *path)
+{
+	const char *base;
+	size_t l;
+
+	if(!strcmp(path, "configure.ac") || !strcmp(path, "configure.in"))
+	{
+		return 1;
+	}
+	base = ((base = strrchr(path, '/')) ? base + 1 : path);
+	l = strlen(base);
+	return !strcmp(base, "Makefile.am") || (l > 3 && !strcmp(base + l - 3, ".m4"));
+}
+
+/* Compute a digest of everything that autoreconf consumes: the
+ * configure script source, Makefile.am files, macro files, and the
+ * identity of the autotools themselves. Must be called from the
+ * top-level source directory.
+ */
+static int
+autoconf_digest(build_context_t *ctx, char *hex)
+{
+	static const char *tools[] = { "autoreconf", "autoconf", "autoheader", "automake", "aclocal", "libtoolize", "autopoint", NULL };
+	static const char *envs[] = { "BUILD_AUTORECONF", "AUTORECONF", "AUTOCONF", "AUTOHEADER", "AUTOMAKE", "ACLOCAL", "LIBTOOLIZE", "AUTOPOINT", NULL };
+	struct stat sbuf;
+	const char *p;
+	tree_t *tree;
+	digest_t d;
+	size_t c;
+
+	if(access("configure.ac", R_OK) && access("configure.in", R_OK))
+	{
+		context_msg(ctx, MSG_PERROR, "failed to read configure.ac or configure.in");
+		return -1;
+	}
+	if(!(tree = tree_scan(ctx, ".", autoconf_ignore, 0, 0)))
+	{
+		return -1;
+	}
+	digest_init(&d);
+	for(c = 0; c < tree->count; c++)
+	{
+		if(autoconf_digest_wanted(tree->entries[c].path))
+		{
+			digest_str(&d, tree->entries[c].path);
+			digest_file(&d, tree->entries[c].path);
+		}
+	}
+	tree_free(tree);
+	for(c = 0; envs[c]; c++)
+	{
+		digest_str(&d, getenv(envs[c]));
+	}
+	for(c = 0; tools[c]; c++)
+	{
+		if((p = context_pathsearch(ctx, tools[c])) && !stat(p, &sbuf))
+		{
+			digest_strf(&d, "%s:%s:%lld:%ld", tools[c], p, (long long) sbuf.st_size, (long) sbuf.st_mtime);
+		}
+	}
+	digest_final(&d, hex);
+	return 0;
+}
+
 int
 autoconf_prepare(build_context_t *ctx)
 {
 	cmd_t *cmd;
-	int r, r1, r2;
+	int r, r1, r2, uptodate;
 	struct stat conf, csrc;
+	char digest[DIGEST_HEXLEN + 1];
+	const char *prev;
+	build_defn_t *kv;
 
 	if(ctx->project)
 	{
@@ -142,27 +238,49 @@ autoconf_prepare(build_context_t *ctx)
 	{
 		return -1;
 	}
-	/* TODO:
-	 *  compare acinclude.m4/aclocal.m4, Makefile.am/Makefile.in, etc.
-	 */
+	if(autoconf_digest(ctx, digest))
+	{
+		context_returnwd(ctx);
+		return -1;
+	}
+	kv = state_load(ctx, AUTOCONF_PREPARE_STATE);
 	if(ctx->isauto)
 	{
 		if(-1 == (r1 = stat("configure.gnu", &conf)))
 		{
 			r1 = stat("configure", &conf);
 		}
-		if(-1 == (r2 = stat("configure.ac", &csrc)))
+		if((prev = state_get(kv, "digest")))
+		{
+			uptodate = (r1 != -1 && !strcmp(prev, digest));
+		}
+		else
 		{
-			if(-1 == (r2 = stat("configure.in", &csrc)))
+			/* Nothing recorded by an earlier run: fall back to comparing
+			 * the modification times of configure and its source.
+			 */
+			if(-1 == (r2 = stat("configure.ac", &csrc)))
 			{
-				context_msg(ctx, MSG_PERROR, "failed to locate configure.ac or configure.in");
-				return -1;
+				if(-1 == (r2 = stat("configure.in", &csrc)))
+				{
+					context_msg(ctx, MSG_PERROR, "failed to locate configure.ac or configure.in");
+					state_free(kv);
+					context_returnwd(ctx);
+					return -1;
+				}
+			}
+			uptodate = (r1 != -1 && conf.st_mtime >= csrc.st_mtime);
+			if(uptodate)
+			{
+				state_set(ctx, &kv, "digest", digest);
+				state_save(ctx, AUTOCONF_PREPARE_STATE, kv);
 			}
 		}
-		if(r1 == -1 || conf.st_mtime >= csrc.st_mtime)
+		if(uptodate)
 		{
 			/* configure script is up to date */
 			context_msg(ctx, MSG_INFO, "configure script is up to date\n");
+			state_free(kv);
 			context_returnwd(ctx);
 			return -255;
 		}
@@ -171,22 +289,513 @@ autoconf_prepare(build_context_t *ctx)
 	cmd_arg_add(cmd, "--install");
 	r = cmd_spawn(cmd, 0);
 	cmd_destroy(cmd);
+	if(!r && !ctx->dryrun)
+	{
+		/* autoreconf --install may have added macros to m4/, so the
+		 * digest must be taken again now that it has finished.
+		 */
+		if(!autoconf_digest(ctx, digest))
+		{
+			state_set(ctx, &kv, "digest", digest);
+			state_save(ctx, AUTOCONF_PREPARE_STATE, kv);
+		}
+	}
+	state_free(kv);
 	context_returnwd(ctx);
 	return r;
 }
 
+/* Compute a fingerprint of a configure invocation: its command-line,
+ * the environment variables which configure scripts consult, and the
+ * contents of the configure script itself.
+ */
+static int
+autoconf_fingerprint(build_context_t *ctx, cmd_t *cmd, char *hex)
+{
+	static const char *envs[] = {
+		"CC", "CFLAGS", "CPP", "CPPFLAGS", "CXX", "CXXFLAGS", "CXXCPP",
+		"OBJC", "OBJCFLAGS", "LDFLAGS", "LIBS", "CONFIG_SITE", "CONFIG_SHELL",
+		"PKG_CONFIG", "PKG_CONFIG_PATH", "PKG_CONFIG_LIBDIR", "PATH", NULL
+	};
+	digest_t d;
+	size_t c;
+
+	digest_init(&d);
+	for(c = 0; c < cmd->argc; c++)
+	{
+		digest_str(&d, cmd->argv[c]);
+	}
+	for(c = 0; envs[c]; c++)
+	{
+		digest_strf(&d, "%s=%s", envs[c], (getenv(envs[c]) ? getenv(envs[c]) : ""));
+	}
+	if(digest_file(&d, cmd->argv[1]))
+	{
+		context_msg(ctx, MSG_PERROR, "%s", cmd->argv[1]);
+		return -1;
+	}
+	digest_final(&d, hex);
+	return 0;
+}
+
+/* Look up a variable which affects the results of configure tests,
+ * preferring a definition over the environment.
+ */
+static const char *
+autoconf_var(build_context_t *ctx, const char *name)
+{
+	build_defn_t *p;
+
+	if((p = context_defn_find(ctx, name)) && p->value)
+	{
+		return p->value;
+	}
+	return getenv(name);
+}
+
+/* Determine the path to the shared configure cache for the current
+ * toolchain: the build, host and target triplets, the compiler and
+ * its flags. Returns a static buffer.
+ */
+static const char *
+autoconf_cache_path(build_context_t *ctx)
+{
+	static const char *vars[] = { "CC", "CFLAGS", "CPP", "CPPFLAGS", "LDFLAGS", "LIBS", NULL };
+	static char pbuf[1100];
+	char cc[256], hex[DIGEST_HEXLEN + 1], *t;
+	const char *dir, *p;
+	struct stat sbuf;
+	digest_t d;
+	size_t c;
+
+	if(!(dir = state_cachedir(ctx, "autoconf")))
+	{
+		return NULL;
+	}
+	digest_init(&d);
+	digest_str(&d, ctx->build);
+	digest_str(&d, ctx->host);
+	digest_str(&d, ctx->target);
+	for(c = 0; vars[c]; c++)
+	{
+		digest_str(&d, autoconf_var(ctx, vars[c]));
+	}
+	/* Identify the compiler itself, so that upgrading it invalidates
+	 * the cache.
+	 */
+	snprintf(cc, sizeof(cc), "%s", ((p = autoconf_var(ctx, "CC")) ? p : "gcc"));
+	if((t = strchr(cc, ' ')))
+	{
+		*t = 0;
+	}
+	if(!(p = strchr(cc, '/') ? cc : context_pathsearch(ctx, cc)))
+	{
+		p = context_pathsearch(ctx, "cc");
+	}
+	if(p && !stat(p, &sbuf))
+	{
+		digest_strf(&d, "%s:%lld:%ld", p, (long long) sbuf.st_size, (long) sbuf.st_mtime);
+	}
+	digest_final(&d, hex);
+	snprintf(pbuf, sizeof(pbuf), "%s/%s-%s.cache", dir, (ctx->host ? ctx->host : "native"), hex);
+	return pbuf;
+}
+
+/* A configure cache file, kept in its original form: each entry is an
+ * assignment to a cache variable, whose quoted value might span several
+ * lines, and anything else (such as the comments at the top) is kept
+ * as it is, with a NULL name.
+ */
+typedef struct autoconf_entry_s autoconf_entry_t;
+
+struct autoconf_entry_s
+{
+	autoconf_entry_t *next;
+	char *name;
+	char *text;
+};
+
+static void
+autoconf_cache_free(autoconf_entry_t *list)
+{
+	autoconf_entry_t *p;
+
+	while((p = list))
+	{
+		list = p->next;
+		free(p->name);
+		free(p->text);
+		free(p);
+	}
+}
+
+/* Determine whether the text of an entry is complete, or whether it
+ * ends within quotes or with a continuation
+ */
+static int
+autoconf_cache_complete(const char *text)
+{
+	char quote;
+
+	for(quote = 0; *text; text++)
+	{
+		if(quote == '\'')
+		{
+			if(*text == '\'')
+			{
+				quote = 0;
+			}
+		}
+		else if(*text == '\\')
+		{
+			if(!text[1] || (text[1] == '\n' && !text[2]))
+			{
+				return 0;
+			}
+			text++;
+		}
+		else if(quote == '"')
+		{
+			if(*text == '"')
+			{
+				quote = 0;
+			}
+		}
+		else if(*text == '\'' || *text == '"')
+		{
+			quote = *text;
+		}
+	}
+	return !quote;
+}
+
+/* Read a configure cache file; one which doesn't exist is empty */
+static int
+autoconf_cache_read(build_context_t *ctx, const char *path, autoconf_entry_t **list)
+{
+	autoconf_entry_t *entry, **tail;
+	char *buf, *text, *p;
+	size_t bufsize, l, tl;
+	ssize_t r;
+	FILE *f;
+
+	*list = NULL;
+	if(!(f = fopen(path, "r")))
+	{
+		if(errno == ENOENT)
+		{
+			return 0;
+		}
+		context_msg(ctx, MSG_PERROR, "%s", path);
+		return -1;
+	}
+	tail = list;
+	buf = text = NULL;
+	bufsize = tl = 0;
+	while((r = getline(&buf, &bufsize, f)) >= 0)
+	{
+		if(!(p = realloc(text, tl + r + 1)))
+		{
+			context_msg(ctx, MSG_PERROR, "realloc()");
+			break;
+		}
+		text = p;
+		memcpy(text + tl, buf, r + 1);
+		tl += r;
+		if(!autoconf_cache_complete(text))
+		{
+			continue;
+		}
+		if(!(entry = (autoconf_entry_t *) calloc(1, sizeof(autoconf_entry_t))))
+		{
+			context_msg(ctx, MSG_PERROR, "calloc()");
+			break;
+		}
+		entry->text = text;
+		text = NULL;
+		tl = 0;
+		/* Cache variables are assignments at the start of a line */
+		for(l = 0; isalnum((unsigned char) entry->text[l]) || entry->text[l] == '_'; l++)
+		{
+		}
+		if(l && !isdigit((unsigned char) entry->text[0]) && entry->text[l] == '=')
+		{
+			entry->name = strndup(entry->text, l);
+		}
+		*tail = entry;
+		tail = &(entry->next);
+	}
+	/* Anything left over was never finished, and is discarded */
+	free(text);
+	free(buf);
+	if(ferror(f) || r >= 0)
+	{
+		fclose(f);
+		autoconf_cache_free(*list);
+		*list = NULL;
+		return -1;
+	}
+	fclose(f);
+	return 0;
+}
+
+/* Write a configure cache file, replacing it atomically */
+static int
+autoconf_cache_write(build_context_t *ctx, const char *path, autoconf_entry_t *list)
+{
+	char *tmp;
+	FILE *f;
+	int r;
+
+	if(!(tmp = malloc(strlen(path) + 32)))
+	{
+		context_msg(ctx, MSG_PERROR, "malloc(%u)", (unsigned) (strlen(path) + 32));
+		return -1;
+	}
+	sprintf(tmp, "%s.%ld.tmp", path, (long) getpid());
+	if(!(f = fopen(tmp, "w")))
+	{
+		context_msg(ctx, MSG_PERROR, "%s", tmp);
+		free(tmp);
+		return -1;
+	}
+	for(r = 0; list && r >= 0; list = list->next)
+	{
+		r = fputs(list->text, f);
+	}
+	if(fclose(f) || r < 0 || rename(tmp, path) < 0)
+	{
+		context_msg(ctx, MSG_PERROR, "%s", path);
+		unlink(tmp);
+		free(tmp);
+		return -1;
+	}
+	free(tmp);
+	return 0;
+}
+
+/* Seed the private cache used by this configure run from the shared
+ * cache (which might not exist yet).
+ */
+static int
+autoconf_cache_seed(build_context_t *ctx, const char *shared, const char *private)
+{
+	autoconf_entry_t *list;
+	char lock[1200];
+	int fd, r;
+
+	snprintf(lock, sizeof(lock), "%s.lock", shared);
+	if((fd = state_lock(ctx, lock, 0)) < 0)
+	{
+		return -1;
+	}
+	r = autoconf_cache_read(ctx, shared, &list);
+	state_unlock(fd);
+	if(r)
+	{
+		return -1;
+	}
+	if(mkdir(".build", 0777) < 0 && errno != EEXIST)
+	{
+		context_msg(ctx, MSG_PERROR, ".build");
+		autoconf_cache_free(list);
+		return -1;
+	}
+	r = autoconf_cache_write(ctx, private, list);
+	autoconf_cache_free(list);
+	return r;
+}
+
+/* Merge the results of a configure run back into the shared cache,
+ * entry by entry, replacing those already present where they are and
+ * adding the others at the end. Only cache variables (whose names
+ * contain '_cv_') are shared. The precious variables (ac_cv_env_*) are
+ * specific to the project and the environment it was configured in,
+ * and would cause other projects' configure scripts to complain, so
+ * they are never shared.
+ */
+static int
+autoconf_cache_merge(build_context_t *ctx, const char *shared, const char *private)
+{
+	autoconf_entry_t *list, *priv, *p, *q, **tail;
+	char lock[1200];
+	int fd, r;
+
+	snprintf(lock, sizeof(lock), "%s.lock", shared);
+	if((fd = state_lock(ctx, lock, 1)) < 0)
+	{
+		return -1;
+	}
+	if(autoconf_cache_read(ctx, shared, &list) || autoconf_cache_read(ctx, private, &priv))
+	{
+		state_unlock(fd);
+		autoconf_cache_free(list);
+		return -1;
+	}
+	while((p = priv))
+	{
+		priv = p->next;
+		p->next = NULL;
+		if(!p->name || !strstr(p->name, "_cv_") || !strncmp(p->name, "ac_cv_env_", 10))
+		{
+			autoconf_cache_free(p);
+			continue;
+		}
+		for(tail = &list; (q = *tail); tail = &(q->next))
+		{
+			if(q->name && !strcmp(q->name, p->name))
+			{
+				break;
+			}
+		}
+		if(q)
+		{
+			p->next = q->next;
+			q->next = NULL;
+			autoconf_cache_free(q);
+		}
+		*tail = p;
+	}
+	r = autoconf_cache_write(ctx, shared, list);
+	state_unlock(fd);
+	autoconf_cache_free(list);
+	return r;
+}
+
+/* Return the name of the state file which records the configure
+ * fingerprint; with --vpath, each build directory has its own
+ */
+static const char *
+autoconf_config_state(build_context_t *ctx)
+{
+	static char name[256];
+	const char *dir, *p;
+
+	if(!ctx->vpath || !(dir = context_objdir(ctx)))
+	{
+		return AUTOCONF_CONFIG_STATE;
+	}
+	p = ((p = strrchr(dir, '/')) ? p + 1 : dir);
+	snprintf(name, sizeof(name), "%s.%s", AUTOCONF_CONFIG_STATE, p);
+	return name;
+}
+
+/* Run configure, unless it's already been run in exactly the same way.
+ * With --vpath, this happens within the build directory, so that each
+ * configuration has its own cache file and fingerprint.
+ */
+static int
+autoconf_configure(build_context_t *ctx, cmd_t *cmd)
+{
+	int r;
+	build_defn_t *kv;
+	char fp[DIGEST_HEXLEN + 1];
+	const char *prev, *shared;
+	struct stat sbuf;
+
+	/* Each configure run has a private cache file, seeded from a cache
+	 * shared by all projects built with the same toolchain.
+	 */
+	shared = NULL;
+	if(!ctx->nocache && (shared = autoconf_cache_path(ctx)))
+	{
+		cmd_arg_add(cmd, "--cache-file=.build/config.cache");
+	}
+	/* If we're configuring as a prerequisite of a later phase, and
+	 * configure has already been run in exactly the same way, there's
+	 * no need to run it again.
+	 */
+	fp[0] = 0;
+	/* Before 'prepare' has been performed (which, in a dry run, it
+	 * won't have been), there's no configure script to fingerprint
+	 */
+	if(!access(cmd->argv[1], F_OK) && autoconf_fingerprint(ctx, cmd, fp) && !ctx->dryrun)
+	{
+		return -1;
+	}
+	kv = state_load(ctx, autoconf_config_state(ctx));
+	if(ctx->isauto && fp[0] && (prev = state_get(kv, "fingerprint")) && !strcmp(prev, fp) &&
+	   !stat("config.status", &sbuf) && !stat("Makefile", &sbuf))
+	{
+		context_msg(ctx, MSG_INFO, "configuration is up to date\n");
+		state_free(kv);
+		return -255;
+	}
+	state_free(kv);
+	kv = NULL;
+	/* Forget the old fingerprint before running configure, so that an
+	 * interrupted run isn't mistaken for a complete one.
+	 */
+	if(!ctx->dryrun)
+	{
+		state_remove(ctx, autoconf_config_state(ctx));
+		if(shared && autoconf_cache_seed(ctx, shared, ".build/config.cache"))
+		{
+			return -1;
+		}
+	}
+	r = cmd_spawn(cmd, 0);
+	if(!r && shared && !ctx->dryrun)
+	{
+		context_msg(ctx, MSG_INFO, "updating shared configure cache %s\n", shared);
+		autoconf_cache_merge(ctx, shared, ".build/config.cache");
+	}
+	if(!r && fp[0])
+	{
+		state_set(ctx, &kv, "fingerprint", fp);
+		state_save(ctx, autoconf_config_state(ctx), kv);
+		state_free(kv);
+	}
+	return r;
+}
+
 int
 autoconf_config(build_context_t *ctx)
 {
 	int r;
 	cmd_t *cmd;
 	build_defn_t *p;
+	char srcdir[4096], *cwd;
+	struct stat sbuf;
 
-	/* If auto mode, we should only re-run configure if it's newer
-	 * than our makefile.
-	 */
 	cmd = context_cmd_create(ctx, "/bin/sh", NULL, NULL);
-	if(ctx->project)
+	if(ctx->vpath)
+	{
+		/* configure is run from the build directory, so it must be
+		 * invoked by an absolute path, from which it determines srcdir
+		 */
+		if(!(cwd = getcwd(NULL, 0)))
+		{
+			context_msg(ctx, MSG_PERROR, "getcwd()");
+			cmd_destroy(cmd);
+			return -1;
+		}
+		if(ctx->project && ctx->project[0] == '/')
+		{
+			snprintf(srcdir, sizeof(srcdir), "%s", ctx->project);
+		}
+		else if(ctx->project)
+		{
+			snprintf(srcdir, sizeof(srcdir), "%s/%s", cwd, ctx->project);
+		}
+		else
+		{
+			snprintf(srcdir, sizeof(srcdir), "%s", cwd);
+		}
+		free(cwd);
+		cmd_arg_addf(cmd, "%s/configure", srcdir);
+		/* configure refuses to build out of tree once the source tree has
+		 * been configured in place
+		 */
+		strncat(srcdir, "/config.status", sizeof(srcdir) - strlen(srcdir) - 1);
+		if(!stat(srcdir, &sbuf))
+		{
+			context_msg(ctx, MSG_FATAL, "the source tree has been configured in place; run '%s distclean' without --vpath first.  Stop.\n", ctx->progname);
+			cmd_destroy(cmd);
+			return -1;
+		}
+	}
+	else if(ctx->project)
 	{
 		cmd_arg_addf(cmd, "%s/configure", ctx->project);
 	}
@@ -333,14 +942,53 @@ autoconf_config(build_context_t *ctx)
 	{
 		cmd_arg_addf(cmd, "LIBS=%s", p->value);
 	}
-
-	r = cmd_spawn(cmd, 0);
+	if(context_objdir_enter(ctx))
+	{
+		cmd_destroy(cmd);
+		return -1;
+	}
+	r = autoconf_configure(ctx, cmd);
+	if(ctx->vpath)
+	{
+		context_returnwd(ctx);
+	}
 	cmd_destroy(cmd);
 	return r;
 }
 
+/* Perform a phase within the build directory, with --vpath */
+static int
+autoconf_objdir(build_context_t *ctx, int (*fn)(build_context_t *))
+{
+	int r;
+
+	if(!ctx->vpath)
+	{
+		return fn(ctx);
+	}
+	if(context_objdir_enter(ctx))
+	{
+		return -1;
+	}
+	r = fn(ctx);
+	context_returnwd(ctx);
+	return r;
+}
+
 int
-autoconf_install(build_context_t *ctx)
+autoconf_build(build_context_t *ctx)
+{
+	return autoconf_objdir(ctx, gnumake_build);
+}
+
+int
+autoconf_clean(build_context_t *ctx)
+{
+	return autoconf_objdir(ctx, gnumake_clean);
+}
+
+static int
+autoconf_install_here(build_context_t *ctx)
 {
 	int r;
 	cmd_t *cmd;
@@ -361,9 +1009,14 @@ autoconf_install(build_context_t *ctx)
 	return r;
 }
 
-	
 int
-autoconf_distclean(build_context_t *ctx)
+autoconf_install(build_context_t *ctx)
+{
+	return autoconf_objdir(ctx, autoconf_install_here);
+}
+
+static int
+autoconf_distclean_here(build_context_t *ctx)
 {
 	cmd_t *cmd;
 	int r;
@@ -376,6 +1029,36 @@ autoconf_distclean(build_context_t *ctx)
 	cmd_arg_add(cmd, "distclean");
 	r = cmd_spawn(cmd, ctx->isauto);
 	cmd_destroy(cmd);
+	state_remove(ctx, autoconf_config_state(ctx));
+	return r;
+}
+
+int
+autoconf_distclean(build_context_t *ctx)
+{
+	return autoconf_objdir(ctx, autoconf_distclean_here);
+}
+
+/* The products are those of the generated Makefile, which is in the
+ * build directory with --vpath
+ */
+int
+autoconf_products(build_context_t *ctx, int run, build_defn_t **products)
+{
+	int r;
+
+	if(!ctx->vpath)
+	{
+		return gnumake_products(ctx, run, products);
+	}
+	*products = NULL;
+	if(!context_objdir(ctx) || chdir(context_objdir(ctx)) < 0)
+	{
+		/* Not configured yet */
+		return 1;
+	}
+	r = gnumake_products(ctx, run, products);
+	context_returnwd(ctx);
 	return r;
 }
 
@@ -385,8 +1068,9 @@ build_handler_t autoconf_handler = {
 	autoconf_detect,
 	autoconf_prepare,
 	autoconf_config,
-	gnumake_build,
+	autoconf_build,
 	autoconf_install,
-	gnumake_clean,
-	autoconf_distclean
+	autoconf_clean,
+	autoconf_distclean,
+	autoconf_products
 };
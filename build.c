@@ -17,11 +17,40 @@
 # include "config.h"
 #endif
 
+#include <ctype.h>
+
 #include "p_build.h"
 
 int makelevel;
 
 static const char *progname;
+static const char **wspaths;
+static size_t nwspaths;
+static int daemonmode;
+static int workermode;
+static int batchmode;
+static const char *batchpath;
+static const char *workerpath;
+static int listproducts;
+static const char *listprefix;
+
+enum
+{
+	OPT_NOCACHE = 256,
+	OPT_DAEMON,
+	OPT_NODAEMON,
+	OPT_STATS,
+	OPT_TRACE,
+	OPT_TAIL,
+	OPT_LOG,
+	OPT_WORKER,
+	OPT_SYNC,
+	OPT_BATCH,
+	OPT_OUTPUTCACHE,
+	OPT_FORMAT,
+	OPT_VPATH,
+	OPT_LISTPRODUCTS
+};
 
 static struct option longopts[] = {
 	{ "dir", required_argument, NULL, 'C' },
@@ -35,6 +64,22 @@ static struct option longopts[] = {
 	{ "only", no_argument, NULL, 'O' },
 	{ "dry-run", no_argument, NULL, 'N' },
 	{ "at", required_argument, NULL, 'r' },
+	{ "jobs", required_argument, NULL, 'j' },
+	{ "workspace", required_argument, NULL, 'w' },
+	{ "no-cache", no_argument, NULL, OPT_NOCACHE },
+	{ "daemon", no_argument, NULL, OPT_DAEMON },
+	{ "no-daemon", no_argument, NULL, OPT_NODAEMON },
+	{ "stats", required_argument, NULL, OPT_STATS },
+	{ "trace", required_argument, NULL, OPT_TRACE },
+	{ "tail", required_argument, NULL, OPT_TAIL },
+	{ "log", required_argument, NULL, OPT_LOG },
+	{ "worker", optional_argument, NULL, OPT_WORKER },
+	{ "sync", no_argument, NULL, OPT_SYNC },
+	{ "batch", optional_argument, NULL, OPT_BATCH },
+	{ "output-cache", no_argument, NULL, OPT_OUTPUTCACHE },
+	{ "vpath", no_argument, NULL, OPT_VPATH },
+	{ "format", required_argument, NULL, OPT_FORMAT },
+	{ "list-products", optional_argument, NULL, OPT_LISTPRODUCTS },
 	{ "verbose", no_argument, NULL, 'v' },
 	{ "quiet", no_argument, NULL, 'q' },
 	{ "help", no_argument, NULL, 'h' },
@@ -52,17 +97,39 @@ usage(void)
 			"      [-pPATH|--project=PATH]       Specify path to a project file or directory\n"
 			"      [-PNAME|--product=NAME]       Build the named product NAME\n"
 			"      [-BTRIPLET|--build=TRIPLET]   Set the build system type to TRIPLET\n"
-			"      [-HTRIPLET|--host=TRIPLET]    Set the host system type to TRIPLET\n"
+			"      [-HTRIPLET|--host=TRIPLET]    Set the host system type to TRIPLET (or\n"
+			"                                    build for each of a comma-separated list)\n"
 			"      [-TTRIPLET|--target=TRIPLET]  Set the target system type to TRIPLET\n"
 			"      [-cNAME|--config=NAME]        Build using the configuration named NAME\n"
+			"                                    (or each of a comma-separated list)\n"
 			"      [-sPATH|--sdk=PATH]           Build using the SDK found at PATH\n"
+			"      [--vpath]                     Configure and build outside of the source\n"
+			"                                    tree, in a directory per configuration\n"
+			"      [--list-products[=PREFIX]]    List the products which can be built (or\n"
+			"                                    those beginning with PREFIX)\n"
 			"      [-DVAR[=VALUE]]               Define the variable VAR (optionally to VALUE)\n"
 			"      [-O|--only]                   Do not attempt prerequisite build phases\n"
 			"      [-N|--dry-run]                Don't actually execute anything\n"
+			"      [--format=json]               With --dry-run, write the plan to standard\n"
+			"                                    output as JSON\n"
 			"      [-r[USER@]HOST|--at=[USER@]HOST]\n"
 			"                                    Invoke %s on a remote host\n"
+			"      [--sync]                      Copy the tree to the remote host first\n"
+			"      [-jN|--jobs=N]                Run up to N jobs at once\n"
+			"      [-wPATH|--workspace=PATH]     Add a project directory, or a manifest\n"
+			"                                    listing projects, to the workspace\n"
+			"      [--batch[=FILE]]              Run the jobs listed in FILE (or read from\n"
+			"                                    standard input)\n"
+			"      [--no-cache]                  Don't use or update shared caches\n"
+			"      [--output-cache]              Reuse the results of identical builds\n"
+			"      [--no-daemon]                 Don't pass the request to a build daemon\n"
+			"      [--stats=FILE]                Append resource usage by phase to FILE\n"
+			"      [--trace=FILE]                Write a trace of phases and commands to FILE\n"
+			"      [--log=FILE]                  Also write the output of commands to FILE\n"
 			"      [-v|--verbose]                Print information about actions\n"
 			"      [-q|--quiet]                  Be as quiet as possible\n"
+			"      [--tail=KIB]                  In quiet mode, show up to KIB kilobytes\n"
+			"                                    of the output of a failed command\n"
 			"      [PHASE]                       Specify the build phase PHASE\n"
 			"      [VAR=VALUE] ...               Define the variable VAR to VALUE\n"
 			"\n"
@@ -70,6 +137,13 @@ usage(void)
 			"\n"
 			"%s --version|-V                  Show version information\n"
 			"\n"
+			"%s --daemon                      Run a build daemon\n"
+			"%s --worker[=PATH]               Run requests for remote clients, from\n"
+			"                                    standard input or on the socket PATH\n"
+			"\n"
+			"%s [OPTIONS] watch [PHASE] ...   Perform the phases again whenever the\n"
+			"                                    project changes\n"
+			"\n"
 			"PHASE is one of:\n"
 			"      prepare                       Prepare the project for building\n"
 			"                                    (e.g., run autoconf, automake, etc.)\n"
@@ -78,7 +152,7 @@ usage(void)
 			"      install                       Install the built project\n"
 			"      clean                         Remove 'build' output\n"
 			"      distclean                     Remove 'build' and 'config' output\n",
-			progname, progname, progname, progname);
+			progname, progname, progname, progname, progname, progname, progname);
 	fprintf(stderr, "\nAvailable handlers:\n\n");
 	context_handler_list(stderr);
 	fprintf(stderr, "\n");
@@ -107,10 +181,21 @@ parse_options(int argc, char **argv, build_context_t *context)
 		NULL
 	};
 	int r, c, match, idx;
+	unsigned long kib;
 	char *p;
 	
+	/* Requests serviced by a daemon are parsed in a fork of it */
+	wspaths = NULL;
+	nwspaths = 0;
+	daemonmode = 0;
+	workermode = 0;
+	batchmode = 0;
+	batchpath = NULL;
+	workerpath = NULL;
+	listproducts = 0;
+	listprefix = NULL;
 	opterr = 0;
-	while((r = getopt_long(argc, argv, "hVONrvqD:C:P:B:H:T:c:s:", longopts, &idx)) != EOF)
+	while((r = getopt_long(argc, argv, "hVONr:vqD:C:P:B:H:T:c:s:j:w:", longopts, &idx)) != EOF)
 	{
 		switch(r)
 		{
@@ -150,11 +235,91 @@ parse_options(int argc, char **argv, build_context_t *context)
 		case 'r':
 			context->remote = optarg;
 			break;
+		case 'j':
+			if((context->jobs = atoi(optarg)) < 1)
+			{
+				fprintf(stderr, "%s: invalid job count `%s'\n", context->progname, optarg);
+				exit(EXIT_FAILURE);
+			}
+			break;
+		case 'w':
+			if(!(wspaths = realloc(wspaths, sizeof(char *) * (nwspaths + 1))))
+			{
+				context_msg(context, MSG_PERROR, "realloc(..., %u)", (unsigned) (sizeof(char *) * (nwspaths + 1)));
+				exit(EXIT_FAILURE);
+			}
+			wspaths[nwspaths] = optarg;
+			nwspaths++;
+			break;
 		case 'N':
 			context->dryrun = 1;
 			context->verbose = 1;
 			context->quiet = 0;
 			break;
+		case OPT_NOCACHE:
+			context->nocache = 1;
+			break;
+		case OPT_DAEMON:
+			daemonmode = 1;
+			break;
+		case OPT_NODAEMON:
+			daemonmode = -1;
+			break;
+		case OPT_STATS:
+			context->statsfile = optarg;
+			break;
+		case OPT_TRACE:
+			context->tracefile = optarg;
+			break;
+		case OPT_TAIL:
+			errno = 0;
+			kib = strtoul(optarg, &p, 10);
+			if(!isdigit((unsigned char) optarg[0]) || *p || errno || kib < 1 || kib > BUILD_TAIL_MAX / 1024)
+			{
+				fprintf(stderr, "%s: invalid output size `%s' (must be between 1 and %d)\n", context->progname, optarg, BUILD_TAIL_MAX / 1024);
+				exit(EXIT_FAILURE);
+			}
+			context->tail = (size_t) kib * 1024;
+			break;
+		case OPT_WORKER:
+			workermode = 1;
+			workerpath = optarg;
+			break;
+		case OPT_OUTPUTCACHE:
+			context->outputcache = 1;
+			break;
+		case OPT_VPATH:
+			context->vpath = 1;
+			break;
+		case OPT_LISTPRODUCTS:
+			listproducts = 1;
+			listprefix = optarg;
+			break;
+		case OPT_FORMAT:
+			if(!strcmp(optarg, "text"))
+			{
+				context->format = FORMAT_TEXT;
+			}
+			else if(!strcmp(optarg, "json"))
+			{
+				context->format = FORMAT_JSON;
+			}
+			else
+			{
+				fprintf(stderr, "%s: unrecognized output format `%s'\n", context->progname, optarg);
+				exit(EXIT_FAILURE);
+			}
+			break;
+		case OPT_BATCH:
+			batchmode = 1;
+			batchpath = (optarg ? optarg : "-");
+			break;
+		case OPT_SYNC:
+			context->sync = 1;
+			break;
+		case OPT_LOG:
+			context->logfile = optarg;
+			break;
 		case 'v':
 			context->verbose = 1;
 			context->quiet = 0;
@@ -231,95 +396,263 @@ parse_options(int argc, char **argv, build_context_t *context)
 			*p = 0;
 			p++;
 			context_defn_add(context, argv[c], p);
-			*p = '=';
+			p[-1] = '=';
 		}
 	}		
 }
 
-int
-main(int argc, char **argv)
+static build_phase_t
+parse_phase(build_context_t *context, const char *name)
 {
-	char *t, buf[64];
-	build_context_t context;
-	int r, here;
+	static const char *names[] = { "distclean", "clean", "prepare", "config", "build", "install", NULL };
+	size_t c;
 
-	if((t = strrchr(argv[0], '/')))
+	for(c = 0; names[c]; c++)
 	{
-		progname = t + 1;
+		if(!strcmp(name, names[c]))
+		{
+			return (build_phase_t) c;
+		}
 	}
-	else
+	context_msg(context, MSG_FATAL, "unrecognized build phase `%s'\n", name);
+	exit(EXIT_FAILURE);
+}
+
+/* Export path (made absolute) to nested invocations via the environment
+ * variable name or, if path is NULL, return the value inherited from our
+ * parent.
+ */
+static const char *
+inherit_path(build_context_t *context, const char *path, const char *name)
+{
+	char *cwd, *p;
+
+	if(!path)
 	{
-		progname = t;
+		return ((path = getenv(name)) && path[0] ? path : NULL);
 	}
+	if(path[0] != '/' && (cwd = getcwd(NULL, 0)))
+	{
+		if(!(p = malloc(strlen(cwd) + strlen(path) + 2)))
+		{
+			context_msg(context, MSG_PERROR, "malloc(%u)", (unsigned) (strlen(cwd) + strlen(path) + 2));
+			exit(EXIT_FAILURE);
+		}
+		sprintf(p, "%s/%s", cwd, path);
+		free(cwd);
+		path = p;
+	}
+	setenv(name, path, 1);
+	return path;
+}
+
+static int
+build_main(int argc, char **argv)
+{
+	char *t, buf[64], **args;
+	build_context_t context;
+	build_phase_t *phases;
+	build_workspace_t *workspace;
+	size_t nphases, c;
+	int here, r, watch, matrix;
+
 	memset(&context, 0, sizeof(build_context_t));
 	context.progname = progname;
+	context.tail = BUILD_TAIL_DEFAULT;
+	context.logfd = -1;
 	if((t = getenv("MAKELEVEL")))
 	{
 		context.level = atoi(t);
 	}
-	sprintf(buf, "%d", context.level + 1);
-	setenv("MAKELEVEL", buf, 1);
-	parse_options(argc, argv, &context);
-	if((here = context_chdir(&context)) < 0)
+	/* Option parsing rearranges and modifies the arguments, so keep a
+	 * copy of them in case they need to be passed to a daemon.
+	 */
+	if(!(args = calloc(argc + 1, sizeof(char *))))
 	{
+		context_msg(&context, MSG_PERROR, "calloc(%u, %u)", (unsigned) (argc + 1), (unsigned) sizeof(char *));
 		exit(EXIT_FAILURE);
 	}
-	if(context.project)
+	memcpy(args, argv, sizeof(char *) * argc);
+	for(c = 0; c < (size_t) argc; c++)
 	{
-		if(stat(context.project, &context.sbuf) < 0)
+		if(!(args[c] = strdup(argv[c])))
 		{
-			fprintf(stderr, "%s: %s: %s\n", progname, context.project, strerror(errno));
+			context_msg(&context, MSG_PERROR, "strdup(...[%u])", (unsigned) strlen(argv[c]));
 			exit(EXIT_FAILURE);
 		}
 	}
-	if(NULL == context_detect(&context))
+	parse_options(argc, argv, &context);
+	if(daemonmode > 0)
 	{
-		context_msg(&context, MSG_FATAL, "No suitable project file or directory could be found.  Stop.\n");
+		return daemon_serve(&context, build_main);
+	}
+	if(workermode)
+	{
+		return remote_worker(&context, workerpath, build_main);
+	}
+	/* A worker runs requests with the client's arguments, --at included */
+	if(context.remote && !remote_active())
+	{
+		return remote_client(&context, argc, args);
+	}
+	if(!daemonmode && !context.level && !daemon_active())
+	{
+		if((r = daemon_client(&context, argc, args)) >= 0)
+		{
+			return r;
+		}
+	}
+	sprintf(buf, "%d", context.level + 1);
+	setenv("MAKELEVEL", buf, 1);
+	/* Nested invocations append to the same statistics and trace files */
+	context.statsfile = inherit_path(&context, context.statsfile, "BUILD_STATS");
+	if(context.tracefile)
+	{
+		context.tracefile = inherit_path(&context, context.tracefile, "BUILD_TRACE");
+		trace_init(&context, 1);
+	}
+	else if((context.tracefile = inherit_path(&context, NULL, "BUILD_TRACE")))
+	{
+		trace_init(&context, 0);
+	}
+	/* The log isn't passed on to nested invocations, whose output
+	 * reaches it anyway by way of the command which invoked them. It
+	 * isn't opened for appending, because splice() won't write to files
+	 * which are.
+	 */
+	if(context.logfile && (context.logfd = open(context.logfile, O_WRONLY|O_CREAT|O_TRUNC, 0666)) < 0)
+	{
+		context_msg(&context, MSG_PERROR, "%s", context.logfile);
 		exit(EXIT_FAILURE);
 	}
-	if(optind >= argc)
+	if(context.logfd >= 0)
 	{
-		return context_build(&context, PH_BUILD, 0);
+		fcntl(context.logfd, F_SETFD, fcntl(context.logfd, F_GETFD) | FD_CLOEXEC);
+	}
+	if(!(phases = calloc(argc + 1, sizeof(build_phase_t))))
+	{
+		context_msg(&context, MSG_PERROR, "calloc(%u, %u)", (unsigned) (argc + 1), (unsigned) sizeof(build_phase_t));
+		exit(EXIT_FAILURE);
 	}
-	for(; optind < argc; optind++)
+	watch = 0;
+	for(nphases = 0; optind < argc; optind++)
 	{
 		if(!strcmp(argv[optind], "-" ) || !strcmp(argv[optind], "--") || strchr(argv[optind], '='))
 		{
 			continue;
 		}
-		if(!strcmp(argv[optind], "prepare"))
-		{
-			r = context_build(&context, PH_PREPARE, 0);
-		}
-		else if(!strcmp(argv[optind], "config"))
-		{
-			r = context_build(&context, PH_CONFIG, 0);
-		}
-		else if(!strcmp(argv[optind], "build"))
+		if(!nphases && !watch && !strcmp(argv[optind], "watch"))
 		{
-			r = context_build(&context, PH_BUILD, 0);
+			watch = 1;
+			continue;
 		}
-		else if(!strcmp(argv[optind], "install"))
+		phases[nphases] = parse_phase(&context, argv[optind]);
+		nphases++;
+	}
+	if(!nphases)
+	{
+		phases[0] = PH_BUILD;
+		nphases = 1;
+	}
+	if((here = context_chdir(&context)) < 0)
+	{
+		exit(EXIT_FAILURE);
+	}
+	jobserver_init(&context);
+	if(watch && (nwspaths || batchmode))
+	{
+		context_msg(&context, MSG_FATAL, "watch mode can't be used with a workspace or batch.  Stop.\n");
+		exit(EXIT_FAILURE);
+	}
+	/* Comma-separated lists of host triplets or configurations make a
+	 * matrix of combinations, each of which is built
+	 */
+	matrix = ((context.host && strchr(context.host, ',')) || (context.config && strchr(context.config, ',')));
+	if(context.format == FORMAT_JSON && (!context.dryrun || watch || nwspaths || batchmode || matrix))
+	{
+		context_msg(&context, MSG_FATAL, "--format=json may only be used with --dry-run, for a single project.  Stop.\n");
+		exit(EXIT_FAILURE);
+	}
+	if(matrix && (watch || nwspaths || batchmode))
+	{
+		context_msg(&context, MSG_FATAL, "lists of host triplets or configurations can't be used with watch mode, a workspace or batch.  Stop.\n");
+		exit(EXIT_FAILURE);
+	}
+	if(listproducts && (watch || nwspaths || batchmode || matrix || context.format == FORMAT_JSON))
+	{
+		context_msg(&context, MSG_FATAL, "--list-products may only be used for a single project and configuration.  Stop.\n");
+		exit(EXIT_FAILURE);
+	}
+	if(nwspaths || batchmode)
+	{
+		/* Workspace members are relative to --dir, in the same way as
+		 * --project is.
+		 */
+		if(!(workspace = workspace_create(&context)))
 		{
-			r = context_build(&context, PH_INSTALL, 0);
+			exit(EXIT_FAILURE);
 		}
-		else if(!strcmp(argv[optind], "clean"))
+		for(c = 0; c < nwspaths; c++)
 		{
-			r = context_build(&context, PH_CLEAN, 0);
+			if(workspace_add(workspace, wspaths[c]))
+			{
+				exit(EXIT_FAILURE);
+			}
 		}
-		else if(!strcmp(argv[optind], "distclean"))
+		if(batchmode && workspace_batch(workspace, batchpath))
 		{
-			r = context_build(&context, PH_DISTCLEAN, 0);
+			exit(EXIT_FAILURE);
 		}
-		else
+		/* Each project starts out with what's already known about
+		 * detection, rather than loading it for itself
+		 */
+		context_cache_load(&context);
+		return workspace_run(workspace, phases, nphases);
+	}
+	if(context.project)
+	{
+		if(stat(context.project, &context.sbuf) < 0)
 		{
-			context_msg(&context, MSG_FATAL, "unrecognized build phase `%s'\n", argv[optind]);
+			fprintf(stderr, "%s: %s: %s\n", progname, context.project, strerror(errno));
 			exit(EXIT_FAILURE);
 		}
-		if(r)
+	}
+	if(NULL == context_detect(&context))
+	{
+		context_msg(&context, MSG_FATAL, "No suitable project file or directory could be found.  Stop.\n");
+		exit(EXIT_FAILURE);
+	}
+	if(listproducts)
+	{
+		return products_list(&context, listprefix);
+	}
+	if(watch)
+	{
+		return watch_run(&context, phases, nphases);
+	}
+	if(matrix)
+	{
+		if(!(workspace = workspace_create(&context)) || workspace_matrix(workspace, phases, nphases))
 		{
-			return (r < 0 ? 1 : r);
+			exit(EXIT_FAILURE);
 		}
+		return workspace_run(workspace, phases, nphases);
+	}
+	return context_run(&context, phases, nphases);
+}
+
+int
+main(int argc, char **argv)
+{
+	char *t;
+
+	if((t = strrchr(argv[0], '/')))
+	{
+		progname = t + 1;
+	}
+	else
+	{
+		progname = argv[0];
 	}
-	return 0;
+	return build_main(argc, argv);
 }
@@ -91,110 +91,640 @@ context_msg(build_context_t *ctx, int verbosity, const char *fmt, ...)
 	return r;
 }
 
+const char *
+context_phase_name(build_phase_t phase)
+{
+	static const char *phases[] = { "distclean", "clean", "prepare", "config", "build", "install" };
+
+	return phases[phase];
+}
+
+/* Determine the earliest phase which a change to the file at path
+ * (relative to the top of the project) can affect: the inputs to
+ * autoconf and aclocal affect 'prepare', those to automake and other
+ * templates affect 'config', and anything else affects 'build'.
+ */
+build_phase_t
+context_path_phase(const char *path)
+{
+	static const char *prepare[] = { "configure.ac", "configure.in", "aclocal.m4", "acinclude.m4", "autogen.sh", NULL };
+	const char *base;
+	size_t c, l;
+
+	base = ((base = strrchr(path, '/')) ? base + 1 : path);
+	if(!strncmp(path, "m4/", 3))
+	{
+		return PH_PREPARE;
+	}
+	for(c = 0; prepare[c]; c++)
+	{
+		if(!strcmp(base, prepare[c]))
+		{
+			return PH_PREPARE;
+		}
+	}
+	l = strlen(base);
+	if(!strcmp(base, "Makefile.am") || !strcmp(base, "configure") || (l > 3 && !strcmp(base + l - 3, ".in")))
+	{
+		return PH_CONFIG;
+	}
+	return PH_BUILD;
+}
+
+/* Decide whether a prerequisite of a later phase needs to be performed,
+ * given whether it already has been by this process
+ */
+static int
+context_prereq(build_context_t *ctx, build_phase_t phase, int done)
+{
+	if(ctx->only)
+	{
+		plan_phase(ctx, phase, 0, "prerequisites are skipped with --only");
+		return 0;
+	}
+	if(done)
+	{
+		return 0;
+	}
+	if(ctx->completed & (1 << phase))
+	{
+		plan_phase(ctx, phase, 0, "completed by an earlier invocation, and its inputs haven't changed");
+		return 0;
+	}
+	return 1;
+}
+
+/* Decide whether the handler should be asked to perform a phase */
+static int
+context_perform(build_context_t *ctx, build_phase_t phase, int done, int (*fn)(build_context_t *))
+{
+	if(done)
+	{
+		plan_phase(ctx, phase, 0, "already performed");
+		return 0;
+	}
+	if(!fn)
+	{
+		plan_phase(ctx, phase, 0, "not supported by the handler");
+		return 0;
+	}
+	plan_phase(ctx, phase, 1, (ctx->isauto ? "required by a later phase" : "requested"));
+	return 1;
+}
+
+static long long context_began;
+static unsigned long context_ncmds;
+
+/* Called immediately before and after the handler performs a phase */
+static void
+context_phase_begin(build_context_t *ctx, build_phase_t phase)
+{
+	ctx->phase = phase;
+	phases_begin(ctx, phase);
+	context_began = trace_now();
+	context_ncmds = ctx->stats[phase].ncmds;
+}
+
+static void
+context_phase_end(build_context_t *ctx, build_phase_t phase, int r)
+{
+	/* Only time phases which actually ran something: one which had
+	 * nothing to do, or whose outputs were restored from the object
+	 * cache, says nothing about how long it takes
+	 */
+	if(!r && ctx->stats[phase].ncmds > context_ncmds)
+	{
+		timing_record(ctx, timing_phasekey(ctx, phase), trace_now() - context_began);
+	}
+	phases_end(ctx, phase, r);
+}
+
 int
 context_build(build_context_t *ctx, build_phase_t phase, int isauto)
 {
-	static const char *phases[] = { "distclean", "clean", "prepare", "config", "build", "install" };
+	build_phase_t wasphase;
 	int wasauto, r, s;
+	long long start;
 
+	start = trace_now();
 	wasauto = ctx->isauto;
+	wasphase = ctx->phase;
 	ctx->isauto = isauto;
-	context_msg(ctx, (ctx->isauto ? MSG_INFO : MSG_ECHO), "beginning phase '%s'.\n", phases[phase]);
+	context_msg(ctx, (ctx->isauto ? MSG_INFO : MSG_ECHO), "beginning phase '%s'.\n", context_phase_name(phase));
 	r = -255;
 	switch(phase)
 	{
 	case PH_DISTCLEAN:
-		if(ctx->vt->distclean)
+		if(context_perform(ctx, phase, 0, ctx->vt->distclean))
 		{
+			context_phase_begin(ctx, phase);
 			r = ctx->vt->distclean(ctx);
+			context_phase_end(ctx, phase, r);
 		}
 		ctx->configured = ctx->built = ctx->installed = 0;
+		ctx->completed &= ~((1 << PH_CONFIG) | (1 << PH_BUILD) | (1 << PH_INSTALL));
+		phases_clear(ctx, PH_CONFIG);
 		break;
 	case PH_CLEAN:
-		if(ctx->vt->clean)
+		if(context_perform(ctx, phase, 0, ctx->vt->clean))
 		{
+			context_phase_begin(ctx, phase);
 			r = ctx->vt->clean(ctx);
+			context_phase_end(ctx, phase, r);
 		}
 		ctx->built = ctx->installed = 0;
+		ctx->completed &= ~((1 << PH_BUILD) | (1 << PH_INSTALL));
+		phases_clear(ctx, PH_BUILD);
 		break;
 	case PH_PREPARE:
-		if(!ctx->prepared && ctx->vt->prepare)
+		if(context_perform(ctx, phase, ctx->prepared, ctx->vt->prepare))
 		{
+			context_phase_begin(ctx, phase);
 			r = ctx->vt->prepare(ctx);
+			context_phase_end(ctx, phase, r);
 		}
 		ctx->prepared = 1;
 		break;
 	case PH_CONFIG:
-		if(!ctx->only && !ctx->prepared)
+		if(context_prereq(ctx, PH_PREPARE, ctx->prepared))
 		{
 			if((s = context_build(ctx, PH_PREPARE, 1)))
 			{
 				ctx->isauto = wasauto;
+				trace_event(ctx, "phase", context_phase_name(phase), start, trace_now(), NULL, s);
 				return s;
 			}
 		}
-		if(!ctx->configured && ctx->vt->config)
+		if(context_perform(ctx, phase, ctx->configured, ctx->vt->config))
 		{
+			context_phase_begin(ctx, phase);
 			r = ctx->vt->config(ctx);
+			context_phase_end(ctx, phase, r);
 		}
 		ctx->configured = 1;
 		break;
 	case PH_BUILD:
-		if(!ctx->only && !ctx->configured)
+		if(context_prereq(ctx, PH_CONFIG, ctx->configured))
 		{
 			if((s = context_build(ctx, PH_CONFIG, 1)))
 			{
 				ctx->isauto = wasauto;
+				trace_event(ctx, "phase", context_phase_name(phase), start, trace_now(), NULL, s);
 				return s;
 			}
 		}
-		if(!ctx->built && ctx->vt->build)
+		if(context_perform(ctx, phase, ctx->built, ctx->vt->build))
 		{
-			r = ctx->vt->build(ctx);
+			/* There may have been no makefile to ask until now */
+			if(products_check(ctx))
+			{
+				ctx->isauto = wasauto;
+				trace_event(ctx, "phase", context_phase_name(phase), start, trace_now(), NULL, -1);
+				return -1;
+			}
+			context_phase_begin(ctx, phase);
+			if(objects_restore(ctx, phase))
+			{
+				r = 0;
+			}
+			else if(!(r = ctx->vt->build(ctx)))
+			{
+				objects_save(ctx, phase);
+			}
+			context_phase_end(ctx, phase, r);
 		}
 		ctx->built = 1;
 		break;
 	case PH_INSTALL:
-		if(!ctx->only && !ctx->built)
+		if(context_prereq(ctx, PH_BUILD, ctx->built))
 		{
 			if((s = context_build(ctx, PH_BUILD, 1)))
 			{
 				ctx->isauto = wasauto;
+				trace_event(ctx, "phase", context_phase_name(phase), start, trace_now(), NULL, s);
 				return s;
 			}
 		}
-		if(!ctx->installed && ctx->vt->install)
+		if(context_perform(ctx, phase, ctx->installed, ctx->vt->install))
 		{
-			r = ctx->vt->install(ctx);
+			context_phase_begin(ctx, phase);
+			if(objects_restore(ctx, phase))
+			{
+				r = 0;
+			}
+			else if(!(r = ctx->vt->install(ctx)))
+			{
+				objects_save(ctx, phase);
+			}
+			context_phase_end(ctx, phase, r);
 		}
 		ctx->installed = 1;
 		break;
 	}
 	if(r == -255)
 	{
-		context_msg(ctx, (ctx->isauto ? MSG_INFO : MSG_ECHO), "nothing to be done for phase '%s'.\n", phases[phase]);
+		context_msg(ctx, (ctx->isauto ? MSG_INFO : MSG_ECHO), "nothing to be done for phase '%s'.\n", context_phase_name(phase));
 		r = 0;
 	}
 	ctx->isauto = wasauto;
+	ctx->phase = wasphase;
+	trace_event(ctx, "phase", context_phase_name(phase), start, trace_now(), NULL, r);
+	return r;
+}
+
+/* Execute each of the requested phases in turn, stopping at the first
+ * failure.
+ */
+int
+context_run(build_context_t *ctx, const build_phase_t *phases, size_t nphases)
+{
+	size_t c;
+	int r;
+	long long start;
+
+	r = 0;
+	start = trace_now();
+	if(ctx->vpath && ctx->vt != &autoconf_handler)
+	{
+		context_msg(ctx, MSG_ERROR, "warning: --vpath is ignored by the '%s' handler\n", ctx->vt->name);
+	}
+	phases_load(ctx);
+	/* A product which doesn't exist should be reported before anything
+	 * is done, rather than after make has started
+	 */
+	if(products_check(ctx))
+	{
+		r = -1;
+		nphases = 0;
+	}
+	for(c = 0; c < nphases; c++)
+	{
+		if((r = context_build(ctx, phases[c], 0)))
+		{
+			break;
+		}
+	}
+	trace_event(ctx, "project", ctx->vt->name, start, trace_now(), NULL, r);
+	stats_report(ctx);
+	plan_report(ctx, r);
+	timing_save(ctx);
+	context_cache_save(ctx);
+	return (r < 0 ? 1 : r);
+}
+
+
+/* The context cache holds information which is expensive to discover,
+ * such as the results of handler detection and PATH searches, so that
+ * it can be re-used within the process and, when running as a daemon,
+ * detection results can be re-used by subsequent invocations. PATH
+ * search results aren't passed back to the daemon: a tool could be
+ * installed ahead of one which was found at any time, and a cached
+ * result is only checked for still being there.
+ *
+ * Detection results are also kept on disk, in the shared cache
+ * directory, so that they survive from one invocation to the next. Every
+ * entry is validated before use, so the file may be shared freely
+ * between builds, and removed at any time.
+ */
+
+#define CONTEXT_CACHE_FILE              "detect"
+#define CONTEXT_CACHE_PREFIX            "detect."
+#define CONTEXT_CACHE_PATH              "path."
+/* The number of entries retained on disk */
+#define CONTEXT_CACHE_MAX               4096
+
+static build_defn_t *ctxcache;
+static int ctxloaded, ctxdirty;
+
+const char *
+context_cache_get(const char *key)
+{
+	return state_get(ctxcache, key);
+}
+
+int
+context_cache_set(build_context_t *ctx, const char *key, const char *value)
+{
+	if(!strncmp(key, CONTEXT_CACHE_PREFIX, strlen(CONTEXT_CACHE_PREFIX)))
+	{
+		ctxdirty = 1;
+	}
+	return state_set(ctx, &ctxcache, key, value);
+}
+
+/* Load the on-disk cache, the first time it's needed; anything we
+ * already know is newer than what's on disk.
+ */
+void
+context_cache_load(build_context_t *ctx)
+{
+	build_defn_t *kv, *p;
+	const char *dir, *path;
+
+	if(ctxloaded || ctx->nocache)
+	{
+		return;
+	}
+	ctxloaded = 1;
+	if(!(dir = state_cachepath(NULL)) || !(path = state_path_in(ctx, dir, CONTEXT_CACHE_FILE)))
+	{
+		return;
+	}
+	kv = state_read(ctx, path);
+	for(p = kv; p; p = p->hh.next)
+	{
+		if(!state_find(ctxcache, p->name))
+		{
+			state_set(ctx, &ctxcache, p->name, p->value);
+		}
+	}
+	state_free(kv);
+}
+
+/* Write any new detection results back to the on-disk cache, merging
+ * them with whatever other builds have added since we read it, and
+ * discarding the least recently added entries if it has grown too large.
+ */
+int
+context_cache_save(build_context_t *ctx)
+{
+	build_defn_t *kv, *p, *tmp;
+	const char *path;
+	char *dir;
+	int fd, r;
+
+	if(!ctxdirty || ctx->nocache || ctx->dryrun)
+	{
+		return 0;
+	}
+	ctxdirty = 0;
+	if(!(path = state_cachedir(ctx, NULL)) || !(dir = strdup(path)))
+	{
+		return -1;
+	}
+	if(!(path = state_path_in(ctx, dir, CONTEXT_CACHE_FILE ".lock")) || (fd = state_lock(ctx, path, 1)) < 0)
+	{
+		free(dir);
+		return -1;
+	}
+	path = state_path_in(ctx, dir, CONTEXT_CACHE_FILE);
+	kv = state_read(ctx, path);
+	for(p = ctxcache; p; p = p->hh.next)
+	{
+		if(!strncmp(p->name, CONTEXT_CACHE_PREFIX, strlen(CONTEXT_CACHE_PREFIX)))
+		{
+			state_set(ctx, &kv, p->name, p->value);
+		}
+	}
+	HASH_ITER(hh, kv, p, tmp)
+	{
+		if(HASH_COUNT(kv) <= CONTEXT_CACHE_MAX)
+		{
+			break;
+		}
+		HASH_DEL(kv, p);
+		free(p->name);
+		free(p);
+	}
+	r = state_write(ctx, state_path_in(ctx, dir, CONTEXT_CACHE_FILE), kv);
+	state_free(kv);
+	state_unlock(fd);
+	free(dir);
 	return r;
 }
-		
+
+/* Merge a set of cache entries (for example, those learned by a child
+ * process) into the cache.
+ */
+void
+context_cache_merge(build_context_t *ctx, build_defn_t *kv)
+{
+	build_defn_t *p;
+
+	for(p = kv; p; p = p->hh.next)
+	{
+		state_set(ctx, &ctxcache, p->name, p->value);
+	}
+}
+
+/* Write the entries which a daemon's child reports back to it */
+int
+context_cache_report(FILE *f)
+{
+	build_defn_t *p;
+
+	for(p = ctxcache; p; p = p->hh.next)
+	{
+		if(!strncmp(p->name, CONTEXT_CACHE_PATH, strlen(CONTEXT_CACHE_PATH)))
+		{
+			continue;
+		}
+		if(fprintf(f, "%s=%s\n", p->name, p->value) < 0)
+		{
+			return -1;
+		}
+	}
+	return 0;
+}
+
+/* Describe the identity of the directory at path, for validating
+ * cached information about it.
+ */
+static int
+context_dirstamp(const char *path, char *buf, size_t len)
+{
+	struct stat sbuf;
+
+	if(stat(path, &sbuf) < 0)
+	{
+		return -1;
+	}
+	snprintf(buf, len, "%lld:%lld:%lld", (long long) sbuf.st_dev, (long long) sbuf.st_ino, (long long) sbuf.st_mtime);
+	return 0;
+}
+
+static void
+context_detect_key(build_context_t *ctx, char *key)
+{
+	char hex[DIGEST_HEXLEN + 1], *cwd;
+	digest_t d;
+
+	digest_init(&d);
+	cwd = getcwd(NULL, 0);
+	digest_str(&d, cwd);
+	digest_str(&d, ctx->project);
+	free(cwd);
+	digest_final(&d, hex);
+	sprintf(key, "detect.%s", hex);
+}
+
+/* Work out the stamp against which a detection result is validated:
+ * a digest of the identity of the working directory, of the project,
+ * if one was specified, and of the parent directories which detection
+ * may have searched. A witness found in a parent directory ends the
+ * search there (its own presence is checked separately); otherwise
+ * every parent up to the root could have changed the result, by gaining
+ * a configure.ac, for example.
+ */
+static int
+context_detect_stamp(const char *project, const char *witness, char *stamp)
+{
+	char buf[128], *dir, *wdir, *t;
+	struct stat sbuf;
+	digest_t d;
+
+	digest_init(&d);
+	if(context_dirstamp(".", buf, sizeof(buf)))
+	{
+		return -1;
+	}
+	digest_str(&d, buf);
+	if(project)
+	{
+		if(stat(project, &sbuf) < 0)
+		{
+			return -1;
+		}
+		if(!S_ISDIR(sbuf.st_mode))
+		{
+			/* Only a directory is searched upwards from */
+			digest_str(&d, project);
+			digest_final(&d, stamp);
+			return 0;
+		}
+		if(context_dirstamp(project, buf, sizeof(buf)))
+		{
+			return -1;
+		}
+		digest_str(&d, buf);
+	}
+	if(!(dir = realpath(project ? project : ".", NULL)))
+	{
+		return -1;
+	}
+	wdir = (witness ? realpath(witness, NULL) : NULL);
+	if(wdir && (t = strrchr(wdir, '/')))
+	{
+		*t = 0;
+	}
+	while(strlen(dir) > 1 && (t = strrchr(dir, '/')))
+	{
+		if(t == dir)
+		{
+			t[1] = 0;
+		}
+		else
+		{
+			*t = 0;
+		}
+		if(wdir && !strcmp(dir, wdir))
+		{
+			break;
+		}
+		if(context_dirstamp(dir, buf, sizeof(buf)))
+		{
+			free(wdir);
+			free(dir);
+			return -1;
+		}
+		digest_str(&d, buf);
+	}
+	free(wdir);
+	free(dir);
+	digest_final(&d, stamp);
+	return 0;
+}
+
+/* Look for a still-valid cached detection result. Entries have the form
+ * HANDLER<TAB>STAMP<TAB>WITNESS<TAB>PROJECT, where WITNESS is the file
+ * whose presence identified the project.
+ */
+static build_handler_t *
+context_detect_cached(build_context_t *ctx, const char *key)
+{
+	const char *value;
+	char *buf, *f[4], stamp[DIGEST_HEXLEN + 1];
+	size_t c;
+
+	if(!(value = context_cache_get(key)) || !(buf = strdup(value)))
+	{
+		return NULL;
+	}
+	f[0] = buf;
+	for(c = 1; c < 4; c++)
+	{
+		if(!(f[c] = strchr(f[c - 1], '\t')))
+		{
+			free(buf);
+			return NULL;
+		}
+		*(f[c]) = 0;
+		f[c]++;
+	}
+	if(context_detect_stamp(ctx->project, (f[2][0] ? f[2] : NULL), stamp) || strcmp(stamp, f[1]) ||
+	   (f[2][0] && access(f[2], R_OK)))
+	{
+		free(buf);
+		return NULL;
+	}
+	for(c = 0; handlers[c]; c++)
+	{
+		if(!strcmp(handlers[c]->name, f[0]))
+		{
+			ctx->vt = handlers[c];
+			ctx->project = (f[3][0] ? strdup(f[3]) : NULL);
+			ctx->detected = (f[2][0] ? strdup(f[2]) : NULL);
+			context_msg(ctx, MSG_DEBUG, "using cached detection result (%s)\n", f[0]);
+			free(buf);
+			return handlers[c];
+		}
+	}
+	free(buf);
+	return NULL;
+}
 
 build_handler_t *
 context_detect(build_context_t *ctx)
 {
-	size_t c;
+	char key[64], stamp[DIGEST_HEXLEN + 1], *value;
+	const char *project;
+	size_t c, l;
 	int r;
 
+	context_cache_load(ctx);
+	context_detect_key(ctx, key);
+	if(context_detect_cached(ctx, key))
+	{
+		return ctx->vt;
+	}
+	project = ctx->project;
 	for(c = 0; handlers[c]; c++)
 	{
-		if((r = handlers[c]->detect(ctx)))
+		r = handlers[c]->detect(ctx);
+		/* Handlers may change directory while looking for a project,
+		 * but each handler, and later the phases, expect to start out
+		 * in the working directory.
+		 */
+		context_returnwd(ctx);
+		if(r)
 		{
 			if(r < 0)
 			{
 				return NULL;
 			}
 			ctx->vt = handlers[c];
+			if(!context_detect_stamp(project, ctx->detected, stamp))
+			{
+				l = strlen(handlers[c]->name) + strlen(stamp) + 4 +
+					(ctx->detected ? strlen(ctx->detected) : 0) + (ctx->project ? strlen(ctx->project) : 0);
+				if((value = malloc(l)))
+				{
+					sprintf(value, "%s\t%s\t%s\t%s", handlers[c]->name, stamp,
+						(ctx->detected ? ctx->detected : ""), (ctx->project ? ctx->project : ""));
+					context_cache_set(ctx, key, value);
+					free(value);
+				}
+			}
 			return handlers[c];
 		}
 	}
@@ -222,6 +752,11 @@ context_chdir(build_context_t *ctx)
 		}
 	}
 	ctx->here = open(".", O_RDONLY);
+	if(state_init(ctx) < 0)
+	{
+		close(here);
+		return -1;
+	}
 	return here;
 }
 
@@ -238,11 +773,11 @@ context_pathsearch(build_context_t *ctx, const char *name)
 	static char *pathbuf;
 	static size_t pbufsize;
 
-	char *pp;
+	char *pp, key[128], hex[DIGEST_HEXLEN + 1];
 	const char *path, *p;
-	size_t l, nl;
+	digest_t d;
+	size_t l;
 	
-	nl = strlen(name);
 	if(!(path = getenv("PATH")))
 	{
 		if(!pwarned)
@@ -252,7 +787,18 @@ context_pathsearch(build_context_t *ctx, const char *name)
 		pwarned = 1;
 		return NULL;
 	}
-	l = strlen(path) + strlen(name) + 1;
+	/* Results are cached against the value of PATH, and checked before
+	 * being used.
+	 */
+	digest_init(&d);
+	digest_str(&d, path);
+	digest_final(&d, hex);
+	snprintf(key, sizeof(key), CONTEXT_CACHE_PATH "%s.%s", hex, name);
+	l = strlen(path) + strlen(name) + 2;
+	if((p = context_cache_get(key)) && strlen(p) + 1 > l)
+	{
+		l = strlen(p) + 1;
+	}
 	if(l > pbufsize)
 	{
 		if(!(pp = realloc(pathbuf, l)))
@@ -261,6 +807,12 @@ context_pathsearch(build_context_t *ctx, const char *name)
 			return NULL;
 		}
 		pathbuf = pp;
+		pbufsize = l;
+	}
+	if(p && access(p, R_OK|X_OK) != -1)
+	{
+		strcpy(pathbuf, p);
+		return pathbuf;
 	}
 	p = path;
 	for(; p && path; path = p + 1)
@@ -279,6 +831,7 @@ context_pathsearch(build_context_t *ctx, const char *name)
 		strcpy(&(pathbuf[l + 1]), name);
 		if(access(pathbuf, R_OK|X_OK) != -1)
 		{
+			context_cache_set(ctx, key, pathbuf);
 			return pathbuf;
 		}
 	}
@@ -394,12 +947,46 @@ cmd_arg_addf(cmd_t *cmd, const char *arg, ...)
 	return cmd_arg_vaddf(cmd, arg, ap);
 }
 
+/* Show the output captured from a failed command */
+static void
+cmd_output(cmd_t *cmd, const char *out, size_t len)
+{
+	size_t c;
+
+	if(cmd->stats.outbytes > len)
+	{
+		context_msg(cmd->context, MSG_ERROR, "the last %lu bytes of output (of %llu) from:", (unsigned long) len, cmd->stats.outbytes);
+	}
+	else
+	{
+		context_msg(cmd->context, MSG_ERROR, "output from:");
+	}
+	for(c = 0; c < cmd->argc; c++)
+	{
+		fprintf(stderr, " %s", cmd->argv[c]);
+	}
+	fputc('\n', stderr);
+	fflush(stderr);
+	if(len && write(2, out, len) < 0)
+	{
+		return;
+	}
+	if(len && out[len - 1] != '\n')
+	{
+		fputc('\n', stderr);
+	}
+}
+
 int
 cmd_spawn(cmd_t *cmd, int ignore)
 {
-	pid_t pid, r;
-	int status;
-	size_t c;
+	supervisor_t *sup;
+	supervisor_job_t *job;
+	size_t c, l;
+	long long start;
+	char *cmdline, *p, *out;
+	size_t outlen;
+	int r, status;
 
 	if(!cmd->context->quiet)
 	{
@@ -414,17 +1001,52 @@ cmd_spawn(cmd_t *cmd, int ignore)
 	}
 	if(cmd->context->dryrun)
 	{
+		plan_command(cmd);
 		return 0;
 	}
-	if(posix_spawnp(&pid, cmd->argv[0], NULL, NULL, cmd->argv, environ) < 0)
+	if(!(sup = supervisor_create(cmd->context)))
 	{
 		return -1;
 	}
-	do
+	/* In quiet mode, only the tail of the output is kept, and shown if
+	 * the command fails.
+	 */
+	if(cmd->context->quiet)
 	{
-		r = waitpid(pid, &status, 0);
+		supervisor_capture(sup, cmd->context->tail);
 	}
-	while(r == -1 && errno == EINTR);   
+	if(cmd->context->logfd >= 0)
+	{
+		supervisor_log(sup, cmd->context->logfd);
+	}
+	if(!supervisor_spawn(sup, NULL, cmd->argv, NULL))
+	{
+		supervisor_destroy(sup);
+		return -1;
+	}
+	/* With no timeout and nothing else watched, supervisor_wait() only
+	 * returns without a job if waiting failed (it retries by itself if
+	 * interrupted by a signal)
+	 */
+	if(!(job = supervisor_wait(sup, -1)))
+	{
+		supervisor_kill(sup);
+		supervisor_destroy(sup);
+		return -1;
+	}
+	supervisor_destroy(sup);
+	status = supervisor_job_status(job);
+	stats_rusage(&(cmd->stats), supervisor_job_rusage(job), supervisor_job_elapsed(job));
+	cmd->stats.outbytes = supervisor_job_outbytes(job, &(cmd->stats.outlines));
+	start = supervisor_job_started(job);
+	out = NULL;
+	outlen = 0;
+	if(!ignore && cmd->stats.outbytes && (!WIFEXITED(status) || WEXITSTATUS(status)) && (out = malloc(cmd->context->tail)))
+	{
+		outlen = supervisor_job_output(job, out);
+	}
+	supervisor_job_free(job);
+	stats_add(&(cmd->context->stats[cmd->context->phase]), &(cmd->stats));
 	if(WIFEXITED(status))
 	{
 		r = WEXITSTATUS(status);
@@ -433,6 +1055,27 @@ cmd_spawn(cmd_t *cmd, int ignore)
 	{
 		r = 127;
 	}
+	if(cmd->context->tracefile)
+	{
+		for(c = 0, l = 1; c < cmd->argc; c++)
+		{
+			l += strlen(cmd->argv[c]) + 1;
+		}
+		if((cmdline = calloc(1, l)))
+		{
+			for(c = 0, p = cmdline; c < cmd->argc; c++)
+			{
+				p += sprintf(p, "%s%s", (c ? " " : ""), cmd->argv[c]);
+			}
+		}
+		trace_event(cmd->context, "command", ((p = strrchr(cmd->argv[0], '/')) ? p + 1 : cmd->argv[0]),
+					start, start + cmd->stats.wall, cmdline, r);
+		free(cmdline);
+	}
+	if(!r)
+	{
+		timing_record(cmd->context, timing_cmdkey(cmd), cmd->stats.wall);
+	}
 	if(r)
 	{
 		if(ignore)
@@ -443,6 +1086,11 @@ cmd_spawn(cmd_t *cmd, int ignore)
 			}
 			return 0;
 		}
+		if(out)
+		{
+			cmd_output(cmd, out, outlen);
+			free(out);
+		}
 		context_msg(cmd->context, MSG_FATAL, "Build phase failed with exit status %d.  Stop.\n", r);
 	}
 	return r;	
@@ -498,3 +1146,155 @@ context_defn_find(build_context_t *ctx, const char *name)
 	HASH_FIND_STR(ctx->defs, name, p);
 	return p;
 }
+
+static int
+context_defn_cmp(const void *a, const void *b)
+{
+	return strcmp((*(build_defn_t * const *) a)->name, (*(build_defn_t * const *) b)->name);
+}
+
+/* Add the definitions to a digest in a consistent order, other than
+ * DESTDIR, which only determines where the results are installed
+ */
+static int
+context_digest_defs(build_context_t *ctx, digest_t *d)
+{
+	build_defn_t *p, **defs;
+	size_t n, c;
+
+	if(!(n = HASH_COUNT(ctx->defs)))
+	{
+		return 0;
+	}
+	if(!(defs = calloc(n, sizeof(build_defn_t *))))
+	{
+		context_msg(ctx, MSG_PERROR, "calloc(%u, %u)", (unsigned) n, (unsigned) sizeof(build_defn_t *));
+		return -1;
+	}
+	for(c = 0, p = ctx->defs; p; p = p->hh.next)
+	{
+		defs[c++] = p;
+	}
+	qsort(defs, n, sizeof(build_defn_t *), context_defn_cmp);
+	for(c = 0; c < n; c++)
+	{
+		if(strcmp(defs[c]->name, "DESTDIR"))
+		{
+			digest_str(d, defs[c]->name);
+			digest_str(d, defs[c]->value);
+		}
+	}
+	free(defs);
+	return 0;
+}
+
+/* Add everything which determines the result of building the project
+ * to a digest: the handler, the project, product, triplets, configuration
+ * and SDK, whether it's built out of tree, and the definitions.
+ */
+int
+context_digest_options(build_context_t *ctx, digest_t *d)
+{
+	digest_str(d, (ctx->vt ? ctx->vt->name : NULL));
+	digest_str(d, ctx->project);
+	digest_str(d, ctx->product);
+	digest_str(d, ctx->build);
+	digest_str(d, ctx->host);
+	digest_str(d, ctx->target);
+	digest_str(d, ctx->config);
+	digest_str(d, ctx->sdk);
+	if(ctx->vpath)
+	{
+		digest_str(d, "vpath");
+	}
+	return context_digest_defs(ctx, d);
+}
+
+/* With --vpath, return the directory in which the current configuration
+ * is configured and built: .build/obj/NAME, where NAME is made up of the
+ * host triplet (or 'native'), the configuration name, if any, and a
+ * digest of the triplets, configuration, SDK and definitions, so that
+ * each combination has its own. Returns a static buffer, or NULL when
+ * building in the tree, which is always the case for handlers other
+ * than autoconf.
+ */
+const char *
+context_objdir(build_context_t *ctx)
+{
+	static char pbuf[4096];
+	char hex[DIGEST_HEXLEN + 1];
+	digest_t d;
+
+	if(!ctx->vpath || !ctx->statedir || ctx->vt != &autoconf_handler)
+	{
+		return NULL;
+	}
+	digest_init(&d);
+	digest_str(&d, ctx->build);
+	digest_str(&d, ctx->host);
+	digest_str(&d, ctx->target);
+	digest_str(&d, ctx->config);
+	digest_str(&d, ctx->sdk);
+	if(context_digest_defs(ctx, &d))
+	{
+		return NULL;
+	}
+	digest_final(&d, hex);
+	snprintf(pbuf, sizeof(pbuf), "%s/obj/%s%s%s-%.12s", ctx->statedir, (ctx->host ? ctx->host : "native"),
+			 (ctx->config ? "-" : ""), (ctx->config ? ctx->config : ""), hex);
+	return pbuf;
+}
+
+/* With --vpath, change to the build directory for the current
+ * configuration, creating it if needed; context_returnwd() returns to
+ * the source tree afterwards. In a dry run, nothing is created, and if
+ * the directory doesn't exist yet, the working directory is left alone.
+ */
+int
+context_objdir_enter(build_context_t *ctx)
+{
+	const char *dir;
+	char path[4096], *s;
+
+	if(!ctx->vpath)
+	{
+		return 0;
+	}
+	if(!(dir = context_objdir(ctx)))
+	{
+		return -1;
+	}
+	if(!ctx->dryrun)
+	{
+		snprintf(path, sizeof(path), "%s", dir);
+		for(s = strchr(path + 1, '/'); ; s = strchr(s + 1, '/'))
+		{
+			if(s)
+			{
+				*s = 0;
+			}
+			if(mkdir(path, 0777) < 0 && errno != EEXIST)
+			{
+				context_msg(ctx, MSG_PERROR, "%s", path);
+				return -1;
+			}
+			if(!s)
+			{
+				break;
+			}
+			*s = '/';
+		}
+	}
+	if(chdir(dir) < 0)
+	{
+		if(ctx->dryrun && errno == ENOENT)
+		{
+			context_msg(ctx, MSG_INFO, "would build in %s\n", dir);
+			return 0;
+		}
+		context_msg(ctx, MSG_PERROR, "%s", dir);
+		return -1;
+	}
+	context_msg(ctx, MSG_INFO, "building in %s\n", dir);
+	return 0;
+}
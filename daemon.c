@@ -0,0 +1,726 @@
+/* Copyright 2013 Mo McRoberts.
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ */
+
+#ifdef HAVE_CONFIG_H
+# include "config.h"
+#endif
+
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <arpa/inet.h>
+#include <poll.h>
+#include <signal.h>
+
+#include "p_build.h"
+
+/* The build daemon.
+ *
+ * `build --daemon' listens on a Unix-domain socket and services requests
+ * from ordinary invocations of build, which pass it their arguments,
+ * environment, working directory and standard file descriptors, and
+ * wait for an exit status. Each request is run in a forked child of the
+ * daemon, and so starts out with everything the daemon has learned so
+ * far (such as detection results and the locations of tools); when the
+ * child finishes, it reports back anything new that it learned.
+ *
+ * The client forwards any terminating signals it receives to the
+ * daemon, which passes them on to the request's process group. The exit
+ * status is sent by the daemon once the child has been reaped, so that
+ * the client hears how it finished however it did so.
+ *
+ * Only requests from the user the daemon runs as are accepted.
+ */
+
+typedef struct daemon_job_s daemon_job_t;
+
+struct daemon_job_s
+{
+	daemon_job_t *next;
+	pid_t pid;
+	int conn;
+	int report;
+	char *buf;
+	size_t len;
+	size_t alloc;
+};
+
+static int indaemon;
+static int clientfd = -1;
+static int reportfd = -1;
+static daemon_job_t *jobs;
+
+/* Return non-zero if we're the daemon or one of its children */
+int
+daemon_active(void)
+{
+	return indaemon;
+}
+
+/* Return the path of the daemon's socket; only the daemon itself
+ * creates the cache directory which contains it
+ */
+static const char *
+daemon_path(build_context_t *ctx, int create)
+{
+	static char pbuf[sizeof(((struct sockaddr_un *) 0)->sun_path)];
+	const char *p;
+
+	if((p = getenv("BUILD_SOCKET")) && p[0])
+	{
+		snprintf(pbuf, sizeof(pbuf), "%s", p);
+		return pbuf;
+	}
+	if(!(p = (create ? state_cachedir(ctx, NULL) : state_cachepath(NULL))))
+	{
+		return NULL;
+	}
+	if(strlen(p) + 14 > sizeof(pbuf))
+	{
+		return NULL;
+	}
+	snprintf(pbuf, sizeof(pbuf), "%s/daemon.sock", p);
+	return pbuf;
+}
+
+/* Connect to the Unix-domain socket at path */
+int
+daemon_connect(const char *path)
+{
+	struct sockaddr_un sun;
+	int fd;
+
+	if((fd = socket(AF_UNIX, SOCK_STREAM, 0)) < 0)
+	{
+		return -1;
+	}
+	memset(&sun, 0, sizeof(sun));
+	sun.sun_family = AF_UNIX;
+	strncpy(sun.sun_path, path, sizeof(sun.sun_path) - 1);
+	if(connect(fd, (struct sockaddr *) &sun, sizeof(sun)) < 0)
+	{
+		close(fd);
+		return -1;
+	}
+	return fd;
+}
+
+int
+daemon_writeall(int fd, const void *buf, size_t len)
+{
+	const char *p;
+	ssize_t r;
+
+	for(p = (const char *) buf; len; p += r, len -= r)
+	{
+		if((r = write(fd, p, len)) < 0)
+		{
+			if(errno == EINTR)
+			{
+				r = 0;
+				continue;
+			}
+			return -1;
+		}
+	}
+	return 0;
+}
+
+int
+daemon_readall(int fd, void *buf, size_t len)
+{
+	char *p;
+	ssize_t r;
+
+	for(p = (char *) buf; len; p += r, len -= r)
+	{
+		if((r = read(fd, p, len)) <= 0)
+		{
+			if(r < 0 && errno == EINTR)
+			{
+				r = 0;
+				continue;
+			}
+			return -1;
+		}
+	}
+	return 0;
+}
+
+static void
+daemon_client_signal(int sig)
+{
+	unsigned char c;
+
+	c = (unsigned char) sig;
+	if(clientfd >= 0 && write(clientfd, &c, 1) < 0)
+	{
+		_exit(128 + sig);
+	}
+}
+
+/* Append a NUL-terminated string to a growable buffer */
+static int
+daemon_buf_add(daemon_job_t *b, const char *str, size_t len)
+{
+	char *p;
+	size_t n;
+
+	if(b->len + len > b->alloc)
+	{
+		for(n = (b->alloc ? b->alloc : 4096); n < b->len + len; n *= 2)
+		{
+		}
+		if(!(p = realloc(b->buf, n)))
+		{
+			return -1;
+		}
+		b->buf = p;
+		b->alloc = n;
+	}
+	memcpy(&(b->buf[b->len]), str, len);
+	b->len += len;
+	return 0;
+}
+
+/* Determine the user at the other end of a connection */
+static int
+daemon_peer(int conn, uid_t *uid)
+{
+#if defined(HAVE_GETPEEREID)
+	gid_t gid;
+
+	return getpeereid(conn, uid, &gid);
+#elif defined(SO_PEERCRED)
+	struct ucred cred;
+	socklen_t len;
+
+	len = sizeof(cred);
+	if(getsockopt(conn, SOL_SOCKET, SO_PEERCRED, &cred, &len) < 0)
+	{
+		return -1;
+	}
+	*uid = cred.uid;
+	return 0;
+#else
+	(void) conn;
+	(void) uid;
+	/* There's no telling who it is */
+	return -1;
+#endif
+}
+
+/* Hand an invocation to a running daemon, if there is one. Returns the
+ * exit status of the build, or -1 if there is no daemon to talk to and
+ * the build should be performed locally.
+ */
+int
+daemon_client(build_context_t *ctx, int argc, char **argv)
+{
+	const char *path;
+	char *cwd, num[32], c;
+	daemon_job_t req;
+	struct msghdr msg;
+	struct iovec iov;
+	struct cmsghdr *cmsg;
+	union
+	{
+		struct cmsghdr align;
+		char buf[CMSG_SPACE(sizeof(int) * 3)];
+	} control;
+	uint32_t len;
+	unsigned char status[4];
+	int fd, fds[3], i, r;
+	uid_t uid;
+
+	if(!(path = daemon_path(ctx, 0)) || (fd = daemon_connect(path)) < 0)
+	{
+		return -1;
+	}
+	/* A daemon run by somebody else would refuse the request */
+	if(daemon_peer(fd, &uid) || uid != geteuid())
+	{
+		context_msg(ctx, MSG_DEBUG, "ignoring the daemon at %s, which belongs to another user\n", path);
+		close(fd);
+		return -1;
+	}
+	context_msg(ctx, MSG_DEBUG, "passing request to daemon at %s\n", path);
+	memset(&req, 0, sizeof(req));
+	if(!(cwd = getcwd(NULL, 0)))
+	{
+		context_msg(ctx, MSG_PERROR, "getcwd()");
+		close(fd);
+		return -1;
+	}
+	r = daemon_buf_add(&req, cwd, strlen(cwd) + 1);
+	free(cwd);
+	sprintf(num, "%d", argc);
+	r |= daemon_buf_add(&req, num, strlen(num) + 1);
+	for(i = 0; i < argc; i++)
+	{
+		r |= daemon_buf_add(&req, argv[i], strlen(argv[i]) + 1);
+	}
+	for(i = 0; environ[i]; i++)
+	{
+		r |= daemon_buf_add(&req, environ[i], strlen(environ[i]) + 1);
+	}
+	if(r)
+	{
+		context_msg(ctx, MSG_PERROR, "malloc()");
+		free(req.buf);
+		close(fd);
+		return -1;
+	}
+	/* The request is introduced by a single byte accompanied by our
+	 * standard descriptors, followed by its length and the request
+	 * itself.
+	 */
+	c = 'R';
+	iov.iov_base = &c;
+	iov.iov_len = 1;
+	memset(&msg, 0, sizeof(msg));
+	memset(&control, 0, sizeof(control));
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	msg.msg_control = control.buf;
+	msg.msg_controllen = sizeof(control.buf);
+	cmsg = CMSG_FIRSTHDR(&msg);
+	cmsg->cmsg_level = SOL_SOCKET;
+	cmsg->cmsg_type = SCM_RIGHTS;
+	cmsg->cmsg_len = CMSG_LEN(sizeof(int) * 3);
+	fds[0] = 0;
+	fds[1] = 1;
+	fds[2] = 2;
+	memcpy(CMSG_DATA(cmsg), fds, sizeof(fds));
+	len = htonl((uint32_t) req.len);
+	if(sendmsg(fd, &msg, 0) != 1 || daemon_writeall(fd, &len, sizeof(len)) || daemon_writeall(fd, req.buf, req.len))
+	{
+		context_msg(ctx, MSG_PERROR, "failed to send request to daemon");
+		free(req.buf);
+		close(fd);
+		return -1;
+	}
+	free(req.buf);
+	clientfd = fd;
+	signal(SIGINT, daemon_client_signal);
+	signal(SIGTERM, daemon_client_signal);
+	signal(SIGHUP, daemon_client_signal);
+	signal(SIGQUIT, daemon_client_signal);
+	if(daemon_readall(fd, status, sizeof(status)))
+	{
+		context_msg(ctx, MSG_FATAL, "lost connection to the build daemon.  Stop.\n");
+		return 1;
+	}
+	close(fd);
+	return (int) (((uint32_t) status[0] << 24) | ((uint32_t) status[1] << 16) | ((uint32_t) status[2] << 8) | status[3]);
+}
+
+static void
+daemon_cloexec(int fd)
+{
+	fcntl(fd, F_SETFD, fcntl(fd, F_GETFD) | FD_CLOEXEC);
+}
+
+/* Report what the child has learned to the daemon; called when the
+ * request finishes, including by way of exit()
+ */
+static void
+daemon_child_report(void)
+{
+	FILE *f;
+
+	fflush(stdout);
+	fflush(stderr);
+	if(reportfd >= 0 && (f = fdopen(reportfd, "w")))
+	{
+		context_cache_report(f);
+		fclose(f);
+	}
+	reportfd = -1;
+}
+
+/* Run a request in the child: adopt the client's descriptors, directory
+ * and environment, perform the build, then report back.
+ */
+static void
+daemon_child(build_context_t *ctx, int conn, int report, int *fds, char *req, size_t len, int (*runner)(int argc, char **argv))
+{
+	char **argv, **env, *p, *end;
+	int argc, envc, i, r;
+
+	/* The daemon holds the connection, and sends the exit status */
+	close(conn);
+	reportfd = report;
+	daemon_cloexec(report);
+	atexit(daemon_child_report);
+	setpgid(0, 0);
+	signal(SIGPIPE, SIG_DFL);
+	signal(SIGINT, SIG_DFL);
+	signal(SIGTERM, SIG_DFL);
+	signal(SIGHUP, SIG_DFL);
+	signal(SIGQUIT, SIG_DFL);
+	for(i = 0; i < 3; i++)
+	{
+		dup2(fds[i], i);
+		close(fds[i]);
+	}
+	end = req + len;
+	p = req;
+	if(chdir(p) < 0)
+	{
+		context_msg(ctx, MSG_PERROR, "%s", p);
+		_exit(EXIT_FAILURE);
+	}
+	p += strlen(p) + 1;
+	argc = atoi(p);
+	p += strlen(p) + 1;
+	if(argc < 1 || !(argv = calloc(argc + 1, sizeof(char *))))
+	{
+		_exit(EXIT_FAILURE);
+	}
+	for(i = 0; i < argc && p < end; i++)
+	{
+		argv[i] = p;
+		p += strlen(p) + 1;
+	}
+	for(envc = 0, end = p; end < req + len; end += strlen(end) + 1)
+	{
+		envc++;
+	}
+	if(!(env = calloc(envc + 1, sizeof(char *))))
+	{
+		_exit(EXIT_FAILURE);
+	}
+	for(i = 0; p < end; i++)
+	{
+		env[i] = p;
+		p += strlen(p) + 1;
+	}
+	environ = env;
+	nx_getopt_reset();
+	r = runner(argc, argv);
+	daemon_child_report();
+	_exit(r);
+}
+
+static int
+daemon_accept(build_context_t *ctx, int lfd, int (*runner)(int argc, char **argv))
+{
+	struct msghdr msg;
+	struct iovec iov;
+	struct cmsghdr *cmsg;
+	union
+	{
+		struct cmsghdr align;
+		char buf[CMSG_SPACE(sizeof(int) * 3)];
+	} control;
+	daemon_job_t *job, *p;
+	int conn, fds[3], rp[2], i;
+	uint32_t len;
+	char c, *req;
+	uid_t uid;
+	pid_t pid;
+
+	if((conn = accept(lfd, NULL, NULL)) < 0)
+	{
+		return (errno == EINTR ? 0 : -1);
+	}
+	daemon_cloexec(conn);
+	if(daemon_peer(conn, &uid) || uid != geteuid())
+	{
+		context_msg(ctx, MSG_ERROR, "refusing a request from another user\n");
+		close(conn);
+		return 0;
+	}
+	iov.iov_base = &c;
+	iov.iov_len = 1;
+	memset(&msg, 0, sizeof(msg));
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	msg.msg_control = control.buf;
+	msg.msg_controllen = sizeof(control.buf);
+	if(recvmsg(conn, &msg, 0) != 1 || c != 'R' || !(cmsg = CMSG_FIRSTHDR(&msg)) ||
+	   cmsg->cmsg_type != SCM_RIGHTS || cmsg->cmsg_len != CMSG_LEN(sizeof(int) * 3))
+	{
+		context_msg(ctx, MSG_ERROR, "ignoring malformed request\n");
+		close(conn);
+		return 0;
+	}
+	memcpy(fds, CMSG_DATA(cmsg), sizeof(fds));
+	req = NULL;
+	if(daemon_readall(conn, &len, sizeof(len)) || !(len = ntohl(len)) || len > 16777216 ||
+	   !(req = malloc(len + 1)) || daemon_readall(conn, req, len) || pipe(rp) < 0)
+	{
+		context_msg(ctx, MSG_ERROR, "ignoring incomplete request\n");
+		free(req);
+		for(i = 0; i < 3; i++)
+		{
+			close(fds[i]);
+		}
+		close(conn);
+		return 0;
+	}
+	req[len] = 0;
+	if(!(job = calloc(1, sizeof(daemon_job_t))) || (pid = fork()) < 0)
+	{
+		context_msg(ctx, MSG_PERROR, "fork()");
+		free(job);
+		free(req);
+		for(i = 0; i < 3; i++)
+		{
+			close(fds[i]);
+		}
+		close(rp[0]);
+		close(rp[1]);
+		close(conn);
+		return 0;
+	}
+	if(!pid)
+	{
+		close(lfd);
+		close(rp[0]);
+		for(p = jobs; p; p = p->next)
+		{
+			close(p->conn);
+			if(p->report >= 0)
+			{
+				close(p->report);
+			}
+		}
+		indaemon = 1;
+		daemon_child(ctx, conn, rp[1], fds, req, len, runner);
+	}
+	free(req);
+	for(i = 0; i < 3; i++)
+	{
+		close(fds[i]);
+	}
+	close(rp[1]);
+	daemon_cloexec(rp[0]);
+	job->pid = pid;
+	job->conn = conn;
+	job->report = rp[0];
+	job->next = jobs;
+	jobs = job;
+	context_msg(ctx, MSG_INFO, "started request %ld\n", (long) pid);
+	return 0;
+}
+
+/* Collect whatever a child has reported about what it has learned */
+static void
+daemon_report(build_context_t *ctx, daemon_job_t *job)
+{
+	char buf[4096];
+	build_defn_t *kv;
+	ssize_t r;
+	FILE *f;
+
+	if((r = read(job->report, buf, sizeof(buf))) > 0)
+	{
+		daemon_buf_add(job, buf, r);
+		return;
+	}
+	if(r < 0 && errno == EINTR)
+	{
+		return;
+	}
+	close(job->report);
+	job->report = -1;
+	if(job->len && (f = fmemopen(job->buf, job->len, "r")))
+	{
+		kv = state_fread(ctx, f);
+		fclose(f);
+		context_cache_merge(ctx, kv);
+		state_free(kv);
+	}
+	free(job->buf);
+	job->buf = NULL;
+	job->len = job->alloc = 0;
+}
+
+/* Relay a signal from the client, or notice that it has gone away */
+static void
+daemon_relay(build_context_t *ctx, daemon_job_t *job)
+{
+	unsigned char c;
+	ssize_t r;
+
+	if((r = read(job->conn, &c, 1)) == 1)
+	{
+		if(job->pid)
+		{
+			kill(-job->pid, c);
+		}
+		return;
+	}
+	if(r < 0 && errno == EINTR)
+	{
+		return;
+	}
+	if(job->pid)
+	{
+		context_msg(ctx, MSG_INFO, "client for request %ld went away\n", (long) job->pid);
+		kill(-job->pid, SIGTERM);
+	}
+	close(job->conn);
+	job->conn = -1;
+}
+
+/* Listen on a Unix-domain socket at path, unless something else
+ * already is.
+ */
+int
+daemon_listen(build_context_t *ctx, const char *path)
+{
+	struct sockaddr_un sun;
+	int lfd;
+
+	if((lfd = daemon_connect(path)) >= 0)
+	{
+		close(lfd);
+		context_msg(ctx, MSG_FATAL, "something is already listening on %s.  Stop.\n", path);
+		return -1;
+	}
+	unlink(path);
+	if((lfd = socket(AF_UNIX, SOCK_STREAM, 0)) < 0)
+	{
+		context_msg(ctx, MSG_PERROR, "socket()");
+		return -1;
+	}
+	memset(&sun, 0, sizeof(sun));
+	sun.sun_family = AF_UNIX;
+	strncpy(sun.sun_path, path, sizeof(sun.sun_path) - 1);
+	if(bind(lfd, (struct sockaddr *) &sun, sizeof(sun)) < 0 || listen(lfd, 16) < 0)
+	{
+		context_msg(ctx, MSG_PERROR, "%s", path);
+		close(lfd);
+		return -1;
+	}
+	daemon_cloexec(lfd);
+	return lfd;
+}
+
+/* Run the daemon; only returns on failure */
+int
+daemon_serve(build_context_t *ctx, int (*runner)(int argc, char **argv))
+{
+	struct pollfd *pfd;
+	daemon_job_t *job, **jp;
+	const char *path;
+	unsigned char code[4];
+	size_t n, c;
+	int lfd, status, timeout;
+	pid_t pid;
+
+	if(!(path = daemon_path(ctx, 1)))
+	{
+		context_msg(ctx, MSG_FATAL, "unable to determine the location of the daemon socket.  Stop.\n");
+		return 1;
+	}
+	if((lfd = daemon_listen(ctx, path)) < 0)
+	{
+		return 1;
+	}
+	signal(SIGPIPE, SIG_IGN);
+	/* Requests start out with whatever is in the on-disk cache */
+	context_cache_load(ctx);
+	context_msg(ctx, MSG_ECHO, "listening on %s\n", path);
+	pfd = NULL;
+	for(;;)
+	{
+		for(n = 1, job = jobs; job; job = job->next)
+		{
+			n += 2;
+		}
+		if(!(pfd = realloc(pfd, sizeof(struct pollfd) * n)))
+		{
+			context_msg(ctx, MSG_PERROR, "realloc()");
+			return 1;
+		}
+		pfd[0].fd = lfd;
+		pfd[0].events = POLLIN;
+		timeout = 1000;
+		for(n = 1, job = jobs; job; job = job->next)
+		{
+			pfd[n].fd = job->conn;
+			pfd[n].events = POLLIN;
+			pfd[n + 1].fd = job->report;
+			pfd[n + 1].events = POLLIN;
+			n += 2;
+			/* A child which has sent its report is about to exit, and
+			 * its client is waiting for the status
+			 */
+			if(job->pid && job->report < 0)
+			{
+				timeout = 10;
+			}
+		}
+		if(poll(pfd, n, timeout) < 0 && errno != EINTR)
+		{
+			context_msg(ctx, MSG_PERROR, "poll()");
+			return 1;
+		}
+		for(c = 1, job = jobs; job; job = job->next, c += 2)
+		{
+			if(job->conn >= 0 && (pfd[c].revents & (POLLIN|POLLHUP|POLLERR)))
+			{
+				daemon_relay(ctx, job);
+			}
+			if(job->report >= 0 && (pfd[c + 1].revents & (POLLIN|POLLHUP|POLLERR)))
+			{
+				daemon_report(ctx, job);
+			}
+		}
+		while((pid = waitpid(-1, &status, WNOHANG)) > 0)
+		{
+			for(job = jobs; job; job = job->next)
+			{
+				if(job->pid != pid)
+				{
+					continue;
+				}
+				context_msg(ctx, MSG_INFO, "request %ld finished\n", (long) pid);
+				job->pid = 0;
+				/* A child killed by a signal is reported as a shell
+				 * would report it
+				 */
+				if(job->conn >= 0)
+				{
+					code[0] = code[1] = code[2] = 0;
+					code[3] = (unsigned char) (WIFSIGNALED(status) ? 128 + WTERMSIG(status) : WEXITSTATUS(status));
+					daemon_writeall(job->conn, code, sizeof(code));
+				}
+			}
+		}
+		for(jp = &jobs; *jp; )
+		{
+			job = *jp;
+			if(!job->pid && job->report < 0)
+			{
+				if(job->conn >= 0)
+				{
+					close(job->conn);
+				}
+				*jp = job->next;
+				free(job);
+				continue;
+			}
+			jp = &(job->next);
+		}
+		if(pfd[0].revents & POLLIN)
+		{
+			daemon_accept(ctx, lfd, runner);
+		}
+	}
+}
@@ -0,0 +1,208 @@
+/* Copyright 2013 Mo McRoberts.
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ */
+
+#ifdef HAVE_CONFIG_H
+# include "config.h"
+#endif
+
+#include "p_build.h"
+
+/* Content digests.
+ *
+ * Digests are 128-bit MurmurHash3 (x64 variant) values, computed
+ * incrementally, and represented as 32 hexadecimal digits. They are used
+ * to decide whether inputs have changed, not for any security purpose.
+ */
+
+#define DIGEST_C1                       0x87c37b91114253d5ULL
+#define DIGEST_C2                       0x4cf5ad432745937fULL
+
+#define ROTL64(x, r)                    (((x) << (r)) | ((x) >> (64 - (r))))
+
+static uint64_t
+digest_fmix(uint64_t k)
+{
+	k ^= k >> 33;
+	k *= 0xff51afd7ed558ccdULL;
+	k ^= k >> 33;
+	k *= 0xc4ceb9fe1a85ec53ULL;
+	k ^= k >> 33;
+	return k;
+}
+
+static uint64_t
+digest_get64(const unsigned char *p)
+{
+	return (uint64_t) p[0] | ((uint64_t) p[1] << 8) | ((uint64_t) p[2] << 16) | ((uint64_t) p[3] << 24) |
+		((uint64_t) p[4] << 32) | ((uint64_t) p[5] << 40) | ((uint64_t) p[6] << 48) | ((uint64_t) p[7] << 56);
+}
+
+static void
+digest_block(digest_t *d, const unsigned char *p)
+{
+	uint64_t k1, k2;
+
+	k1 = digest_get64(p);
+	k2 = digest_get64(p + 8);
+	k1 *= DIGEST_C1;
+	k1 = ROTL64(k1, 31);
+	k1 *= DIGEST_C2;
+	d->h1 ^= k1;
+	d->h1 = ROTL64(d->h1, 27);
+	d->h1 += d->h2;
+	d->h1 = d->h1 * 5 + 0x52dce729;
+	k2 *= DIGEST_C2;
+	k2 = ROTL64(k2, 33);
+	k2 *= DIGEST_C1;
+	d->h2 ^= k2;
+	d->h2 = ROTL64(d->h2, 31);
+	d->h2 += d->h1;
+	d->h2 = d->h2 * 5 + 0x38495ab5;
+}
+
+void
+digest_init(digest_t *d)
+{
+	memset(d, 0, sizeof(digest_t));
+}
+
+void
+digest_update(digest_t *d, const void *data, size_t len)
+{
+	const unsigned char *p;
+	size_t n;
+
+	p = (const unsigned char *) data;
+	d->len += len;
+	if(d->blen)
+	{
+		n = 16 - d->blen;
+		if(n > len)
+		{
+			n = len;
+		}
+		memcpy(&(d->buf[d->blen]), p, n);
+		d->blen += n;
+		p += n;
+		len -= n;
+		if(d->blen < 16)
+		{
+			return;
+		}
+		digest_block(d, d->buf);
+		d->blen = 0;
+	}
+	for(; len >= 16; p += 16, len -= 16)
+	{
+		digest_block(d, p);
+	}
+	if(len)
+	{
+		memcpy(d->buf, p, len);
+		d->blen = len;
+	}
+}
+
+/* Add a string, including its terminating NUL so that consecutive
+ * strings can't run into one another.
+ */
+void
+digest_str(digest_t *d, const char *str)
+{
+	digest_update(d, (str ? str : ""), (str ? strlen(str) + 1 : 1));
+}
+
+void
+digest_strf(digest_t *d, const char *fmt, ...)
+{
+	char buf[1024];
+	va_list ap;
+
+	va_start(ap, fmt);
+	vsnprintf(buf, sizeof(buf), fmt, ap);
+	va_end(ap);
+	digest_str(d, buf);
+}
+
+/* Add the contents of a file; returns -1 if it can't be read */
+int
+digest_file(digest_t *d, const char *path)
+{
+	unsigned char buf[65536];
+	ssize_t r;
+	int fd;
+
+	if((fd = open(path, O_RDONLY)) < 0)
+	{
+		return -1;
+	}
+	while((r = read(fd, buf, sizeof(buf))) != 0)
+	{
+		if(r < 0)
+		{
+			if(errno == EINTR)
+			{
+				continue;
+			}
+			close(fd);
+			return -1;
+		}
+		digest_update(d, buf, r);
+	}
+	close(fd);
+	return 0;
+}
+
+void
+digest_final(digest_t *d, char *hex)
+{
+	uint64_t k1, k2, h1, h2;
+	size_t c;
+
+	k1 = k2 = 0;
+	h1 = d->h1;
+	h2 = d->h2;
+	for(c = d->blen; c > 8; c--)
+	{
+		k2 ^= (uint64_t) d->buf[c - 1] << ((c - 9) * 8);
+	}
+	for(c = (d->blen > 8 ? 8 : d->blen); c > 0; c--)
+	{
+		k1 ^= (uint64_t) d->buf[c - 1] << ((c - 1) * 8);
+	}
+	if(d->blen > 8)
+	{
+		k2 *= DIGEST_C2;
+		k2 = ROTL64(k2, 33);
+		k2 *= DIGEST_C1;
+		h2 ^= k2;
+	}
+	if(d->blen)
+	{
+		k1 *= DIGEST_C1;
+		k1 = ROTL64(k1, 31);
+		k1 *= DIGEST_C2;
+		h1 ^= k1;
+	}
+	h1 ^= d->len;
+	h2 ^= d->len;
+	h1 += h2;
+	h2 += h1;
+	h1 = digest_fmix(h1);
+	h2 = digest_fmix(h2);
+	h1 += h2;
+	h2 += h1;
+	sprintf(hex, "%016llx%016llx", (unsigned long long) h1, (unsigned long long) h2);
+}
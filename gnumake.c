@@ -70,6 +70,7 @@ gnumake_detect(build_context_t *ctx)
 	if(ctx->project && !S_ISDIR(ctx->sbuf.st_mode))
 	{
 		/* We can't really detect whether something's a Makefile or not */
+		ctx->detected = ctx->project;
 		return 1;
 	}
 	if(ctx->project)
@@ -104,6 +105,7 @@ gnumake_detect(build_context_t *ctx)
 		if(!access(pbuf, R_OK))
 		{
 			ctx->project = pbuf;
+			ctx->detected = pbuf;
 			return 1;
 		}
 	}
@@ -131,6 +133,10 @@ gnumake_build(build_context_t *ctx)
 		gnumake_args(cmd, ctx);
 	}
 	r = cmd_spawn(cmd, 0);
+	if(!r && !ctx->dryrun)
+	{
+		resource_record(ctx, cmd->stats.maxrss);
+	}
 	cmd_destroy(cmd);
 	return r;
 }
@@ -179,6 +185,35 @@ gnumake_clean(build_context_t *ctx)
 	return r;
 }
 
+/* The products are the targets in make's database */
+int
+gnumake_products(build_context_t *ctx, int run, build_defn_t **products)
+{
+	cmd_t *cmd;
+	int r;
+
+	*products = NULL;
+	cmd = context_cmd_create(ctx, "gnumake", "gmake", "make", NULL, "BUILD_MAKE", "MAKE", NULL);
+	if(ctx->project && ctx->vt == &gnumake_handler)
+	{
+		cmd_arg_addf(cmd, "-f%s", ctx->project);
+		gnumake_args(cmd, ctx);
+	}
+	else
+	{
+		/* Otherwise, the makefile is the one which configure generates */
+		if(access("Makefile", F_OK))
+		{
+			cmd_destroy(cmd);
+			return 1;
+		}
+		cmd_arg_add(cmd, "-fMakefile");
+	}
+	r = products_make(ctx, cmd, run, products);
+	cmd_destroy(cmd);
+	return r;
+}
+
 build_handler_t gnumake_handler = {
 	"gnumake",
 	"Builds Makefile-based projects with GNU Make",
@@ -189,4 +224,5 @@ build_handler_t gnumake_handler = {
 	gnumake_install,
 	gnumake_clean,
 	NULL,
+	gnumake_products
 };
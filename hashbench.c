@@ -0,0 +1,94 @@
+/* Copyright 2013 Mo McRoberts.
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ */
+
+#ifdef HAVE_CONFIG_H
+# include "config.h"
+#endif
+
+#include "p_build.h"
+
+/* A benchmark for tree_scan(), built with 'make hashbench'.
+ *
+ * The tree is scanned three times: once reading every file, once more
+ * to populate the index (in DIR/.build/tree), and then using it, as a
+ * build would once the index is warm. Whether the first scan is served
+ * from the page cache depends on what has read the tree recently; drop
+ * the caches beforehand to measure reading from disk.
+ */
+
+static const char *const ignore[] = { ".build", ".git", ".hg", ".svn", NULL };
+
+static int
+bench(build_context_t *ctx, const char *label, const char *root, int flags, int nthreads)
+{
+	struct timeval start, end;
+	tree_t *tree;
+	double secs;
+
+	gettimeofday(&start, NULL);
+	if(!(tree = tree_scan(ctx, root, ignore, flags, nthreads)))
+	{
+		return -1;
+	}
+	gettimeofday(&end, NULL);
+	secs = (end.tv_sec - start.tv_sec) + (end.tv_usec - start.tv_usec) / 1000000.0;
+	if(secs <= 0)
+	{
+		secs = 0.000001;
+	}
+	printf("%s: %lu files (%.1f MiB) in %.3fs: %.0f files/s; read %lu files (%.1f MiB) at %.2f GB/s\n",
+		   label, (unsigned long) tree->count, tree->bytes / 1048576.0, secs, tree->count / secs,
+		   (unsigned long) tree->hashed, tree->hashbytes / 1048576.0, tree->hashbytes / secs / 1000000000.0);
+	tree_free(tree);
+	return 0;
+}
+
+int
+main(int argc, char **argv)
+{
+	build_context_t ctx;
+	int c, nthreads;
+
+	memset(&ctx, 0, sizeof(ctx));
+	ctx.progname = "hashbench";
+	nthreads = 0;
+	while((c = getopt(argc, argv, "j:v")) != -1)
+	{
+		switch(c)
+		{
+		case 'j':
+			nthreads = atoi(optarg);
+			break;
+		case 'v':
+			ctx.verbose = 1;
+			break;
+		default:
+			fprintf(stderr, "Usage: %s [-v] [-jTHREADS] DIR\n", argv[0]);
+			return 1;
+		}
+	}
+	if(optind + 1 != argc)
+	{
+		fprintf(stderr, "Usage: %s [-v] [-jTHREADS] DIR\n", argv[0]);
+		return 1;
+	}
+	if(bench(&ctx, "full", argv[optind], TREE_DIGEST, nthreads) ||
+	   bench(&ctx, "indexing", argv[optind], TREE_DIGEST|TREE_INDEX, nthreads) ||
+	   bench(&ctx, "indexed", argv[optind], TREE_DIGEST|TREE_INDEX, nthreads))
+	{
+		return 1;
+	}
+	return 0;
+}
@@ -0,0 +1,262 @@
+/* Copyright 2013 Mo McRoberts.
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ */
+
+#ifdef HAVE_CONFIG_H
+# include "config.h"
+#endif
+
+#include "p_build.h"
+
+/* GNU Make jobserver support.
+ *
+ * A jobserver is a pipe (or, with GNU Make 4.4 and later, a named FIFO)
+ * pre-loaded with one byte per job slot, less one: every process in the
+ * tree implicitly owns a single slot, and must read a token from the
+ * pipe before starting any additional jobs, writing it back when the job
+ * completes. The location of the pipe is passed down through MAKEFLAGS.
+ *
+ * If we're invoked by a make which is running a jobserver, we attach to
+ * it as a client; otherwise, if more than one job has been requested (or
+ * chosen automatically, if --jobs wasn't given), we create one ourselves,
+ * so that the makes we launch share our job slots rather than choosing
+ * their own.
+ */
+
+static int jsread = -1;
+static int jswrite = -1;
+
+static int
+jobserver_nonblock(int fd)
+{
+	int fl;
+
+	if((fl = fcntl(fd, F_GETFL)) < 0)
+	{
+		return -1;
+	}
+	return fcntl(fd, F_SETFL, fl | O_NONBLOCK);
+}
+
+/* Locate the (last) jobserver option within MAKEFLAGS, returning
+ * a copy of its value.
+ */
+static char *
+jobserver_find(const char *flags)
+{
+	static const char *opts[] = { "--jobserver-auth=", "--jobserver-fds=", NULL };
+	const char *p, *match;
+	size_t c, l;
+	char *value;
+
+	match = NULL;
+	for(c = 0; opts[c]; c++)
+	{
+		l = strlen(opts[c]);
+		for(p = flags; (p = strstr(p, opts[c])); p += l)
+		{
+			match = p + l;
+		}
+		if(match)
+		{
+			break;
+		}
+	}
+	if(!match)
+	{
+		return NULL;
+	}
+	for(l = 0; match[l] && match[l] != ' ' && match[l] != '\t'; l++)
+	{
+	}
+	if(!(value = calloc(1, l + 1)))
+	{
+		return NULL;
+	}
+	memcpy(value, match, l);
+	return value;
+}
+
+static int
+jobserver_attach(build_context_t *ctx, const char *auth)
+{
+	int r, w;
+
+	if(!strncmp(auth, "fifo:", 5))
+	{
+		/* Open the FIFO ourselves so that we have our own file
+		 * description, and can safely make it non-blocking.
+		 */
+		if((jsread = open(auth + 5, O_RDWR|O_NONBLOCK)) < 0)
+		{
+			context_msg(ctx, MSG_ERROR, "warning: jobserver unavailable (%s: %s): using -j1\n", auth + 5, strerror(errno));
+			return -1;
+		}
+		jswrite = jsread;
+		context_msg(ctx, MSG_INFO, "using jobserver at %s\n", auth + 5);
+		return 0;
+	}
+	if(sscanf(auth, "%d,%d", &r, &w) != 2 || r < 0 || w < 0 ||
+	   fcntl(r, F_GETFD) < 0 || fcntl(w, F_GETFD) < 0)
+	{
+		context_msg(ctx, MSG_ERROR, "warning: jobserver unavailable: using -j1.  Add `+' to parent make rule.\n");
+		return -1;
+	}
+	/* GNU Make itself makes the read side non-blocking, and copes with
+	 * somebody else taking the token first.
+	 */
+	jobserver_nonblock(r);
+	jsread = r;
+	jswrite = w;
+	context_msg(ctx, MSG_INFO, "using jobserver on descriptors %d,%d\n", r, w);
+	return 0;
+}
+
+static int
+jobserver_create(build_context_t *ctx)
+{
+	static char flagbuf[256];
+	int fds[2], c;
+	const char *flags;
+	char *buf;
+	size_t l;
+
+	if(pipe(fds) < 0)
+	{
+		context_msg(ctx, MSG_PERROR, "pipe()");
+		return -1;
+	}
+	for(c = 1; c < ctx->jobs; c++)
+	{
+		if(write(fds[1], "+", 1) != 1)
+		{
+			context_msg(ctx, MSG_PERROR, "write(jobserver)");
+			close(fds[0]);
+			close(fds[1]);
+			return -1;
+		}
+	}
+	jobserver_nonblock(fds[0]);
+	jsread = fds[0];
+	jswrite = fds[1];
+	snprintf(flagbuf, sizeof(flagbuf), " -j%d --jobserver-auth=%d,%d", ctx->jobs, fds[0], fds[1]);
+	if((flags = getenv("MAKEFLAGS")) && flags[0])
+	{
+		l = strlen(flags) + strlen(flagbuf) + 1;
+		if(!(buf = malloc(l)))
+		{
+			context_msg(ctx, MSG_PERROR, "malloc(%u)", (unsigned) l);
+			return -1;
+		}
+		snprintf(buf, l, "%s%s", flags, flagbuf);
+		setenv("MAKEFLAGS", buf, 1);
+		free(buf);
+	}
+	else
+	{
+		setenv("MAKEFLAGS", flagbuf, 1);
+	}
+	context_msg(ctx, MSG_INFO, "started jobserver with %d job slots\n", ctx->jobs);
+	return 0;
+}
+
+/* Attach to an existing jobserver, or create a new one if appropriate.
+ * Failure to do either is not fatal: we simply run one job at a time.
+ */
+int
+jobserver_init(build_context_t *ctx)
+{
+	const char *flags;
+	char *auth;
+	int r;
+
+	if((flags = getenv("MAKEFLAGS")) && (auth = jobserver_find(flags)))
+	{
+		r = jobserver_attach(ctx, auth);
+		free(auth);
+		if(r < 0)
+		{
+			ctx->jobs = 1;
+		}
+		return 0;
+	}
+	if(!ctx->jobs)
+	{
+		ctx->jobs = resource_jobs(ctx);
+	}
+	if(ctx->jobs > 1)
+	{
+		return jobserver_create(ctx);
+	}
+	return 0;
+}
+
+/* Return the descriptor which becomes readable when a job slot may be
+ * available, or -1 if there is no jobserver
+ */
+int
+jobserver_fd(void)
+{
+	return jsread;
+}
+
+/* Attempt to obtain a job slot in addition to the one we implicitly
+ * hold, without blocking. Returns 1 and stores the token if one was
+ * obtained, 0 if none is available right now.
+ */
+int
+jobserver_acquire(build_context_t *ctx, char *token)
+{
+	ssize_t r;
+
+	if(jsread < 0)
+	{
+		*token = '+';
+		return 1;
+	}
+	do
+	{
+		r = read(jsread, token, 1);
+	}
+	while(r < 0 && errno == EINTR);
+	if(r == 1)
+	{
+		return 1;
+	}
+	if(r < 0 && errno != EAGAIN && errno != EWOULDBLOCK)
+	{
+		context_msg(ctx, MSG_PERROR, "read(jobserver)");
+	}
+	return 0;
+}
+
+void
+jobserver_release(build_context_t *ctx, char token)
+{
+	ssize_t r;
+
+	if(jswrite < 0)
+	{
+		return;
+	}
+	do
+	{
+		r = write(jswrite, &token, 1);
+	}
+	while(r < 0 && errno == EINTR);
+	if(r != 1)
+	{
+		context_msg(ctx, MSG_PERROR, "write(jobserver)");
+	}
+}
@@ -26,6 +26,21 @@
 
 const char *nx_longopt = NULL;
 
+static int lastlong = -1;
+
+/* Prepare to parse a new argument vector */
+void
+nx_getopt_reset(void)
+{
+	lastlong = -1;
+#ifdef __GLIBC__
+	/* Also discards any partially-scanned option cluster */
+	optind = 0;
+#else
+	optind = 1;
+#endif
+}
+
 int
 nx_getopt_long(int argc, char *const *argv, const char *shortopts, const struct nx_option *longopts, int *indexptr)
 {
@@ -33,7 +48,6 @@ nx_getopt_long(int argc, char *const *argv, const char *shortopts, const struct
 	char *op, *ap;
 	static char buf[32];
 	size_t l;
-	static int lastlong = -1;
 
 	lopterr = opterr;
 	opterr = optopt = 0;
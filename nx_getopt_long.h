@@ -36,6 +36,7 @@ extern "C" {
 # endif
 
 int nx_getopt_long(int argc, char *const *argv, const char *shortopts, const struct nx_option *longopts, int *indexptr);
+void nx_getopt_reset(void);
 
 # ifdef __cplusplus
 };
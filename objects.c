@@ -0,0 +1,508 @@
+/* Copyright 2013 Mo McRoberts.
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ */
+
+#ifdef HAVE_CONFIG_H
+# include "config.h"
+#endif
+
+#include <sys/time.h>
+
+#include "p_build.h"
+
+/* The build output cache.
+ *
+ * With --output-cache, a key is computed before the build phase from
+ * everything which determines its result: the contents of the project
+ * tree, the handler, the definitions, the build, host and target
+ * triplets (and configuration, SDK and product), and the identity of
+ * the toolchain. If a previous build with the same key completed, the
+ * files it produced are copied back into place instead of building;
+ * otherwise, once the build has succeeded, the files it created or
+ * changed are added to the cache. The same applies to the install
+ * phase, when DESTDIR is defined, using the files it installed beneath
+ * DESTDIR.
+ *
+ * Files are held once each, named after the digest of their contents,
+ * in the 'objects' subdirectory of the cache directory; the list of
+ * files belonging to each key is kept in 'objects/keys'.
+ */
+
+#define OBJECTS_TOOLS                   "cc", "c++", "gcc", "g++", "clang", "clang++", "ld", "ar", "as", "make", "gmake", "xcodebuild"
+#define OBJECTS_ENVS                    "CC", "CXX", "CPP", "CFLAGS", "CXXFLAGS", "CPPFLAGS", "LDFLAGS", "LIBS"
+
+/* Names which are never considered part of the tree: our own state,
+ * version control metadata, and the configure log, whose contents vary
+ * from one run to the next
+ */
+static const char *const objects_ignore[] = { ".build", ".git", ".hg", ".svn", "config.log", NULL };
+
+static char objkey[DIGEST_HEXLEN + 1];
+static build_defn_t *objsnap[PH_COUNT];
+
+static const char *objects_section(build_context_t *ctx, build_phase_t phase, const char **root);
+
+/* Record the stamp of each file beneath root in snap and, if d is not
+ * NULL, add the path, mode and contents of each to it
+ */
+static int
+objects_walk(build_context_t *ctx, const char *root, build_defn_t **snap, digest_t *d)
+{
+	tree_t *tree;
+	size_t c;
+
+	if(!(tree = tree_scan(ctx, root, objects_ignore, (d ? TREE_DIGEST|TREE_INDEX : 0), 0)))
+	{
+		return -1;
+	}
+	for(c = 0; c < tree->count; c++)
+	{
+		state_set(ctx, snap, tree->entries[c].path, tree->entries[c].stamp);
+		if(d)
+		{
+			digest_str(d, tree->entries[c].path);
+			digest_strf(d, "%o", (unsigned) (tree->entries[c].mode & 0777));
+			digest_str(d, tree->entries[c].digest);
+		}
+	}
+	tree_free(tree);
+	return 0;
+}
+
+/* Compute the cache key for the project in the current directory,
+ * recording the state of the tree as we go
+ */
+static int
+objects_compute(build_context_t *ctx)
+{
+	static const char *tools[] = { OBJECTS_TOOLS, NULL };
+	static const char *envs[] = { OBJECTS_ENVS, NULL };
+	build_defn_t *src;
+	struct stat st;
+	const char *path, *root;
+	digest_t d;
+	size_t c;
+
+	digest_init(&d);
+	if(context_digest_options(ctx, &d))
+	{
+		return -1;
+	}
+	for(c = 0; envs[c]; c++)
+	{
+		digest_str(&d, getenv(envs[c]));
+	}
+	for(c = 0; tools[c]; c++)
+	{
+		if((path = context_pathsearch(ctx, tools[c])) && !stat(path, &st))
+		{
+			digest_strf(&d, "%s:%s:%lld:%ld", tools[c], path, (long long) st.st_size, (long) st.st_mtime);
+		}
+	}
+	state_free(objsnap[PH_BUILD]);
+	objsnap[PH_BUILD] = NULL;
+	/* Out of tree, the build directory (which holds the configuration)
+	 * is part of the key along with the source tree
+	 */
+	objects_section(ctx, PH_BUILD, &root);
+	if(strcmp(root, "."))
+	{
+		src = NULL;
+		if(objects_walk(ctx, ".", &src, &d))
+		{
+			context_msg(ctx, MSG_ERROR, "failed to compute the build cache key\n");
+			state_free(src);
+			return -1;
+		}
+		state_free(src);
+		digest_str(&d, NULL);
+	}
+	if(objects_walk(ctx, root, &(objsnap[PH_BUILD]), &d))
+	{
+		context_msg(ctx, MSG_ERROR, "failed to compute the build cache key\n");
+		return -1;
+	}
+	digest_final(&d, objkey);
+	context_msg(ctx, MSG_INFO, "build cache key is %s\n", objkey);
+	return 0;
+}
+
+/* Return the location of an object in the store */
+static const char *
+objects_path(build_context_t *ctx, const char *hex)
+{
+	char sub[16];
+	const char *dir;
+
+	sprintf(sub, "objects/%.2s", hex);
+	if(!(dir = state_cachedir(ctx, sub)))
+	{
+		return NULL;
+	}
+	return state_path_in(ctx, dir, hex + 2);
+}
+
+/* Copy the file src to dest (via a temporary file), with the given mode
+ * and modification time
+ */
+static int
+objects_copy(build_context_t *ctx, const char *src, const char *dest, unsigned mode, const struct timeval *tv)
+{
+	char buf[65536], *tmp;
+	ssize_t r;
+	int in, out, err;
+
+	if(!(tmp = malloc(strlen(dest) + 32)))
+	{
+		return -1;
+	}
+	sprintf(tmp, "%s.%ld.tmp", dest, (long) getpid());
+	if((in = open(src, O_RDONLY)) < 0)
+	{
+		context_msg(ctx, MSG_PERROR, "%s", src);
+		free(tmp);
+		return -1;
+	}
+	if((out = open(tmp, O_WRONLY|O_CREAT|O_TRUNC, 0600)) < 0)
+	{
+		context_msg(ctx, MSG_PERROR, "%s", tmp);
+		close(in);
+		free(tmp);
+		return -1;
+	}
+	err = 0;
+	while((r = read(in, buf, sizeof(buf))) != 0)
+	{
+		if(r < 0)
+		{
+			if(errno == EINTR)
+			{
+				continue;
+			}
+			err = -1;
+			break;
+		}
+		if(daemon_writeall(out, buf, r))
+		{
+			err = -1;
+			break;
+		}
+	}
+	close(in);
+	if(close(out) < 0 || err || chmod(tmp, mode) < 0 || (tv && utimes(tmp, tv) < 0) || rename(tmp, dest) < 0)
+	{
+		context_msg(ctx, MSG_PERROR, "%s", dest);
+		unlink(tmp);
+		err = -1;
+	}
+	free(tmp);
+	return err;
+}
+
+/* Create the parent directories of path */
+static int
+objects_mkdirs(build_context_t *ctx, char *path)
+{
+	char *s;
+
+	for(s = path + 1; *s; s++)
+	{
+		if(*s != '/')
+		{
+			continue;
+		}
+		*s = 0;
+		if(mkdir(path, 0777) < 0 && errno != EEXIST)
+		{
+			context_msg(ctx, MSG_PERROR, "%s", path);
+			*s = '/';
+			return -1;
+		}
+		*s = '/';
+	}
+	return 0;
+}
+
+/* Return the section of the key's list belonging to a phase, and the
+ * directory which its paths are relative to
+ */
+static const char *
+objects_section(build_context_t *ctx, build_phase_t phase, const char **root)
+{
+	build_defn_t *p;
+
+	if(phase == PH_BUILD)
+	{
+		/* Out of tree, the results are in the build directory */
+		if(!(*root = context_objdir(ctx)))
+		{
+			*root = ".";
+		}
+		return "build";
+	}
+	if(phase == PH_INSTALL && (p = context_defn_find(ctx, "DESTDIR")) && p->value && p->value[0])
+	{
+		*root = p->value;
+		return "install";
+	}
+	return NULL;
+}
+
+/* Take the modification time of a freshly-written file, and apply it
+ * back to the file with the precision utimes() allows, so that it
+ * matches everything else restored alongside it exactly.
+ */
+static int
+objects_touch(build_context_t *ctx, const char *path, struct timeval *tv)
+{
+	struct stat sbuf;
+
+	if(stat(path, &sbuf) < 0)
+	{
+		context_msg(ctx, MSG_PERROR, "%s", path);
+		return -1;
+	}
+#ifdef __APPLE__
+	tv[0].tv_sec = sbuf.st_mtimespec.tv_sec;
+	tv[0].tv_usec = sbuf.st_mtimespec.tv_nsec / 1000;
+#else
+	tv[0].tv_sec = sbuf.st_mtim.tv_sec;
+	tv[0].tv_usec = sbuf.st_mtim.tv_nsec / 1000;
+#endif
+	tv[1] = tv[0];
+	if(utimes(path, tv) < 0)
+	{
+		context_msg(ctx, MSG_PERROR, "%s", path);
+		return -1;
+	}
+	return 0;
+}
+
+/* Forget the key and snapshots, so that they're computed afresh for the
+ * next build performed by this process
+ */
+void
+objects_reset(void)
+{
+	int c;
+
+	objkey[0] = 0;
+	for(c = 0; c < PH_COUNT; c++)
+	{
+		state_free(objsnap[c]);
+		objsnap[c] = NULL;
+	}
+}
+
+/* Before a phase is performed: if the cache holds the results of the
+ * same phase for the same inputs, put them in place and return 1;
+ * otherwise, make a note of the state of things and return 0.
+ */
+int
+objects_restore(build_context_t *ctx, build_phase_t phase)
+{
+	build_defn_t *kv, *p, *first;
+	const char *section, *root, *dir, *path;
+	char dest[4096], target[4096];
+	struct timeval tv[2];
+	unsigned long n;
+	size_t sl;
+	int err;
+
+	if(!ctx->outputcache || ctx->nocache || ctx->dryrun || !(section = objects_section(ctx, phase, &root)))
+	{
+		return 0;
+	}
+	if(!objkey[0] && objects_compute(ctx))
+	{
+		return 0;
+	}
+	if(phase != PH_BUILD)
+	{
+		state_free(objsnap[phase]);
+		objsnap[phase] = NULL;
+		if(objects_walk(ctx, root, &(objsnap[phase]), NULL))
+		{
+			return 0;
+		}
+	}
+	if(!(dir = state_cachedir(ctx, "objects/keys")) || !(path = state_path_in(ctx, dir, objkey)))
+	{
+		return 0;
+	}
+	kv = state_read(ctx, path);
+	if(!(p = state_find(kv, section)) || strcmp(p->value, "complete"))
+	{
+		state_free(kv);
+		return 0;
+	}
+	/* Everything restored shares a single modification time, so that
+	 * make considers it all to be up to date with respect to itself. The
+	 * time is taken from the first file written rather than the system
+	 * clock, because the filesystem's timestamps can lag behind it, and
+	 * a source file edited straight after a restore must still appear
+	 * newer than the outputs.
+	 */
+	first = NULL;
+	sl = strlen(section);
+	err = 0;
+	n = 0;
+	for(p = kv; p && !err; p = p->hh.next)
+	{
+		if(strncmp(p->name, section, sl) || p->name[sl] != '/')
+		{
+			continue;
+		}
+		snprintf(dest, sizeof(dest), "%s/%s", root, p->name + sl + 1);
+		if(objects_mkdirs(ctx, dest))
+		{
+			err = -1;
+			break;
+		}
+		if(!strncmp(p->value, "link ", 5))
+		{
+			snprintf(target, sizeof(target), "%s", p->value + 5);
+			unlink(dest);
+			if(symlink(target, dest) < 0)
+			{
+				context_msg(ctx, MSG_PERROR, "%s", dest);
+				err = -1;
+			}
+		}
+		else if(strlen(p->value) < DIGEST_HEXLEN + 2 || !(path = objects_path(ctx, p->value + strlen(p->value) - DIGEST_HEXLEN)) ||
+				objects_copy(ctx, path, dest, (unsigned) strtoul(p->value, NULL, 8), (first ? tv : NULL)))
+		{
+			err = -1;
+		}
+		else if(!first)
+		{
+			if(objects_touch(ctx, dest, tv))
+			{
+				err = -1;
+			}
+			first = p;
+		}
+		n++;
+	}
+	state_free(kv);
+	if(err)
+	{
+		context_msg(ctx, MSG_ERROR, "failed to restore the results of phase '%s' from the cache; performing it instead\n", context_phase_name(phase));
+		return 0;
+	}
+	context_msg(ctx, MSG_ECHO, "restored %lu file(s) from the cache for phase '%s'.\n", n, context_phase_name(phase));
+	return 1;
+}
+
+/* After a phase has been performed successfully, add whatever it
+ * created or changed to the cache
+ */
+int
+objects_save(build_context_t *ctx, build_phase_t phase)
+{
+	build_defn_t *after, *kv, *p;
+	const char *section, *root, *dir, *path, *prev;
+	char src[4096], target[4096], name[4200], value[4200], hex[DIGEST_HEXLEN + 1], *keypath;
+	struct stat st;
+	unsigned long n;
+	digest_t d;
+	ssize_t r;
+	int err;
+
+	if(!ctx->outputcache || ctx->nocache || ctx->dryrun || !objkey[0] || !(section = objects_section(ctx, phase, &root)))
+	{
+		return 0;
+	}
+	after = NULL;
+	if(objects_walk(ctx, root, &after, NULL))
+	{
+		state_free(after);
+		return -1;
+	}
+	if(!(dir = state_cachedir(ctx, "objects/keys")) || !(path = state_path_in(ctx, dir, objkey)) || !(keypath = strdup(path)))
+	{
+		state_free(after);
+		return -1;
+	}
+	kv = state_read(ctx, keypath);
+	err = 0;
+	n = 0;
+	for(p = after; p && !err; p = p->hh.next)
+	{
+		if((prev = state_get(objsnap[phase], p->name)) && !strcmp(prev, p->value))
+		{
+			continue;
+		}
+		if(strpbrk(p->name, "=\n"))
+		{
+			context_msg(ctx, MSG_INFO, "not caching the results of phase '%s': `%s' can't be recorded\n", context_phase_name(phase), p->name);
+			err = -1;
+			break;
+		}
+		snprintf(src, sizeof(src), "%s/%s", root, p->name);
+		if(lstat(src, &st) < 0)
+		{
+			err = -1;
+			break;
+		}
+		if(S_ISLNK(st.st_mode))
+		{
+			if((r = readlink(src, target, sizeof(target) - 1)) < 0)
+			{
+				err = -1;
+				break;
+			}
+			target[r] = 0;
+			snprintf(name, sizeof(name), "%s/%s", section, p->name);
+			snprintf(value, sizeof(value), "link %s", target);
+			state_set(ctx, &kv, name, value);
+			n++;
+			continue;
+		}
+		digest_init(&d);
+		if(digest_file(&d, src))
+		{
+			context_msg(ctx, MSG_PERROR, "%s", src);
+			err = -1;
+			break;
+		}
+		digest_final(&d, hex);
+		if(!(path = objects_path(ctx, hex)))
+		{
+			err = -1;
+			break;
+		}
+		if(access(path, F_OK) < 0 && objects_copy(ctx, src, path, 0444, NULL))
+		{
+			err = -1;
+			break;
+		}
+		snprintf(name, sizeof(name), "%s/%s", section, p->name);
+		state_setf(ctx, &kv, name, "%o %s", (unsigned) (st.st_mode & 07777), hex);
+		n++;
+	}
+	state_free(after);
+	if(!err)
+	{
+		state_set(ctx, &kv, section, "complete");
+		err = state_write(ctx, keypath, kv);
+	}
+	if(!err)
+	{
+		context_msg(ctx, MSG_INFO, "added %lu file(s) to the cache for phase '%s'\n", n, context_phase_name(phase));
+	}
+	state_free(kv);
+	free(keypath);
+	return err;
+}
@@ -23,10 +23,15 @@
 # include <unistd.h>
 # include <fcntl.h>
 # include <stdarg.h>
+# include <stdint.h>
 # include <spawn.h>
 # include <dirent.h>
 # include <sys/types.h>
 # include <sys/stat.h>
+# include <sys/wait.h>
+# include <sys/time.h>
+# include <sys/resource.h>
+# include <sys/file.h>
 
 # include "nx_getopt_long.h"
 
@@ -40,6 +45,15 @@
 #  define EXIT_FAILURE                  1
 # endif
 
+/* Output formats, for --format */
+# define FORMAT_TEXT                    0
+# define FORMAT_JSON                    1
+
+/* The default amount of output retained from each command in quiet mode */
+# define BUILD_TAIL_DEFAULT             (16 * 1024)
+/* The most that --tail may ask for */
+# define BUILD_TAIL_MAX                 (64 * 1024 * 1024)
+
 #define AUTODEP(ctx, a, r, st) a = ctx->isauto; ctx->isauto = 1; if(!ctx->only) { st; if(r) return r; } ctx->isauto = a;
 
 extern char **environ;
@@ -48,6 +62,45 @@ typedef struct build_context_s build_context_t;
 typedef struct build_handler_s build_handler_t;
 typedef struct build_defn_s build_defn_t;
 typedef struct cmd_s cmd_t;
+typedef struct build_workspace_s build_workspace_t;
+typedef struct digest_s digest_t;
+typedef struct build_stats_s build_stats_t;
+typedef struct supervisor_s supervisor_t;
+typedef struct supervisor_job_s supervisor_job_t;
+typedef struct tree_s tree_t;
+typedef struct tree_entry_s tree_entry_t;
+
+typedef enum
+{
+	PH_DISTCLEAN,
+	PH_CLEAN,
+	PH_PREPARE,
+	PH_CONFIG,
+	PH_BUILD,
+	PH_INSTALL
+} build_phase_t;
+
+/* The number of build phases */
+# define PH_COUNT                       (PH_INSTALL + 1)
+
+/* Resources consumed by spawned commands */
+struct build_stats_s
+{
+	unsigned long ncmds;
+	/* Times are in microseconds */
+	long long wall;
+	long long utime;
+	long long stime;
+	/* Peak RSS (in KiB) of the largest process run */
+	long maxrss;
+	long long inblock;
+	long long oublock;
+	long long nvcsw;
+	long long nivcsw;
+	/* Output captured in quiet mode */
+	unsigned long long outbytes;
+	unsigned long outlines;
+};
 
 struct build_context_s
 {
@@ -64,19 +117,45 @@ struct build_context_s
 	const char *config;
 	const char *sdk;
 	const char *remote;
+	/* The file which identified the project during detection */
+	const char *detected;
+	int jobs;
+	/* Bytes of output to retain from each command in quiet mode */
+	size_t tail;
+	const char *statsfile;
+	const char *tracefile;
+	/* Where a copy of the output of commands is written, if anywhere */
+	const char *logfile;
+	int logfd;
+	/* Copy the tree to the remote host before building there */
+	int sync;
+	/* Configure and build in .build/obj rather than in the tree */
+	int vpath;
 	build_defn_t *defs;
 	/* State */
 	struct stat sbuf;
 	int here;
+	char *statedir;
 	int quiet;
 	int verbose;
 	int only;
 	int dryrun;
+	/* With --dry-run, how the plan is presented */
+	int format;
+	int nocache;
+	int outputcache;
 	int isauto;
 	int prepared;
 	int configured;
 	int built;
 	int installed;
+	/* Phases (as bits, 1 << phase) completed by earlier invocations,
+	 * whose inputs haven't changed since
+	 */
+	int completed;
+	/* The phase currently being performed, and resource usage by phase */
+	build_phase_t phase;
+	build_stats_t stats[PH_COUNT];
 };
 
 struct build_handler_s
@@ -90,6 +169,8 @@ struct build_handler_s
 	int (*install)(build_context_t *context);
 	int (*clean)(build_context_t *context);
 	int (*distclean)(build_context_t *context);
+	/* List the products which can be built: see products.c */
+	int (*products)(build_context_t *context, int run, build_defn_t **products);
 };
 
 struct build_defn_s
@@ -105,17 +186,47 @@ struct cmd_s
 	size_t argc;
 	size_t argalloc;
 	char **argv;
+	/* Resources consumed when the command was last run */
+	build_stats_t stats;
 };
 
-typedef enum
+/* Length of a digest in hexadecimal form, excluding the terminator */
+# define DIGEST_HEXLEN                  32
+
+struct digest_s
 {
-	PH_DISTCLEAN,
-	PH_CLEAN,
-	PH_PREPARE,
-	PH_CONFIG,
-	PH_BUILD,
-	PH_INSTALL
-} build_phase_t;
+	uint64_t h1;
+	uint64_t h2;
+	uint64_t len;
+	unsigned char buf[16];
+	size_t blen;
+};
+
+/* Flags for tree_scan() */
+# define TREE_DIGEST                    (1<<0)
+# define TREE_INDEX                     (1<<1)
+
+/* A file or symbolic link found by tree_scan() */
+struct tree_entry_s
+{
+	/* Relative to the root of the scan */
+	char *path;
+	mode_t mode;
+	time_t mtime;
+	char stamp[96];
+	/* Only with TREE_DIGEST */
+	char digest[DIGEST_HEXLEN + 1];
+};
+
+struct tree_s
+{
+	tree_entry_t *entries;
+	size_t count;
+	/* The total size of the files found, and of those actually read */
+	unsigned long long bytes;
+	unsigned long long hashbytes;
+	size_t hashed;
+};
 
 # define MSG_DEBUG -2
 # define MSG_INFO -1
@@ -132,12 +243,25 @@ extern "C" {
 
 	int context_msg(build_context_t *ctx, int verbosity, const char *fmt, ...);
 
+	const char *context_phase_name(build_phase_t phase);
+	build_phase_t context_path_phase(const char *path);
 	int context_build(build_context_t *ctx, build_phase_t phase, int isauto);
+	int context_run(build_context_t *ctx, const build_phase_t *phases, size_t nphases);
 
 	build_handler_t *context_detect(build_context_t *ctx);
+
+	const char *context_cache_get(const char *key);
+	int context_cache_set(build_context_t *ctx, const char *key, const char *value);
+	void context_cache_merge(build_context_t *ctx, build_defn_t *kv);
+	int context_cache_report(FILE *f);
+	void context_cache_load(build_context_t *ctx);
+	int context_cache_save(build_context_t *ctx);
 	
 	build_defn_t *context_defn_add(build_context_t *ctx, const char *name, const char *value);
 	build_defn_t *context_defn_find(build_context_t *ctx, const char *name);
+	int context_digest_options(build_context_t *ctx, digest_t *d);
+	const char *context_objdir(build_context_t *ctx);
+	int context_objdir_enter(build_context_t *ctx);
 
 	int context_chdir(build_context_t *ctx);
 	int context_returnwd(build_context_t *ctx);
@@ -154,6 +278,126 @@ extern "C" {
 
 	int cmd_destroy(cmd_t *cmd);
 
+	const char *state_path(build_context_t *ctx, const char *name);
+	const char *state_path_in(build_context_t *ctx, const char *dir, const char *name);
+	int state_init(build_context_t *ctx);
+	build_defn_t *state_find(build_defn_t *kv, const char *name);
+	const char *state_get(build_defn_t *kv, const char *name);
+	int state_set(build_context_t *ctx, build_defn_t **kv, const char *name, const char *value);
+	int state_setf(build_context_t *ctx, build_defn_t **kv, const char *name, const char *fmt, ...);
+	void state_unset(build_defn_t **kv, const char *name);
+	void state_free(build_defn_t *kv);
+	build_defn_t *state_fread(build_context_t *ctx, FILE *f);
+	int state_fwrite(FILE *f, build_defn_t *kv);
+	build_defn_t *state_read(build_context_t *ctx, const char *path);
+	int state_write(build_context_t *ctx, const char *path, build_defn_t *kv);
+	build_defn_t *state_load(build_context_t *ctx, const char *name);
+	int state_save(build_context_t *ctx, const char *name, build_defn_t *kv);
+	build_defn_t *state_load_dir(build_context_t *ctx, const char *dir, const char *name);
+	int state_save_dir(build_context_t *ctx, const char *dir, const char *name, build_defn_t *kv);
+	int state_remove(build_context_t *ctx, const char *name);
+	const char *state_cachepath(const char *sub);
+	const char *state_cachedir(build_context_t *ctx, const char *sub);
+	int state_lock(build_context_t *ctx, const char *path, int exclusive);
+	void state_unlock(int fd);
+
+	void digest_init(digest_t *d);
+	void digest_update(digest_t *d, const void *data, size_t len);
+	void digest_str(digest_t *d, const char *str);
+	void digest_strf(digest_t *d, const char *fmt, ...);
+	int digest_file(digest_t *d, const char *path);
+	void digest_final(digest_t *d, char *hex);
+
+	tree_t *tree_scan(build_context_t *ctx, const char *root, const char *const *ignore, int flags, int nthreads);
+	void tree_free(tree_t *tree);
+	void tree_stamp(const struct stat *st, char *buf, size_t len);
+
+	long resource_cpus(build_context_t *ctx);
+	int resource_jobs(build_context_t *ctx);
+	int resource_record(build_context_t *ctx, long maxrss);
+
+	void stats_rusage(build_stats_t *stats, const struct rusage *ru, long long wall);
+	void stats_add(build_stats_t *total, const build_stats_t *stats);
+	int stats_report(build_context_t *ctx);
+
+	long long trace_now(void);
+	int trace_init(build_context_t *ctx, int create);
+	void trace_event(build_context_t *ctx, const char *cat, const char *name, long long start, long long end, const char *detail, int status);
+
+	int daemon_active(void);
+	int daemon_client(build_context_t *ctx, int argc, char **argv);
+	int daemon_serve(build_context_t *ctx, int (*runner)(int argc, char **argv));
+	int daemon_writeall(int fd, const void *buf, size_t len);
+	int daemon_readall(int fd, void *buf, size_t len);
+	int daemon_connect(const char *path);
+	int daemon_listen(build_context_t *ctx, const char *path);
+
+	int remote_active(void);
+	int remote_client(build_context_t *ctx, int argc, char **argv);
+	int remote_worker(build_context_t *ctx, const char *path, int (*runner)(int argc, char **argv));
+	int remote_send(int fd, char type, const void *buf, size_t len);
+	int remote_recv(int fd, char *type, char **buf, size_t *len);
+
+	int sync_client(build_context_t *ctx, int rfd, int wfd);
+	char *sync_worker(build_context_t *ctx, int rfd, int wfd, const char *payload, size_t plen);
+
+	int jobserver_init(build_context_t *ctx);
+	int jobserver_acquire(build_context_t *ctx, char *token);
+	void jobserver_release(build_context_t *ctx, char token);
+	int jobserver_fd(void);
+
+	supervisor_t *supervisor_create(build_context_t *ctx);
+	void supervisor_destroy(supervisor_t *sup);
+	void supervisor_kill(supervisor_t *sup);
+	int supervisor_watch(supervisor_t *sup, int fd);
+	void supervisor_capture(supervisor_t *sup, size_t size);
+	void supervisor_log(supervisor_t *sup, int fd);
+	size_t supervisor_running(supervisor_t *sup);
+	supervisor_job_t *supervisor_spawn(supervisor_t *sup, const char *prefix, char *const *argv, void *data);
+	supervisor_job_t *supervisor_fork(supervisor_t *sup, const char *prefix, int (*fn)(void *data), void *data);
+	supervisor_job_t *supervisor_wait(supervisor_t *sup, int timeout);
+	pid_t supervisor_job_pid(supervisor_job_t *job);
+	int supervisor_job_status(supervisor_job_t *job);
+	const struct rusage *supervisor_job_rusage(supervisor_job_t *job);
+	long long supervisor_job_started(supervisor_job_t *job);
+	long long supervisor_job_elapsed(supervisor_job_t *job);
+	void *supervisor_job_data(supervisor_job_t *job);
+	size_t supervisor_job_output(supervisor_job_t *job, char *buf);
+	unsigned long long supervisor_job_outbytes(supervisor_job_t *job, unsigned long *lines);
+	void supervisor_job_free(supervisor_job_t *job);
+
+	build_workspace_t *workspace_create(build_context_t *ctx);
+	int workspace_add(build_workspace_t *ws, const char *path);
+	int workspace_batch(build_workspace_t *ws, const char *path);
+	int workspace_matrix(build_workspace_t *ws, const build_phase_t *phases, size_t nphases);
+	int workspace_run(build_workspace_t *ws, const build_phase_t *phases, size_t nphases);
+
+	int objects_restore(build_context_t *ctx, build_phase_t phase);
+	int objects_save(build_context_t *ctx, build_phase_t phase);
+	void objects_reset(void);
+
+	int products_make(build_context_t *ctx, cmd_t *cmd, int run, build_defn_t **products);
+	int products_check(build_context_t *ctx);
+	int products_list(build_context_t *ctx, const char *prefix);
+
+	void phases_load(build_context_t *ctx);
+	void phases_begin(build_context_t *ctx, build_phase_t phase);
+	void phases_end(build_context_t *ctx, build_phase_t phase, int r);
+	void phases_clear(build_context_t *ctx, build_phase_t phase);
+
+	const char *timing_cmdkey(cmd_t *cmd);
+	const char *timing_phasekey(build_context_t *ctx, build_phase_t phase);
+	long long timing_predict(build_context_t *ctx, const char *key);
+	long long timing_deviation(build_context_t *ctx, const char *key);
+	void timing_record(build_context_t *ctx, const char *key, long long usec);
+	int timing_save(build_context_t *ctx);
+
+	void plan_phase(build_context_t *ctx, build_phase_t phase, int run, const char *reason);
+	void plan_command(cmd_t *cmd);
+	int plan_report(build_context_t *ctx, int status);
+
+	int watch_run(build_context_t *ctx, const build_phase_t *phases, size_t nphases);
+
 # ifdef __cplusplus
 };
 # endif
@@ -0,0 +1,346 @@
+/* Copyright 2013 Mo McRoberts.
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ */
+
+#ifdef HAVE_CONFIG_H
+# include "config.h"
+#endif
+
+#include "p_build.h"
+
+/* Persistent phase state.
+ *
+ * Within a process, context_build() remembers which phases have been
+ * performed, so that they aren't performed again as prerequisites of
+ * later ones. The same is recorded in '.build/phases', so that a later
+ * invocation can skip prerequisites too: 'build install' after 'build'
+ * needn't prepare, configure and build all over again.
+ *
+ * Each record is filed under a digest of the options which affect the
+ * result (the handler, triplets, configuration, definitions, and so
+ * on), and holds a fingerprint of the phase's inputs: the stamps of the
+ * files in the tree which it depends upon (those which
+ * context_path_phase() maps to it or an earlier phase). The 'install'
+ * phase is recorded only when DESTDIR is set, along with a fingerprint
+ * of what's beneath DESTDIR, since that could be removed at any time.
+ *
+ * A phase is recorded with the fingerprint taken after it has been
+ * performed, since most phases write to the tree themselves: 'build'
+ * writes its outputs alongside its sources, and 'prepare' rewrites
+ * aclocal.m4 and configure. There's no telling a phase's outputs from an
+ * edit made to one of its own inputs while it was in progress, but if
+ * the inputs of an earlier phase (which a phase doesn't ordinarily
+ * write) changed in the meantime, it isn't recorded, and so is
+ * performed again next time.
+ *
+ * The tree is scanned when the records are loaded and after each phase
+ * is performed; the scan taken after one phase serves as the starting
+ * point of the next.
+ *
+ * Only prerequisites are skipped on the strength of these records: a
+ * phase which was asked for explicitly is always performed.
+ */
+
+#define PHASES_FILE                     "phases"
+
+static const char *const phases_ignore[] = { ".build", ".git", ".hg", ".svn", "autom4te.cache", "config.log", NULL };
+
+/* The fingerprints of the tree as it was last scanned, if that's still
+ * current
+ */
+static char phases_now[PH_COUNT][DIGEST_HEXLEN + 1];
+static int phases_known;
+
+/* The fingerprint of the inputs of the phase before each one, taken
+ * before it was performed
+ */
+static char phases_before[PH_COUNT][DIGEST_HEXLEN + 1];
+
+/* Return the value of DESTDIR, if it's set */
+static const char *
+phases_destdir(build_context_t *ctx)
+{
+	build_defn_t *p;
+
+	if((p = context_defn_find(ctx, "DESTDIR")) && p->value && p->value[0])
+	{
+		return p->value;
+	}
+	return NULL;
+}
+
+/* Return the name of the record for a phase */
+static const char *
+phases_key(build_context_t *ctx, build_phase_t phase)
+{
+	static char key[64];
+	char hex[DIGEST_HEXLEN + 1];
+	digest_t d;
+
+	digest_init(&d);
+	if(context_digest_options(ctx, &d))
+	{
+		return NULL;
+	}
+	digest_final(&d, hex);
+	snprintf(key, sizeof(key), "%s.%s", context_phase_name(phase), hex);
+	return key;
+}
+
+/* Fingerprint the inputs of each phase from 'prepare' onwards, with a
+ * single scan of the tree
+ */
+static int
+phases_fingerprint(build_context_t *ctx, char fp[PH_COUNT][DIGEST_HEXLEN + 1])
+{
+	digest_t d[PH_COUNT];
+	struct stat sbuf;
+	const char *objdir;
+	char path[4200];
+	tree_t *tree;
+	size_t n;
+	int c, configured;
+
+	if(!(tree = tree_scan(ctx, ".", phases_ignore, 0, 0)))
+	{
+		return -1;
+	}
+	for(c = PH_PREPARE; c < PH_COUNT; c++)
+	{
+		digest_init(&(d[c]));
+	}
+	for(n = 0; n < tree->count; n++)
+	{
+		for(c = context_path_phase(tree->entries[n].path); c < PH_COUNT; c++)
+		{
+			digest_str(&(d[c]), tree->entries[n].path);
+			digest_str(&(d[c]), tree->entries[n].stamp);
+		}
+	}
+	tree_free(tree);
+	/* Out of tree, the configuration lives in the build directory, which
+	 * might have been removed since
+	 */
+	if((objdir = context_objdir(ctx)))
+	{
+		snprintf(path, sizeof(path), "%s/config.status", objdir);
+		configured = (stat(path, &sbuf) == 0);
+		for(c = PH_CONFIG; c < PH_COUNT; c++)
+		{
+			digest_str(&(d[c]), (configured ? "configured" : NULL));
+		}
+	}
+	digest_str(&(d[PH_INSTALL]), phases_destdir(ctx));
+	for(c = PH_PREPARE; c < PH_COUNT; c++)
+	{
+		digest_final(&(d[c]), fp[c]);
+	}
+	return 0;
+}
+
+/* Bring phases_now up to date, unless nothing can have changed since the
+ * last scan
+ */
+static int
+phases_scan(build_context_t *ctx)
+{
+	if(!phases_known)
+	{
+		if(phases_fingerprint(ctx, phases_now))
+		{
+			return -1;
+		}
+		phases_known = 1;
+	}
+	return 0;
+}
+
+/* Fingerprint whatever has been installed beneath DESTDIR */
+static int
+phases_installed(build_context_t *ctx, char *hex)
+{
+	const char *destdir;
+	tree_t *tree;
+	digest_t d;
+	size_t n;
+
+	if(!(destdir = phases_destdir(ctx)) || !(tree = tree_scan(ctx, destdir, NULL, 0, 0)))
+	{
+		return -1;
+	}
+	digest_init(&d);
+	for(n = 0; n < tree->count; n++)
+	{
+		digest_str(&d, tree->entries[n].path);
+		digest_str(&d, tree->entries[n].stamp);
+	}
+	tree_free(tree);
+	digest_final(&d, hex);
+	return 0;
+}
+
+/* Determine which phases were completed by earlier invocations, and
+ * haven't been invalidated since
+ */
+void
+phases_load(build_context_t *ctx)
+{
+	char inst[DIGEST_HEXLEN + 1], *value;
+	build_defn_t *kv;
+	const char *key, *prev;
+	int c;
+
+	/* Anything might have changed since the last invocation */
+	ctx->completed = 0;
+	phases_known = 0;
+	if(!(kv = state_load(ctx, PHASES_FILE)))
+	{
+		return;
+	}
+	if(phases_scan(ctx))
+	{
+		state_free(kv);
+		return;
+	}
+	for(c = PH_PREPARE; c < PH_COUNT; c++)
+	{
+		if(!(key = phases_key(ctx, c)) || !(prev = state_get(kv, key)))
+		{
+			continue;
+		}
+		if(strncmp(prev, phases_now[c], DIGEST_HEXLEN) || (prev[DIGEST_HEXLEN] && prev[DIGEST_HEXLEN] != ' '))
+		{
+			continue;
+		}
+		if(c == PH_INSTALL)
+		{
+			value = (char *) prev + DIGEST_HEXLEN;
+			if(*value != ' ' || phases_installed(ctx, inst) || strcmp(value + 1, inst))
+			{
+				continue;
+			}
+		}
+		context_msg(ctx, MSG_INFO, "phase '%s' was completed by an earlier invocation, and its inputs haven't changed\n", context_phase_name(c));
+		ctx->completed |= (1 << c);
+	}
+	state_free(kv);
+}
+
+/* Note the state of the inputs to a phase before it's performed */
+void
+phases_begin(build_context_t *ctx, build_phase_t phase)
+{
+	phases_before[phase][0] = 0;
+	ctx->completed &= ~(1 << phase);
+	if(phase < PH_PREPARE)
+	{
+		/* 'clean' and 'distclean' remove things */
+		phases_known = 0;
+		return;
+	}
+	if(ctx->dryrun || phases_scan(ctx))
+	{
+		return;
+	}
+	strcpy(phases_before[phase], (phase > PH_PREPARE ? phases_now[phase - 1] : "-"));
+}
+
+/* Record the outcome of a phase, r being the handler's result */
+void
+phases_end(build_context_t *ctx, build_phase_t phase, int r)
+{
+	char inst[DIGEST_HEXLEN + 1], value[DIGEST_HEXLEN * 2 + 2];
+	build_defn_t *kv;
+	const char *key;
+	int record;
+
+	phases_known = 0;
+	if(phase < PH_PREPARE || ctx->dryrun || !(key = phases_key(ctx, phase)))
+	{
+		return;
+	}
+	/* Handlers return -255 when there was nothing to be done */
+	record = 0;
+	if(!phases_scan(ctx) && (!r || r == -255) && phases_before[phase][0] &&
+	   (phase == PH_PREPARE || !strcmp(phases_now[phase - 1], phases_before[phase])))
+	{
+		record = 1;
+		strcpy(value, phases_now[phase]);
+		if(phase == PH_INSTALL)
+		{
+			if(phases_installed(ctx, inst))
+			{
+				record = 0;
+			}
+			else
+			{
+				sprintf(value, "%s %s", phases_now[phase], inst);
+			}
+		}
+	}
+	kv = state_load(ctx, PHASES_FILE);
+	if(record)
+	{
+		state_set(ctx, &kv, key, value);
+		context_msg(ctx, MSG_DEBUG, "recorded the completion of phase '%s'\n", context_phase_name(phase));
+	}
+	else if(state_find(kv, key))
+	{
+		state_unset(&kv, key);
+	}
+	else
+	{
+		state_free(kv);
+		return;
+	}
+	state_save(ctx, PHASES_FILE, kv);
+	state_free(kv);
+}
+
+/* Forget that the phases from phase onwards were ever completed, for
+ * every configuration, as 'clean' and 'distclean' do
+ */
+void
+phases_clear(build_context_t *ctx, build_phase_t phase)
+{
+	build_defn_t *kv, *p, *tmp;
+	size_t l;
+	int c, n;
+
+	if(ctx->dryrun || !(kv = state_load(ctx, PHASES_FILE)))
+	{
+		return;
+	}
+	n = 0;
+	HASH_ITER(hh, kv, p, tmp)
+	{
+		for(c = phase; c < PH_COUNT; c++)
+		{
+			l = strlen(context_phase_name(c));
+			if(!strncmp(p->name, context_phase_name(c), l) && p->name[l] == '.')
+			{
+				HASH_DEL(kv, p);
+				free(p->name);
+				free(p);
+				n++;
+				break;
+			}
+		}
+	}
+	if(n)
+	{
+		state_save(ctx, PHASES_FILE, kv);
+	}
+	state_free(kv);
+}
@@ -0,0 +1,286 @@
+/* Copyright 2013 Mo McRoberts.
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ */
+
+#ifdef HAVE_CONFIG_H
+# include "config.h"
+#endif
+
+#include "p_build.h"
+
+/* Build plans.
+ *
+ * With --dry-run --format=json, nothing is executed, and instead of
+ * the usual commentary, the plan which would have been carried out is
+ * written to standard output as a JSON object: the handler which was
+ * detected, each phase which would be performed or skipped (and why),
+ * and the arguments of each command which would be run, along with
+ * predictions of how long each would take, based upon the timings
+ * recorded by earlier builds of the same project and configuration (and
+ * for each phase, how much those timings have varied).
+ *
+ * The plan is collected as context_build() proceeds; phases appear in
+ * the order in which they would be performed, with prerequisites first.
+ */
+
+typedef struct plan_cmd_s plan_cmd_t;
+typedef struct plan_step_s plan_step_t;
+
+struct plan_cmd_s
+{
+	char **argv;
+	size_t argc;
+	long long predicted;
+	plan_cmd_t *next;
+};
+
+struct plan_step_s
+{
+	build_phase_t phase;
+	int run;
+	char reason[128];
+	long long predicted;
+	long long deviation;
+	plan_cmd_t *cmds;
+	plan_cmd_t **cmdtail;
+	plan_step_t *next;
+};
+
+static plan_step_t *steps, **steptail = &steps, *current;
+
+/* Note that phase would be performed (if run is set) or skipped */
+void
+plan_phase(build_context_t *ctx, build_phase_t phase, int run, const char *reason)
+{
+	plan_step_t *step;
+
+	if(ctx->format != FORMAT_JSON)
+	{
+		return;
+	}
+	if(!(step = (plan_step_t *) calloc(1, sizeof(plan_step_t))))
+	{
+		context_msg(ctx, MSG_PERROR, "calloc(1, %u)", (unsigned) sizeof(plan_step_t));
+		return;
+	}
+	step->phase = phase;
+	step->run = run;
+	snprintf(step->reason, sizeof(step->reason), "%s", reason);
+	step->predicted = (run ? timing_predict(ctx, timing_phasekey(ctx, phase)) : 0);
+	step->deviation = (run ? timing_deviation(ctx, timing_phasekey(ctx, phase)) : 0);
+	step->cmdtail = &(step->cmds);
+	*steptail = step;
+	steptail = &(step->next);
+	if(run)
+	{
+		current = step;
+	}
+}
+
+/* Note a command which would be run by the current phase */
+void
+plan_command(cmd_t *cmd)
+{
+	plan_cmd_t *p;
+	size_t c;
+
+	if(cmd->context->format != FORMAT_JSON || !current)
+	{
+		return;
+	}
+	if(!(p = (plan_cmd_t *) calloc(1, sizeof(plan_cmd_t))) || !(p->argv = (char **) calloc(cmd->argc + 1, sizeof(char *))))
+	{
+		context_msg(cmd->context, MSG_PERROR, "calloc()");
+		free(p);
+		return;
+	}
+	for(c = 0; c < cmd->argc; c++)
+	{
+		if(!(p->argv[c] = strdup(cmd->argv[c])))
+		{
+			break;
+		}
+	}
+	p->argc = c;
+	p->predicted = timing_predict(cmd->context, timing_cmdkey(cmd));
+	*(current->cmdtail) = p;
+	current->cmdtail = &(p->next);
+}
+
+static void
+plan_quote(FILE *f, const char *str)
+{
+	fputc('"', f);
+	for(; str && *str; str++)
+	{
+		if(*str == '"' || *str == '\\')
+		{
+			fputc('\\', f);
+			fputc(*str, f);
+		}
+		else if((unsigned char) *str < 0x20)
+		{
+			fprintf(f, "\\u%04x", (unsigned) (unsigned char) *str);
+		}
+		else
+		{
+			fputc(*str, f);
+		}
+	}
+	fputc('"', f);
+}
+
+/* Write a duration in seconds, or null if it isn't known */
+static void
+plan_duration(FILE *f, long long usec)
+{
+	if(usec < 0)
+	{
+		fputs("null", f);
+	}
+	else
+	{
+		fprintf(f, "%lld.%06lld", usec / 1000000, usec % 1000000);
+	}
+}
+
+static void
+plan_option(FILE *f, const char *name, const char *value)
+{
+	fprintf(f, ",\n    ");
+	plan_quote(f, name);
+	fputs(": ", f);
+	if(value)
+	{
+		plan_quote(f, value);
+	}
+	else
+	{
+		fputs("null", f);
+	}
+}
+
+/* Write the plan to standard output and discard it */
+int
+plan_report(build_context_t *ctx, int status)
+{
+	plan_step_t *step;
+	plan_cmd_t *cmd;
+	build_defn_t *p;
+	long long total, sum;
+	char *cwd;
+	size_t c;
+
+	if(ctx->format != FORMAT_JSON)
+	{
+		return 0;
+	}
+	cwd = getcwd(NULL, 0);
+	fputs("{\n  \"project\": ", stdout);
+	plan_quote(stdout, cwd);
+	free(cwd);
+	fputs(",\n  \"handler\": ", stdout);
+	plan_quote(stdout, ctx->vt->name);
+	fputs(",\n  \"options\": {\n    \"project\": ", stdout);
+	if(ctx->project)
+	{
+		plan_quote(stdout, ctx->project);
+	}
+	else
+	{
+		fputs("null", stdout);
+	}
+	plan_option(stdout, "product", ctx->product);
+	plan_option(stdout, "build", ctx->build);
+	plan_option(stdout, "host", ctx->host);
+	plan_option(stdout, "target", ctx->target);
+	plan_option(stdout, "config", ctx->config);
+	plan_option(stdout, "sdk", ctx->sdk);
+	fputs(",\n    \"defines\": {", stdout);
+	for(p = ctx->defs; p; p = p->hh.next)
+	{
+		fputs((p == ctx->defs ? "\n      " : ",\n      "), stdout);
+		plan_quote(stdout, p->name);
+		fputs(": ", stdout);
+		plan_quote(stdout, p->value);
+	}
+	fputs((ctx->defs ? "\n    }\n  },\n  \"steps\": [" : "}\n  },\n  \"steps\": ["), stdout);
+	total = 0;
+	for(step = steps; step; step = step->next)
+	{
+		fputs((step == steps ? "\n    {\n      \"phase\": " : ",\n    {\n      \"phase\": "), stdout);
+		plan_quote(stdout, context_phase_name(step->phase));
+		fprintf(stdout, ",\n      \"action\": \"%s\",\n      \"reason\": ", (step->run ? "run" : "skip"));
+		plan_quote(stdout, step->reason);
+		if(step->run)
+		{
+			/* Without a timing for the phase as a whole, the sum of its
+			 * commands' will do, if they're all known
+			 */
+			if(step->predicted < 0 && step->cmds)
+			{
+				for(sum = 0, cmd = step->cmds; cmd && sum >= 0; cmd = cmd->next)
+				{
+					sum = (cmd->predicted < 0 ? -1 : sum + cmd->predicted);
+				}
+				step->predicted = sum;
+			}
+			fputs(",\n      \"predicted\": ", stdout);
+			plan_duration(stdout, step->predicted);
+			fputs(",\n      \"deviation\": ", stdout);
+			plan_duration(stdout, step->deviation);
+			fputs(",\n      \"commands\": [", stdout);
+			for(cmd = step->cmds; cmd; cmd = cmd->next)
+			{
+				fputs((cmd == step->cmds ? "\n        { \"argv\": [" : ",\n        { \"argv\": ["), stdout);
+				for(c = 0; c < cmd->argc; c++)
+				{
+					fputs((c ? ", " : ""), stdout);
+					plan_quote(stdout, cmd->argv[c]);
+				}
+				fputs("], \"predicted\": ", stdout);
+				plan_duration(stdout, cmd->predicted);
+				fputs(" }", stdout);
+			}
+			fputs((step->cmds ? "\n      ]" : "]"), stdout);
+			if(total >= 0)
+			{
+				total = (step->predicted < 0 ? -1 : total + step->predicted);
+			}
+		}
+		fputs("\n    }", stdout);
+	}
+	fputs((steps ? "\n  ],\n  \"predicted\": " : "],\n  \"predicted\": "), stdout);
+	plan_duration(stdout, total);
+	fprintf(stdout, ",\n  \"status\": %d\n}\n", status);
+	fflush(stdout);
+	while((step = steps))
+	{
+		steps = step->next;
+		while((cmd = step->cmds))
+		{
+			step->cmds = cmd->next;
+			for(c = 0; c < cmd->argc; c++)
+			{
+				free(cmd->argv[c]);
+			}
+			free(cmd->argv);
+			free(cmd);
+		}
+		free(step);
+	}
+	steptail = &steps;
+	current = NULL;
+	return 0;
+}
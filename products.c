@@ -0,0 +1,529 @@
+/* Copyright 2013 Mo McRoberts.
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ */
+
+#ifdef HAVE_CONFIG_H
+# include "config.h"
+#endif
+
+#include "p_build.h"
+
+/* Products.
+ *
+ * A handler may be able to say which products can be built (via its
+ * 'products' method), so that --product can be checked before anything
+ * is started, and so that --list-products can list them. For make-based
+ * projects, the products are the targets in make's database, as printed
+ * by 'make -pqn'. Because that costs a full make startup, the parsed
+ * database is kept in '.build/products' (relative to the directory make
+ * runs in), along with the list of makefiles which make read and a
+ * digest of their contents and of make's command-line, and is used for
+ * as long as those remain the same.
+ *
+ * Within the table of products, each name maps to "target" or, for the
+ * target patterns of implicit rules (such as '%.o'), "pattern".
+ */
+
+#define PRODUCTS_FILE                   "products"
+/* The most suggestions offered for a product which doesn't exist */
+#define PRODUCTS_SUGGEST                5
+
+/* Add make's command-line, and the identity of make itself, to a digest */
+static void
+products_digest_cmd(cmd_t *cmd, digest_t *d)
+{
+	struct stat sbuf;
+	size_t c;
+
+	for(c = 0; c < cmd->argc; c++)
+	{
+		digest_str(d, cmd->argv[c]);
+	}
+	if(!stat(cmd->argv[0], &sbuf))
+	{
+		digest_strf(d, "%lld:%ld", (long long) sbuf.st_size, (long) sbuf.st_mtime);
+	}
+}
+
+/* Compute the digest of make's command-line and the contents of the
+ * space-separated list of makefiles it reads
+ */
+static int
+products_digest(build_context_t *ctx, cmd_t *cmd, const char *makefiles, char *hex)
+{
+	char *buf, *t, *saveptr;
+	digest_t d;
+
+	if(!(buf = strdup(makefiles)))
+	{
+		context_msg(ctx, MSG_PERROR, "strdup(...[%u])", (unsigned) strlen(makefiles));
+		return -1;
+	}
+	digest_init(&d);
+	products_digest_cmd(cmd, &d);
+	for(t = strtok_r(buf, " ", &saveptr); t; t = strtok_r(NULL, " ", &saveptr))
+	{
+		digest_str(&d, t);
+		if(digest_file(&d, t))
+		{
+			/* An optional include which doesn't exist (yet) */
+			digest_str(&d, NULL);
+		}
+	}
+	free(buf);
+	digest_final(&d, hex);
+	return 0;
+}
+
+/* Add the targets named on a line of the database, up to the colon, to
+ * the cache
+ */
+static void
+products_rule(build_context_t *ctx, build_defn_t **kv, char *line, int pattern)
+{
+	char *t, *saveptr, name[1024];
+
+	if(!(t = strchr(line, ':')) || strchr(line, '='))
+	{
+		return;
+	}
+	*t = 0;
+	for(t = strtok_r(line, " ", &saveptr); t; t = strtok_r(NULL, " ", &saveptr))
+	{
+		/* Special targets, suffix rules, hidden files, and patterns which
+		 * match anything aren't products
+		 */
+		if(t[0] == '.' || !strcmp(t, "%") || (!pattern && strchr(t, '%')))
+		{
+			continue;
+		}
+		snprintf(name, sizeof(name), "%s.%s", (pattern ? "pattern" : "target"), t);
+		state_set(ctx, kv, name, "");
+	}
+}
+
+/* Run make to print its database, and parse the output into the cache */
+static int
+products_run(build_context_t *ctx, cmd_t *cmd, build_defn_t **kv)
+{
+	enum { S_OTHER, S_IMPLICIT, S_FILES } section;
+	char *buf, *pending, **argv;
+	size_t bufsize, c;
+	ssize_t l;
+	int out[2], status, skip, done, null;
+	pid_t pid;
+	FILE *f;
+
+	if(!(argv = calloc(cmd->argc + 3, sizeof(char *))))
+	{
+		context_msg(ctx, MSG_PERROR, "calloc(%u, %u)", (unsigned) (cmd->argc + 3), (unsigned) sizeof(char *));
+		return -1;
+	}
+	memcpy(argv, cmd->argv, sizeof(char *) * cmd->argc);
+	/* Asking for .DEFAULT means that no goal is considered for building.
+	 * That doesn't make this entirely passive: GNU make still remakes any
+	 * makefile which is out of date, even with -n and -q, running its
+	 * recipe (automake's rule to re-run config.status, for example) and
+	 * re-executing itself afterwards. make then complains that there's
+	 * no rule for .DEFAULT, so its exit status says little.
+	 */
+	argv[cmd->argc] = "-pqn";
+	argv[cmd->argc + 1] = ".DEFAULT";
+	context_msg(ctx, MSG_INFO, "reading the database of %s\n", cmd->argv[0]);
+	if(pipe(out) < 0)
+	{
+		context_msg(ctx, MSG_PERROR, "pipe()");
+		free(argv);
+		return -1;
+	}
+	if((pid = fork()) < 0)
+	{
+		context_msg(ctx, MSG_PERROR, "fork()");
+		close(out[0]);
+		close(out[1]);
+		free(argv);
+		return -1;
+	}
+	if(!pid)
+	{
+		dup2(out[1], 1);
+		if((null = open("/dev/null", O_RDWR)) >= 0)
+		{
+			dup2(null, 0);
+			/* make's complaints are only of interest when the database
+			 * isn't what was expected, so are shown only when debug
+			 * messages are
+			 */
+			if(!ctx->verbose)
+			{
+				dup2(null, 2);
+			}
+		}
+		close(out[0]);
+		close(out[1]);
+		execv(argv[0], argv);
+		_exit(127);
+	}
+	close(out[1]);
+	free(argv);
+	if(!(f = fdopen(out[0], "r")))
+	{
+		context_msg(ctx, MSG_PERROR, "fdopen()");
+		close(out[0]);
+		waitpid(pid, &status, 0);
+		return -1;
+	}
+	buf = pending = NULL;
+	bufsize = 0;
+	section = S_OTHER;
+	skip = done = 0;
+	while((l = getline(&buf, &bufsize, f)) >= 0)
+	{
+		if(l && buf[l - 1] == '\n')
+		{
+			buf[--l] = 0;
+		}
+		/* make prints the database again after remaking makefiles and
+		 * re-executing itself, in which case the last one is wanted
+		 */
+		if(!strncmp(buf, "# Make data base,", 17))
+		{
+			state_free(*kv);
+			*kv = NULL;
+			free(pending);
+			pending = NULL;
+			section = S_OTHER;
+			skip = done = 0;
+			continue;
+		}
+		if(done || !strncmp(buf, "# Finished Make data base", 25))
+		{
+			done = 1;
+			continue;
+		}
+		if(!strncmp(buf, "MAKEFILE_LIST :=", 16))
+		{
+			for(c = 16; buf[c] == ' '; c++)
+			{
+			}
+			state_set(ctx, kv, "makefiles", buf + c);
+			continue;
+		}
+		if(buf[0] == '#')
+		{
+			if(!strcmp(buf, "# Implicit Rules"))
+			{
+				section = S_IMPLICIT;
+			}
+			else if(!strcmp(buf, "# Files"))
+			{
+				section = S_FILES;
+			}
+			else if(!strcmp(buf, "# Not a target:"))
+			{
+				skip = 1;
+			}
+			else if(!strncmp(buf, "#  recipe to execute", 20) && pending)
+			{
+				/* Only pattern rules with recipes can build anything */
+				products_rule(ctx, kv, pending, 1);
+				free(pending);
+				pending = NULL;
+			}
+			else if(!strcmp(buf, "# Variables") || !strcmp(buf, "# Directories") || !strcmp(buf, "# files hash-table stats:") ||
+					!strcmp(buf, "# VPATH Search Paths") || !strcmp(buf, "# Pattern-specific Variable Values"))
+			{
+				section = S_OTHER;
+			}
+			continue;
+		}
+		if(!buf[0] || buf[0] == '\t' || buf[0] == ' ' || section == S_OTHER)
+		{
+			continue;
+		}
+		if(section == S_IMPLICIT)
+		{
+			free(pending);
+			pending = strdup(buf);
+		}
+		else if(!skip)
+		{
+			products_rule(ctx, kv, buf, 0);
+		}
+		skip = 0;
+	}
+	free(pending);
+	free(buf);
+	fclose(f);
+	if(waitpid(pid, &status, 0) < 0 || !WIFEXITED(status) || WEXITSTATUS(status) == 127)
+	{
+		context_msg(ctx, MSG_ERROR, "failed to read the database of %s\n", cmd->argv[0]);
+		return -1;
+	}
+	return 0;
+}
+
+/* Determine the products of a make-based project, whose make command
+ * (including any -f option and definitions) is cmd. Returns 0 and a new
+ * table, 1 if there's no makefile (or, if run is not set, nothing
+ * cached), or -1 on error.
+ */
+int
+products_make(build_context_t *ctx, cmd_t *cmd, int run, build_defn_t **products)
+{
+	build_defn_t *kv, *p;
+	char hex[DIGEST_HEXLEN + 1];
+	const char *makefiles, *prev;
+
+	*products = NULL;
+	kv = state_load_dir(ctx, ".build", PRODUCTS_FILE);
+	if(!(makefiles = state_get(kv, "makefiles")) || !(prev = state_get(kv, "digest")) ||
+	   products_digest(ctx, cmd, makefiles, hex) || strcmp(prev, hex))
+	{
+		state_free(kv);
+		kv = NULL;
+		if(!run)
+		{
+			return 1;
+		}
+		if(products_run(ctx, cmd, &kv))
+		{
+			state_free(kv);
+			return -1;
+		}
+		if(!(makefiles = state_get(kv, "makefiles")) || !makefiles[0])
+		{
+			state_free(kv);
+			return 1;
+		}
+		if(products_digest(ctx, cmd, makefiles, hex))
+		{
+			state_free(kv);
+			return -1;
+		}
+		state_set(ctx, &kv, "digest", hex);
+		state_save_dir(ctx, ".build", PRODUCTS_FILE, kv);
+	}
+	else
+	{
+		context_msg(ctx, MSG_DEBUG, "using the cached database of %s\n", cmd->argv[0]);
+	}
+	for(p = kv; p; p = p->hh.next)
+	{
+		if(!strncmp(p->name, "target.", 7))
+		{
+			state_set(ctx, products, p->name + 7, "target");
+		}
+		else if(!strncmp(p->name, "pattern.", 8))
+		{
+			state_set(ctx, products, p->name + 8, "pattern");
+		}
+	}
+	state_free(kv);
+	return 0;
+}
+
+/* Does name match a target pattern containing a single '%'? */
+static int
+products_match(const char *pattern, const char *name)
+{
+	const char *pct;
+	size_t pl, sl, nl;
+
+	if(!(pct = strchr(pattern, '%')))
+	{
+		return 0;
+	}
+	pl = pct - pattern;
+	sl = strlen(pct + 1);
+	nl = strlen(name);
+	return (nl > pl + sl && !strncmp(name, pattern, pl) && !strcmp(name + nl - sl, pct + 1));
+}
+
+/* The edit distance between a and b, if it's small; otherwise, a number
+ * larger than limit
+ */
+static size_t
+products_distance(const char *a, const char *b, size_t limit)
+{
+	size_t la, lb, i, j, prev[64], cur[64], best;
+
+	la = strlen(a);
+	lb = strlen(b);
+	if(lb >= 64 || (la > lb ? la - lb : lb - la) > limit)
+	{
+		return limit + 1;
+	}
+	for(j = 0; j <= lb; j++)
+	{
+		prev[j] = j;
+	}
+	for(i = 1; i <= la; i++)
+	{
+		cur[0] = i;
+		best = cur[0];
+		for(j = 1; j <= lb; j++)
+		{
+			cur[j] = prev[j - 1] + (a[i - 1] != b[j - 1]);
+			if(prev[j] + 1 < cur[j])
+			{
+				cur[j] = prev[j] + 1;
+			}
+			if(cur[j - 1] + 1 < cur[j])
+			{
+				cur[j] = cur[j - 1] + 1;
+			}
+			if(cur[j] < best)
+			{
+				best = cur[j];
+			}
+		}
+		if(best > limit)
+		{
+			return limit + 1;
+		}
+		memcpy(prev, cur, sizeof(size_t) * (lb + 1));
+	}
+	return prev[lb];
+}
+
+static int
+products_cmp(const void *a, const void *b)
+{
+	return strcmp(*(char * const *) a, *(char * const *) b);
+}
+
+/* Return the sorted names of the targets beginning with prefix (or all
+ * of them), as an array of pointers into the table
+ */
+static const char **
+products_sorted(build_context_t *ctx, build_defn_t *products, const char *prefix, size_t *count)
+{
+	build_defn_t *p;
+	const char **names;
+	size_t n, pl;
+
+	*count = 0;
+	if(!(names = calloc(HASH_COUNT(products) + 1, sizeof(char *))))
+	{
+		context_msg(ctx, MSG_PERROR, "calloc(%u, %u)", (unsigned) (HASH_COUNT(products) + 1), (unsigned) sizeof(char *));
+		return NULL;
+	}
+	pl = (prefix ? strlen(prefix) : 0);
+	for(n = 0, p = products; p; p = p->hh.next)
+	{
+		if(!strcmp(p->value, "target") && (!pl || !strncmp(p->name, prefix, pl)))
+		{
+			names[n++] = p->name;
+		}
+	}
+	qsort(names, n, sizeof(char *), products_cmp);
+	*count = n;
+	return names;
+}
+
+/* Check that the product named by --product can be built, if the
+ * handler is able to say, before anything else is done. Products which
+ * exist as files, or which match a pattern rule, are accepted, as make
+ * would. In a dry run, make is only consulted if its database is
+ * already cached.
+ */
+int
+products_check(build_context_t *ctx)
+{
+	build_defn_t *products, *p;
+	const char **names;
+	struct stat sbuf;
+	size_t n, c, shown;
+	int r;
+
+	if(!ctx->product || !ctx->vt->products)
+	{
+		return 0;
+	}
+	if((r = ctx->vt->products(ctx, !ctx->dryrun, &products)))
+	{
+		/* Not configured yet, or there's no telling */
+		return (r < 0 ? -1 : 0);
+	}
+	if(state_find(products, ctx->product) || !stat(ctx->product, &sbuf))
+	{
+		state_free(products);
+		return 0;
+	}
+	for(p = products; p; p = p->hh.next)
+	{
+		if(!strcmp(p->value, "pattern") && products_match(p->name, ctx->product))
+		{
+			state_free(products);
+			return 0;
+		}
+	}
+	context_msg(ctx, MSG_FATAL, "there is no product named `%s'.\n", ctx->product);
+	if((names = products_sorted(ctx, products, NULL, &n)))
+	{
+		for(c = shown = 0; c < n && shown < PRODUCTS_SUGGEST; c++)
+		{
+			if(!strncmp(names[c], ctx->product, strlen(ctx->product)) || products_distance(ctx->product, names[c], 2) <= 2)
+			{
+				context_msg(ctx, MSG_ERROR, "%s `%s'\n", (shown ? "                  or" : "perhaps you meant"), names[c]);
+				shown++;
+			}
+		}
+		free(names);
+	}
+	context_msg(ctx, MSG_ERROR, "use --list-products to list the products which can be built.\n");
+	state_free(products);
+	return -1;
+}
+
+/* Write the names of the products beginning with prefix (or all of
+ * them) to standard output, one per line; used by --list-products
+ */
+int
+products_list(build_context_t *ctx, const char *prefix)
+{
+	build_defn_t *products;
+	const char **names;
+	size_t n, c;
+	int r;
+
+	if(!ctx->vt->products)
+	{
+		context_msg(ctx, MSG_FATAL, "the '%s' handler can't list its products.  Stop.\n", ctx->vt->name);
+		return 1;
+	}
+	if((r = ctx->vt->products(ctx, 1, &products)) < 0)
+	{
+		return 1;
+	}
+	if(r)
+	{
+		context_msg(ctx, MSG_FATAL, "no makefile could be found; configure the project first.  Stop.\n");
+		return 1;
+	}
+	if(!(names = products_sorted(ctx, products, prefix, &n)))
+	{
+		state_free(products);
+		return 1;
+	}
+	for(c = 0; c < n; c++)
+	{
+		puts(names[c]);
+	}
+	fflush(stdout);
+	free(names);
+	state_free(products);
+	return 0;
+}
@@ -0,0 +1,606 @@
+/* Copyright 2013 Mo McRoberts.
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ */
+
+#ifdef HAVE_CONFIG_H
+# include "config.h"
+#endif
+
+#include <sys/socket.h>
+#include <arpa/inet.h>
+#include <poll.h>
+#include <signal.h>
+
+#include "p_build.h"
+
+/* Remote execution.
+ *
+ * With --at=[USER@]HOST, build runs the request on another machine
+ * rather than locally: it starts `build --worker' there by way of ssh
+ * (or whatever $BUILD_RSH names), sends it the working directory and
+ * arguments, and relays the output and exit status of the build back.
+ * --at=unix:PATH instead connects to a worker listening on a local
+ * socket (`build --worker=PATH'), which is useful for testing.
+ *
+ * Both directions are a sequence of frames, each a type byte and a
+ * 32-bit length, followed by that many bytes:
+ *
+ *   'R'  client to worker: the request (directory and arguments,
+ *        each NUL-terminated)
+ *   'S'  client to worker: a one-byte signal to deliver to the build
+ *   'O'  worker to client: data written to standard output
+ *   'E'  worker to client: data written to standard error
+ *   'X'  worker to client: the 32-bit exit status; always the last frame
+ *
+ * The worker runs the build in the directory named by the request, so
+ * the source tree must be available at the same path on both machines.
+ */
+
+#define REMOTE_FRAME_MAX                16777216
+
+typedef struct remote_buf_s remote_buf_t;
+
+struct remote_buf_s
+{
+	char *buf;
+	size_t len;
+	size_t alloc;
+};
+
+static int inworker;
+static int remotefd = -1;
+
+/* Return non-zero if we're running a request on behalf of a client */
+int
+remote_active(void)
+{
+	return inworker;
+}
+
+/* Append to a growable buffer */
+static int
+remote_buf_add(remote_buf_t *b, const char *str, size_t len)
+{
+	char *p;
+	size_t n;
+
+	if(b->len + len > b->alloc)
+	{
+		for(n = (b->alloc ? b->alloc : 4096); n < b->len + len; n *= 2)
+		{
+		}
+		if(!(p = realloc(b->buf, n)))
+		{
+			return -1;
+		}
+		b->buf = p;
+		b->alloc = n;
+	}
+	memcpy(&(b->buf[b->len]), str, len);
+	b->len += len;
+	return 0;
+}
+
+int
+remote_send(int fd, char type, const void *buf, size_t len)
+{
+	unsigned char hdr[5];
+	uint32_t l;
+
+	hdr[0] = (unsigned char) type;
+	l = htonl((uint32_t) len);
+	memcpy(&(hdr[1]), &l, sizeof(l));
+	if(daemon_writeall(fd, hdr, sizeof(hdr)) || (len && daemon_writeall(fd, buf, len)))
+	{
+		return -1;
+	}
+	return 0;
+}
+
+/* Read a frame, returning its payload (which is NUL-terminated) in a
+ * new buffer
+ */
+int
+remote_recv(int fd, char *type, char **buf, size_t *len)
+{
+	unsigned char hdr[5];
+	uint32_t l;
+
+	*buf = NULL;
+	if(daemon_readall(fd, hdr, sizeof(hdr)))
+	{
+		return -1;
+	}
+	*type = (char) hdr[0];
+	memcpy(&l, &(hdr[1]), sizeof(l));
+	*len = ntohl(l);
+	if(*len > REMOTE_FRAME_MAX || !(*buf = malloc(*len + 1)))
+	{
+		return -1;
+	}
+	if(daemon_readall(fd, *buf, *len))
+	{
+		free(*buf);
+		*buf = NULL;
+		return -1;
+	}
+	(*buf)[*len] = 0;
+	return 0;
+}
+
+static void
+remote_client_signal(int sig)
+{
+	unsigned char frame[6];
+
+	frame[0] = 'S';
+	frame[1] = frame[2] = frame[3] = 0;
+	frame[4] = 1;
+	frame[5] = (unsigned char) sig;
+	if(remotefd >= 0 && write(remotefd, frame, sizeof(frame)) < 0)
+	{
+		_exit(128 + sig);
+	}
+}
+
+/* Start `build --worker' on host by way of $BUILD_RSH (by default,
+ * ssh), connected to us through a pair of pipes.
+ */
+static pid_t
+remote_rsh(build_context_t *ctx, const char *host, int *rfd, int *wfd)
+{
+	const char *rsh;
+	char *cmd, **argv, *p;
+	int in[2], out[2];
+	size_t n;
+	pid_t pid;
+
+	if(!(rsh = getenv("BUILD_RSH")) || !rsh[0])
+	{
+		rsh = "ssh";
+	}
+	if(!(cmd = strdup(rsh)) || !(argv = calloc(strlen(rsh) + 4, sizeof(char *))))
+	{
+		context_msg(ctx, MSG_PERROR, "malloc()");
+		free(cmd);
+		return -1;
+	}
+	n = 0;
+	for(p = strtok(cmd, " \t"); p; p = strtok(NULL, " \t"))
+	{
+		argv[n++] = p;
+	}
+	argv[n++] = (char *) host;
+	argv[n++] = "build";
+	argv[n++] = "--worker";
+	if(pipe(in) < 0)
+	{
+		context_msg(ctx, MSG_PERROR, "pipe()");
+		free(argv);
+		free(cmd);
+		return -1;
+	}
+	if(pipe(out) < 0)
+	{
+		context_msg(ctx, MSG_PERROR, "pipe()");
+		close(in[0]);
+		close(in[1]);
+		free(argv);
+		free(cmd);
+		return -1;
+	}
+	if((pid = fork()) < 0)
+	{
+		context_msg(ctx, MSG_PERROR, "fork()");
+		close(in[0]);
+		close(in[1]);
+		close(out[0]);
+		close(out[1]);
+		free(argv);
+		free(cmd);
+		return -1;
+	}
+	if(!pid)
+	{
+		/* Keep terminal signals away from the transport, so that
+		 * they're relayed to the build rather than cutting it off
+		 */
+		setpgid(0, 0);
+		dup2(in[0], 0);
+		dup2(out[1], 1);
+		close(in[0]);
+		close(in[1]);
+		close(out[0]);
+		close(out[1]);
+		execvp(argv[0], argv);
+		fprintf(stderr, "%s: %s: %s\n", ctx->progname, argv[0], strerror(errno));
+		_exit(127);
+	}
+	close(in[0]);
+	close(out[1]);
+	free(argv);
+	free(cmd);
+	*rfd = out[0];
+	*wfd = in[1];
+	return pid;
+}
+
+/* Pass an invocation to a worker, returning the exit status of the
+ * build
+ */
+int
+remote_client(build_context_t *ctx, int argc, char **argv)
+{
+	char *cwd, *buf, num[32], type;
+	remote_buf_t req;
+	size_t len;
+	uint32_t st;
+	int rfd, wfd, i, r, status;
+	pid_t pid;
+
+	rfd = wfd = -1;
+	pid = 0;
+	if(!strncmp(ctx->remote, "unix:", 5))
+	{
+		if((rfd = wfd = daemon_connect(ctx->remote + 5)) < 0)
+		{
+			context_msg(ctx, MSG_PERROR, "%s", ctx->remote + 5);
+			return 1;
+		}
+	}
+	else if((pid = remote_rsh(ctx, ctx->remote, &rfd, &wfd)) < 0)
+	{
+		return 1;
+	}
+	context_msg(ctx, MSG_DEBUG, "running build on %s\n", ctx->remote);
+	if(!(cwd = getcwd(NULL, 0)))
+	{
+		context_msg(ctx, MSG_PERROR, "getcwd()");
+		return 1;
+	}
+	memset(&req, 0, sizeof(req));
+	r = remote_buf_add(&req, cwd, strlen(cwd) + 1);
+	free(cwd);
+	sprintf(num, "%d", argc);
+	r |= remote_buf_add(&req, num, strlen(num) + 1);
+	for(i = 0; i < argc; i++)
+	{
+		r |= remote_buf_add(&req, argv[i], strlen(argv[i]) + 1);
+	}
+	if(r)
+	{
+		context_msg(ctx, MSG_PERROR, "malloc()");
+		return 1;
+	}
+	signal(SIGPIPE, SIG_IGN);
+	if(ctx->sync && sync_client(ctx, rfd, wfd))
+	{
+		context_msg(ctx, MSG_FATAL, "failed to synchronise with %s.  Stop.\n", ctx->remote);
+		free(req.buf);
+		return 1;
+	}
+	if(remote_send(wfd, 'R', req.buf, req.len))
+	{
+		context_msg(ctx, MSG_FATAL, "failed to send request to %s.  Stop.\n", ctx->remote);
+		free(req.buf);
+		return 1;
+	}
+	free(req.buf);
+	remotefd = wfd;
+	signal(SIGINT, remote_client_signal);
+	signal(SIGTERM, remote_client_signal);
+	signal(SIGHUP, remote_client_signal);
+	signal(SIGQUIT, remote_client_signal);
+	status = -1;
+	while(status < 0 && !remote_recv(rfd, &type, &buf, &len))
+	{
+		switch(type)
+		{
+		case 'O':
+			daemon_writeall(1, buf, len);
+			break;
+		case 'E':
+			daemon_writeall(2, buf, len);
+			break;
+		case 'X':
+			if(len == sizeof(st))
+			{
+				memcpy(&st, buf, sizeof(st));
+				status = (int) ntohl(st);
+			}
+			break;
+		}
+		free(buf);
+	}
+	remotefd = -1;
+	close(rfd);
+	if(wfd != rfd)
+	{
+		close(wfd);
+	}
+	if(pid > 0)
+	{
+		while(waitpid(pid, &r, 0) < 0 && errno == EINTR)
+		{
+		}
+	}
+	if(status < 0)
+	{
+		context_msg(ctx, MSG_FATAL, "lost connection to %s.  Stop.\n", ctx->remote);
+		return 1;
+	}
+	return status;
+}
+
+/* Run a request in the child of a worker, with its output sent to the
+ * pipes out and err
+ */
+static void
+remote_child(build_context_t *ctx, char *req, size_t len, int out, int err, int (*runner)(int argc, char **argv))
+{
+	char **argv, *p, *end;
+	int argc, i, fd;
+
+	setpgid(0, 0);
+	signal(SIGPIPE, SIG_DFL);
+	signal(SIGINT, SIG_DFL);
+	signal(SIGTERM, SIG_DFL);
+	signal(SIGHUP, SIG_DFL);
+	signal(SIGQUIT, SIG_DFL);
+	signal(SIGCHLD, SIG_DFL);
+	if((fd = open("/dev/null", O_RDONLY)) >= 0)
+	{
+		dup2(fd, 0);
+		close(fd);
+	}
+	dup2(out, 1);
+	dup2(err, 2);
+	close(out);
+	close(err);
+	end = req + len;
+	p = req;
+	if(chdir(p) < 0)
+	{
+		context_msg(ctx, MSG_PERROR, "%s", p);
+		_exit(EXIT_FAILURE);
+	}
+	p += strlen(p) + 1;
+	argc = atoi(p);
+	p += strlen(p) + 1;
+	if(argc < 1 || !(argv = calloc(argc + 1, sizeof(char *))))
+	{
+		_exit(EXIT_FAILURE);
+	}
+	for(i = 0; i < argc && p < end; i++)
+	{
+		argv[i] = p;
+		p += strlen(p) + 1;
+	}
+	inworker = 1;
+	nx_getopt_reset();
+	i = runner(argc, argv);
+	fflush(stdout);
+	fflush(stderr);
+	_exit(i);
+}
+
+/* Relay a single chunk of output from the build to the client */
+static int
+remote_relay(int fd, int wfd, char type, int *alive)
+{
+	char buf[16384];
+	ssize_t r;
+
+	if((r = read(fd, buf, sizeof(buf))) < 0 && errno == EINTR)
+	{
+		return 0;
+	}
+	if(r <= 0)
+	{
+		return -1;
+	}
+	if(*alive && remote_send(wfd, type, buf, r))
+	{
+		*alive = 0;
+	}
+	return 0;
+}
+
+/* Service a single request from the client at the other end of rfd and
+ * wfd
+ */
+static int
+remote_session(build_context_t *ctx, int rfd, int wfd, int (*runner)(int argc, char **argv))
+{
+	struct pollfd pfd[3];
+	char type, *req, *buf, *dir;
+	int out[2], err[2], alive, status;
+	size_t len, n;
+	uint32_t st;
+	pid_t pid;
+
+	if(remote_recv(rfd, &type, &req, &len))
+	{
+		return -1;
+	}
+	/* With --sync, the request is preceded by a manifest of the tree,
+	 * and is performed in our copy of it
+	 */
+	dir = NULL;
+	if(type == 'M')
+	{
+		dir = sync_worker(ctx, rfd, wfd, req, len);
+		free(req);
+		if(!dir || remote_recv(rfd, &type, &req, &len))
+		{
+			free(dir);
+			return -1;
+		}
+	}
+	if(dir && type == 'R' && len > strlen(req) + 1)
+	{
+		n = strlen(req) + 1;
+		if(!(buf = malloc(strlen(dir) + 1 + len - n + 1)))
+		{
+			free(dir);
+			free(req);
+			return -1;
+		}
+		strcpy(buf, dir);
+		memcpy(buf + strlen(dir) + 1, req + n, len - n + 1);
+		len = strlen(dir) + 1 + len - n;
+		free(req);
+		req = buf;
+	}
+	free(dir);
+	if(type != 'R' || !len)
+	{
+		context_msg(ctx, MSG_ERROR, "ignoring malformed request\n");
+		free(req);
+		return -1;
+	}
+	if(pipe(out) < 0 || pipe(err) < 0 || (pid = fork()) < 0)
+	{
+		context_msg(ctx, MSG_PERROR, "failed to start request");
+		free(req);
+		return -1;
+	}
+	if(!pid)
+	{
+		close(out[0]);
+		close(err[0]);
+		if(rfd > 2)
+		{
+			close(rfd);
+		}
+		if(wfd > 2 && wfd != rfd)
+		{
+			close(wfd);
+		}
+		remote_child(ctx, req, len, out[1], err[1], runner);
+	}
+	free(req);
+	close(out[1]);
+	close(err[1]);
+	context_msg(ctx, MSG_INFO, "started request %ld\n", (long) pid);
+	alive = 1;
+	pfd[0].fd = rfd;
+	pfd[1].fd = out[0];
+	pfd[2].fd = err[0];
+	pfd[0].events = pfd[1].events = pfd[2].events = POLLIN;
+	while(pfd[1].fd >= 0 || pfd[2].fd >= 0)
+	{
+		if(poll(pfd, 3, -1) < 0)
+		{
+			if(errno == EINTR)
+			{
+				continue;
+			}
+			context_msg(ctx, MSG_PERROR, "poll()");
+			break;
+		}
+		if(pfd[0].revents & (POLLIN|POLLHUP|POLLERR))
+		{
+			if(remote_recv(rfd, &type, &buf, &len))
+			{
+				context_msg(ctx, MSG_INFO, "client for request %ld went away\n", (long) pid);
+				kill(-pid, SIGTERM);
+				pfd[0].fd = -1;
+				alive = 0;
+			}
+			else
+			{
+				if(type == 'S' && len == 1)
+				{
+					kill(-pid, (unsigned char) buf[0]);
+				}
+				free(buf);
+			}
+		}
+		if((pfd[1].revents & (POLLIN|POLLHUP|POLLERR)) && remote_relay(out[0], wfd, 'O', &alive))
+		{
+			close(out[0]);
+			pfd[1].fd = -1;
+		}
+		if((pfd[2].revents & (POLLIN|POLLHUP|POLLERR)) && remote_relay(err[0], wfd, 'E', &alive))
+		{
+			close(err[0]);
+			pfd[2].fd = -1;
+		}
+	}
+	while(waitpid(pid, &status, 0) < 0)
+	{
+		if(errno != EINTR)
+		{
+			status = 255 << 8;
+			break;
+		}
+	}
+	context_msg(ctx, MSG_INFO, "request %ld finished\n", (long) pid);
+	/* Report an abnormal exit as a shell would */
+	st = htonl((uint32_t) (WIFSIGNALED(status) ? 128 + WTERMSIG(status) : WEXITSTATUS(status)));
+	if(alive)
+	{
+		remote_send(wfd, 'X', &st, sizeof(st));
+	}
+	return 0;
+}
+
+/* Run a worker. If path is NULL, a single request is read from standard
+ * input, as when we've been started by a client via ssh; otherwise, we
+ * listen on a Unix-domain socket at path and service requests until
+ * killed.
+ */
+int
+remote_worker(build_context_t *ctx, const char *path, int (*runner)(int argc, char **argv))
+{
+	int lfd, conn;
+	pid_t pid;
+
+	signal(SIGPIPE, SIG_IGN);
+	if(!path)
+	{
+		return (remote_session(ctx, 0, 1, runner) ? 1 : 0);
+	}
+	if((lfd = daemon_listen(ctx, path)) < 0)
+	{
+		return 1;
+	}
+	/* Sessions are never waited for */
+	signal(SIGCHLD, SIG_IGN);
+	context_msg(ctx, MSG_ECHO, "listening on %s\n", path);
+	for(;;)
+	{
+		if((conn = accept(lfd, NULL, NULL)) < 0)
+		{
+			if(errno == EINTR || errno == ECONNABORTED)
+			{
+				continue;
+			}
+			context_msg(ctx, MSG_PERROR, "accept()");
+			return 1;
+		}
+		if((pid = fork()) < 0)
+		{
+			context_msg(ctx, MSG_PERROR, "fork()");
+		}
+		else if(!pid)
+		{
+			close(lfd);
+			signal(SIGCHLD, SIG_DFL);
+			_exit(remote_session(ctx, conn, conn, runner) ? 1 : 0);
+		}
+		close(conn);
+	}
+}
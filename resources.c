@@ -0,0 +1,235 @@
+/* Copyright 2013 Mo McRoberts.
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ */
+
+#ifdef HAVE_CONFIG_H
+# include "config.h"
+#endif
+
+#ifdef HAVE_SCHED_GETAFFINITY
+# include <sched.h>
+#endif
+
+#include "p_build.h"
+
+/* Choosing a job count automatically.
+ *
+ * The job count is bounded by the number of CPUs we may run on (taking
+ * into account any affinity mask and cgroup CPU quota), and by the
+ * memory available divided by the peak resident set size of the largest
+ * single job seen during earlier builds of the same project, so that
+ * link-heavy projects don't push the machine into swap.
+ */
+
+#define RESOURCE_STATE                  "resources"
+#define RESOURCE_CGROUP_ROOT            "/sys/fs/cgroup"
+
+/* Read a single line from a file into buf */
+static int
+resource_readline(const char *path, char *buf, size_t len)
+{
+	FILE *f;
+
+	if(!(f = fopen(path, "r")))
+	{
+		return -1;
+	}
+	if(!fgets(buf, len, f))
+	{
+		fclose(f);
+		return -1;
+	}
+	fclose(f);
+	return 0;
+}
+
+/* Locate our cgroup (v2) directory, in a static buffer */
+static const char *
+resource_cgroup(void)
+{
+	static char path[sizeof(RESOURCE_CGROUP_ROOT) + 1024];
+	char buf[1024];
+	size_t l;
+
+	if(resource_readline("/proc/self/cgroup", buf, sizeof(buf)) || strncmp(buf, "0::", 3))
+	{
+		return NULL;
+	}
+	l = strlen(buf);
+	if(l && buf[l - 1] == '\n')
+	{
+		buf[l - 1] = 0;
+	}
+	snprintf(path, sizeof(path), "%s%s", RESOURCE_CGROUP_ROOT, buf + 3);
+	return path;
+}
+
+/* Return the number of CPUs available to us, allowing for affinity and
+ * any cgroup quota
+ */
+long
+resource_cpus(build_context_t *ctx)
+{
+	const char *cg;
+	char path[sizeof(RESOURCE_CGROUP_ROOT) + 1024 + 32], buf[256];
+	long cpus, quota, period, q;
+#ifdef HAVE_SCHED_GETAFFINITY
+	cpu_set_t set;
+#endif
+
+	if((cpus = sysconf(_SC_NPROCESSORS_ONLN)) < 1)
+	{
+		cpus = 1;
+	}
+#ifdef HAVE_SCHED_GETAFFINITY
+	if(!sched_getaffinity(0, sizeof(set), &set) && CPU_COUNT(&set) > 0 && CPU_COUNT(&set) < cpus)
+	{
+		cpus = CPU_COUNT(&set);
+	}
+#endif
+	quota = period = -1;
+	if((cg = resource_cgroup()))
+	{
+		snprintf(path, sizeof(path), "%s/cpu.max", cg);
+		if(!resource_readline(path, buf, sizeof(buf)) && strncmp(buf, "max", 3))
+		{
+			sscanf(buf, "%ld %ld", &quota, &period);
+		}
+	}
+	if(quota <= 0 && !resource_readline("/sys/fs/cgroup/cpu/cpu.cfs_quota_us", buf, sizeof(buf)))
+	{
+		quota = atol(buf);
+		if(!resource_readline("/sys/fs/cgroup/cpu/cpu.cfs_period_us", buf, sizeof(buf)))
+		{
+			period = atol(buf);
+		}
+	}
+	if(quota > 0 && period > 0)
+	{
+		q = (quota + period - 1) / period;
+		context_msg(ctx, MSG_DEBUG, "cgroup CPU quota allows %ld CPUs\n", q);
+		if(q < cpus)
+		{
+			cpus = q;
+		}
+	}
+	return (cpus < 1 ? 1 : cpus);
+}
+
+/* Return the memory available to us, in KiB, or zero if unknown */
+static long long
+resource_memory(build_context_t *ctx)
+{
+	const char *cg;
+	char path[sizeof(RESOURCE_CGROUP_ROOT) + 1024 + 32], buf[256];
+	long long avail, limit, used;
+	FILE *f;
+
+	avail = 0;
+	if((f = fopen("/proc/meminfo", "r")))
+	{
+		while(fgets(buf, sizeof(buf), f))
+		{
+			if(!strncmp(buf, "MemAvailable:", 13))
+			{
+				avail = atoll(buf + 13);
+				break;
+			}
+		}
+		fclose(f);
+	}
+#if defined(_SC_AVPHYS_PAGES) && defined(_SC_PAGESIZE)
+	if(!avail && sysconf(_SC_AVPHYS_PAGES) > 0)
+	{
+		avail = (long long) sysconf(_SC_AVPHYS_PAGES) * (sysconf(_SC_PAGESIZE) / 1024);
+	}
+#endif
+	if((cg = resource_cgroup()))
+	{
+		snprintf(path, sizeof(path), "%s/memory.max", cg);
+		if(!resource_readline(path, buf, sizeof(buf)) && strncmp(buf, "max", 3))
+		{
+			limit = atoll(buf) / 1024;
+			snprintf(path, sizeof(path), "%s/memory.current", cg);
+			used = (resource_readline(path, buf, sizeof(buf)) ? 0 : atoll(buf) / 1024);
+			context_msg(ctx, MSG_DEBUG, "cgroup memory limit is %lldKiB (%lldKiB in use)\n", limit, used);
+			if(limit > used && (!avail || limit - used < avail))
+			{
+				avail = limit - used;
+			}
+		}
+	}
+	return avail;
+}
+
+/* Select a job count for this project */
+int
+resource_jobs(build_context_t *ctx)
+{
+	build_defn_t *kv;
+	const char *p;
+	long cpus, jobs;
+	long long mem, rss;
+
+	cpus = resource_cpus(ctx);
+	mem = resource_memory(ctx);
+	kv = state_load(ctx, RESOURCE_STATE);
+	rss = ((p = state_get(kv, "maxrss")) ? atoll(p) : 0);
+	state_free(kv);
+	jobs = cpus;
+	if(mem > 0 && rss > 0)
+	{
+		/* Allow a quarter again for page cache and everything else */
+		if(mem / (rss + rss / 4) < jobs)
+		{
+			jobs = (long) (mem / (rss + rss / 4));
+		}
+	}
+	if(jobs < 1)
+	{
+		jobs = 1;
+	}
+	context_msg(ctx, MSG_INFO, "using %ld jobs (%ld CPUs, %lldKiB available, %lldKiB peak per job)\n", jobs, cpus, mem, rss);
+	return (int) jobs;
+}
+
+/* Record the peak resident set size (in KiB) of the largest process run
+ * by a build command. The recorded figure decays slowly, so that a
+ * no-op build doesn't immediately discard what we learned from a full
+ * one.
+ */
+int
+resource_record(build_context_t *ctx, long maxrss)
+{
+	build_defn_t *kv;
+	const char *p;
+	long long prev;
+	int r;
+
+	if(maxrss <= 0)
+	{
+		return 0;
+	}
+	kv = state_load(ctx, RESOURCE_STATE);
+	prev = ((p = state_get(kv, "maxrss")) ? atoll(p) : 0);
+	prev -= prev / 8;
+	if(prev < maxrss)
+	{
+		prev = maxrss;
+	}
+	state_setf(ctx, &kv, "maxrss", "%lld", prev);
+	r = state_save(ctx, RESOURCE_STATE, kv);
+	state_free(kv);
+	return r;
+}
@@ -0,0 +1,464 @@
+/* Copyright 2013 Mo McRoberts.
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ */
+
+#ifdef HAVE_CONFIG_H
+# include "config.h"
+#endif
+
+#include "p_build.h"
+
+/* Persistent per-project state.
+ *
+ * State is kept in a ".build" directory within the directory that build
+ * was invoked for (that is, after --dir has been applied), as a set of
+ * small files each containing NAME=VALUE lines. Files are replaced
+ * atomically when saved, so a reader never sees a partial update.
+ */
+
+#define STATE_DIR                       ".build"
+
+/* Return the path to the named file within a state (or cache)
+ * directory, in a static buffer
+ */
+const char *
+state_path_in(build_context_t *ctx, const char *dir, const char *name)
+{
+	static char *pbuf;
+	static size_t pbufsize;
+	size_t l;
+	char *p;
+
+	l = strlen(dir) + strlen(name) + 2;
+	if(l > pbufsize)
+	{
+		if(!(p = realloc(pbuf, l)))
+		{
+			context_msg(ctx, MSG_PERROR, "realloc(..., %u)", (unsigned) l);
+			return NULL;
+		}
+		pbuf = p;
+		pbufsize = l;
+	}
+	sprintf(pbuf, "%s/%s", dir, name);
+	return pbuf;
+}
+
+/* Return the path to the named state file, in a static buffer */
+const char *
+state_path(build_context_t *ctx, const char *name)
+{
+	if(!ctx->statedir)
+	{
+		return NULL;
+	}
+	return state_path_in(ctx, ctx->statedir, name);
+}
+
+/* Determine the location of the state directory; called once the
+ * working directory has been established.
+ */
+int
+state_init(build_context_t *ctx)
+{
+	char *cwd, *p;
+
+	if(!(cwd = getcwd(NULL, 0)))
+	{
+		context_msg(ctx, MSG_PERROR, "getcwd()");
+		return -1;
+	}
+	if(!(p = malloc(strlen(cwd) + strlen(STATE_DIR) + 2)))
+	{
+		context_msg(ctx, MSG_PERROR, "malloc(%u)", (unsigned) (strlen(cwd) + strlen(STATE_DIR) + 2));
+		free(cwd);
+		return -1;
+	}
+	sprintf(p, "%s/%s", (strcmp(cwd, "/") ? cwd : ""), STATE_DIR);
+	free(cwd);
+	ctx->statedir = p;
+	return 0;
+}
+
+build_defn_t *
+state_find(build_defn_t *kv, const char *name)
+{
+	build_defn_t *p;
+
+	HASH_FIND_STR(kv, name, p);
+	return p;
+}
+
+const char *
+state_get(build_defn_t *kv, const char *name)
+{
+	build_defn_t *p;
+
+	if((p = state_find(kv, name)))
+	{
+		return p->value;
+	}
+	return NULL;
+}
+
+/* Set (or replace) a value in a state table */
+int
+state_set(build_context_t *ctx, build_defn_t **kv, const char *name, const char *value)
+{
+	build_defn_t *p, *q;
+	size_t l;
+
+	if(!(p = malloc(sizeof(build_defn_t))))
+	{
+		context_msg(ctx, MSG_PERROR, "malloc(%u)", (unsigned) sizeof(build_defn_t));
+		return -1;
+	}
+	l = strlen(name) + strlen(value) + 2;
+	if(!(p->name = malloc(l)))
+	{
+		context_msg(ctx, MSG_PERROR, "malloc(%u)", (unsigned) l);
+		free(p);
+		return -1;
+	}
+	strcpy(p->name, name);
+	p->value = &(p->name[strlen(name) + 1]);
+	strcpy(p->value, value);
+	if((q = state_find(*kv, name)))
+	{
+		HASH_DEL(*kv, q);
+		free(q->name);
+		free(q);
+	}
+	HASH_ADD_KEYPTR(hh, *kv, p->name, strlen(p->name), p);
+	return 0;
+}
+
+int
+state_setf(build_context_t *ctx, build_defn_t **kv, const char *name, const char *fmt, ...)
+{
+	char buf[1024];
+	va_list ap;
+
+	va_start(ap, fmt);
+	vsnprintf(buf, sizeof(buf), fmt, ap);
+	va_end(ap);
+	return state_set(ctx, kv, name, buf);
+}
+
+/* Remove an entry from a table, if it's present */
+void
+state_unset(build_defn_t **kv, const char *name)
+{
+	build_defn_t *p;
+
+	if((p = state_find(*kv, name)))
+	{
+		HASH_DEL(*kv, p);
+		free(p->name);
+		free(p);
+	}
+}
+
+void
+state_free(build_defn_t *kv)
+{
+	build_defn_t *p, *tmp;
+
+	HASH_ITER(hh, kv, p, tmp)
+	{
+		HASH_DEL(kv, p);
+		free(p->name);
+		free(p);
+	}
+}
+
+/* Read NAME=VALUE lines from a stream into a new table; lines
+ * beginning with '#' are ignored.
+ */
+build_defn_t *
+state_fread(build_context_t *ctx, FILE *f)
+{
+	char *buf, *p;
+	build_defn_t *kv;
+	size_t bufsize;
+	ssize_t l;
+
+	kv = NULL;
+	buf = NULL;
+	bufsize = 0;
+	while((l = getline(&buf, &bufsize, f)) >= 0)
+	{
+		if(l && buf[l - 1] == '\n')
+		{
+			buf[l - 1] = 0;
+		}
+		if(buf[0] == '#' || !(p = strchr(buf, '=')))
+		{
+			continue;
+		}
+		*p = 0;
+		p++;
+		state_set(ctx, &kv, buf, p);
+	}
+	free(buf);
+	return kv;
+}
+
+int
+state_fwrite(FILE *f, build_defn_t *kv)
+{
+	build_defn_t *p;
+
+	for(p = kv; p; p = p->hh.next)
+	{
+		if(fprintf(f, "%s=%s\n", p->name, p->value) < 0)
+		{
+			return -1;
+		}
+	}
+	return 0;
+}
+
+/* Read a NAME=VALUE file into a new table */
+build_defn_t *
+state_read(build_context_t *ctx, const char *path)
+{
+	FILE *f;
+	build_defn_t *kv;
+
+	if(!(f = fopen(path, "r")))
+	{
+		return NULL;
+	}
+	kv = state_fread(ctx, f);
+	fclose(f);
+	return kv;
+}
+
+/* Write a table to the named file, replacing it atomically */
+int
+state_write(build_context_t *ctx, const char *path, build_defn_t *kv)
+{
+	char *tmp;
+	FILE *f;
+	int r;
+
+	if(!(tmp = malloc(strlen(path) + 32)))
+	{
+		context_msg(ctx, MSG_PERROR, "malloc(%u)", (unsigned) (strlen(path) + 32));
+		return -1;
+	}
+	sprintf(tmp, "%s.%ld.tmp", path, (long) getpid());
+	if(!(f = fopen(tmp, "w")))
+	{
+		context_msg(ctx, MSG_PERROR, "%s", tmp);
+		free(tmp);
+		return -1;
+	}
+	r = state_fwrite(f, kv);
+	if(fclose(f) || r || rename(tmp, path) < 0)
+	{
+		context_msg(ctx, MSG_PERROR, "%s", path);
+		unlink(tmp);
+		r = -1;
+	}
+	free(tmp);
+	return r;
+}
+
+/* Load the named file from the state directory dir, which will
+ * typically be a ".build" directory other than our own.
+ */
+build_defn_t *
+state_load_dir(build_context_t *ctx, const char *dir, const char *name)
+{
+	const char *path;
+
+	if(!(path = state_path_in(ctx, dir, name)))
+	{
+		return NULL;
+	}
+	return state_read(ctx, path);
+}
+
+int
+state_save_dir(build_context_t *ctx, const char *dir, const char *name, build_defn_t *kv)
+{
+	const char *path;
+
+	if(ctx->dryrun)
+	{
+		return 0;
+	}
+	if(mkdir(dir, 0777) < 0 && errno != EEXIST)
+	{
+		context_msg(ctx, MSG_PERROR, "%s", dir);
+		return -1;
+	}
+	if(!(path = state_path_in(ctx, dir, name)))
+	{
+		return -1;
+	}
+	return state_write(ctx, path, kv);
+}
+
+build_defn_t *
+state_load(build_context_t *ctx, const char *name)
+{
+	if(!ctx->statedir)
+	{
+		return NULL;
+	}
+	return state_load_dir(ctx, ctx->statedir, name);
+}
+
+int
+state_save(build_context_t *ctx, const char *name, build_defn_t *kv)
+{
+	if(!ctx->statedir)
+	{
+		return 0;
+	}
+	return state_save_dir(ctx, ctx->statedir, name, kv);
+}
+
+int
+state_remove(build_context_t *ctx, const char *name)
+{
+	const char *path;
+
+	if(ctx->dryrun || !(path = state_path(ctx, name)))
+	{
+		return 0;
+	}
+	if(unlink(path) < 0 && errno != ENOENT)
+	{
+		context_msg(ctx, MSG_PERROR, "%s", path);
+		return -1;
+	}
+	return 0;
+}
+
+/* Return the path to the shared cache directory (or the named
+ * subdirectory of it) in a static buffer, without creating it. The
+ * cache directory is $BUILD_CACHE_DIR, $XDG_CACHE_HOME/build, or
+ * $HOME/.cache/build, whichever is found first.
+ */
+const char *
+state_cachepath(const char *sub)
+{
+	static char pbuf[1024];
+	const char *p;
+	size_t l;
+
+	if((p = getenv("BUILD_CACHE_DIR")) && p[0])
+	{
+		snprintf(pbuf, sizeof(pbuf), "%s/%s", p, (sub ? sub : ""));
+	}
+	else if((p = getenv("XDG_CACHE_HOME")) && p[0])
+	{
+		snprintf(pbuf, sizeof(pbuf), "%s/build/%s", p, (sub ? sub : ""));
+	}
+	else if((p = getenv("HOME")) && p[0])
+	{
+		snprintf(pbuf, sizeof(pbuf), "%s/.cache/build/%s", p, (sub ? sub : ""));
+	}
+	else
+	{
+		return NULL;
+	}
+	if((l = strlen(pbuf)) > 1 && pbuf[l - 1] == '/')
+	{
+		pbuf[l - 1] = 0;
+	}
+	return pbuf;
+}
+
+/* Return the path to the shared cache directory (or the named
+ * subdirectory of it), creating it if needed (except in a dry run), in
+ * a static buffer.
+ */
+const char *
+state_cachedir(build_context_t *ctx, const char *sub)
+{
+	static char pbuf[1024];
+	const char *p;
+	char *s;
+
+	if(!(p = state_cachepath(sub)))
+	{
+		return NULL;
+	}
+	snprintf(pbuf, sizeof(pbuf), "%s", p);
+	if(ctx->dryrun)
+	{
+		return pbuf;
+	}
+	/* Create each component in turn */
+	for(s = pbuf + 1; *s; s++)
+	{
+		if(*s != '/')
+		{
+			continue;
+		}
+		*s = 0;
+		if(mkdir(pbuf, 0777) < 0 && errno != EEXIST)
+		{
+			context_msg(ctx, MSG_PERROR, "%s", pbuf);
+			return NULL;
+		}
+		*s = '/';
+	}
+	if(mkdir(pbuf, 0777) < 0 && errno != EEXIST)
+	{
+		context_msg(ctx, MSG_PERROR, "%s", pbuf);
+		return NULL;
+	}
+	return pbuf;
+}
+
+/* Obtain an advisory lock on path (which is created if needed),
+ * returning a descriptor to pass to state_unlock().
+ */
+int
+state_lock(build_context_t *ctx, const char *path, int exclusive)
+{
+	int fd;
+
+	if((fd = open(path, O_RDWR|O_CREAT, 0666)) < 0)
+	{
+		context_msg(ctx, MSG_PERROR, "%s", path);
+		return -1;
+	}
+	while(flock(fd, (exclusive ? LOCK_EX : LOCK_SH)) < 0)
+	{
+		if(errno != EINTR)
+		{
+			context_msg(ctx, MSG_PERROR, "flock(%s)", path);
+			close(fd);
+			return -1;
+		}
+	}
+	return fd;
+}
+
+void
+state_unlock(int fd)
+{
+	if(fd >= 0)
+	{
+		flock(fd, LOCK_UN);
+		close(fd);
+	}
+}
@@ -0,0 +1,170 @@
+/* Copyright 2013 Mo McRoberts.
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ */
+
+#ifdef HAVE_CONFIG_H
+# include "config.h"
+#endif
+
+#include "p_build.h"
+
+/* Resource accounting.
+ *
+ * cmd_spawn() records the resources used by each command it runs, and
+ * adds them to the totals for the phase being performed. Once the
+ * requested phases are complete, the totals are shown in verbose mode,
+ * and appended to the statistics file, if there is one.
+ */
+
+#define TV_USEC(tv)                     ((tv).tv_sec * 1000000LL + (tv).tv_usec)
+
+/* Fill in stats from the rusage of a single command */
+void
+stats_rusage(build_stats_t *stats, const struct rusage *ru, long long wall)
+{
+	stats->ncmds = 1;
+	stats->wall = wall;
+	stats->utime = TV_USEC(ru->ru_utime);
+	stats->stime = TV_USEC(ru->ru_stime);
+#ifdef __APPLE__
+	/* Darwin reports ru_maxrss in bytes rather than kilobytes */
+	stats->maxrss = ru->ru_maxrss / 1024;
+#else
+	stats->maxrss = ru->ru_maxrss;
+#endif
+	stats->inblock = ru->ru_inblock;
+	stats->oublock = ru->ru_oublock;
+	stats->nvcsw = ru->ru_nvcsw;
+	stats->nivcsw = ru->ru_nivcsw;
+}
+
+void
+stats_add(build_stats_t *total, const build_stats_t *stats)
+{
+	total->ncmds += stats->ncmds;
+	total->wall += stats->wall;
+	total->utime += stats->utime;
+	total->stime += stats->stime;
+	if(stats->maxrss > total->maxrss)
+	{
+		total->maxrss = stats->maxrss;
+	}
+	total->inblock += stats->inblock;
+	total->oublock += stats->oublock;
+	total->nvcsw += stats->nvcsw;
+	total->nivcsw += stats->nivcsw;
+	total->outbytes += stats->outbytes;
+	total->outlines += stats->outlines;
+}
+
+static void
+stats_show(build_context_t *ctx, const char *phase, const build_stats_t *s)
+{
+	context_msg(ctx, MSG_INFO, "%s%s%s: %lu command%s, %lld.%02llds elapsed, %lld.%02llds user, %lld.%02llds system, "
+				"%ldKiB peak RSS, %lld blocks in, %lld out, %lld+%lld context switches\n",
+				(phase ? "phase '" : "all phases"), (phase ? phase : ""), (phase ? "'" : ""), s->ncmds, (s->ncmds == 1 ? "" : "s"),
+				s->wall / 1000000, (s->wall % 1000000) / 10000,
+				s->utime / 1000000, (s->utime % 1000000) / 10000,
+				s->stime / 1000000, (s->stime % 1000000) / 10000,
+				s->maxrss, s->inblock, s->oublock, s->nvcsw, s->nivcsw);
+}
+
+static int
+stats_line(char *buf, size_t len, const char *project, const char *phase, const build_stats_t *s)
+{
+	return snprintf(buf, len, "project=%s\tphase=%s\tcommands=%lu\twall=%lld.%06lld\tuser=%lld.%06lld\tsys=%lld.%06lld\t"
+					"maxrss=%ld\tinblock=%lld\toublock=%lld\tnvcsw=%lld\tnivcsw=%lld\toutbytes=%llu\toutlines=%lu\n",
+					project, phase, s->ncmds,
+					s->wall / 1000000, s->wall % 1000000,
+					s->utime / 1000000, s->utime % 1000000,
+					s->stime / 1000000, s->stime % 1000000,
+					s->maxrss, s->inblock, s->oublock, s->nvcsw, s->nivcsw, s->outbytes, s->outlines);
+}
+
+/* Append the totals for this project to the statistics file. The whole
+ * record is written at once, so that concurrent builds sharing the same
+ * file (such as the projects in a workspace) don't interleave.
+ */
+static int
+stats_write(build_context_t *ctx, const build_stats_t *total)
+{
+	char *cwd, *buf, *p;
+	size_t len;
+	int fd, c, r;
+
+	if(!(cwd = getcwd(NULL, 0)))
+	{
+		context_msg(ctx, MSG_PERROR, "getcwd()");
+		return -1;
+	}
+	len = (PH_COUNT + 1) * (strlen(cwd) + 256);
+	if(!(buf = malloc(len)))
+	{
+		context_msg(ctx, MSG_PERROR, "malloc(%u)", (unsigned) len);
+		free(cwd);
+		return -1;
+	}
+	p = buf;
+	for(c = 0; c < PH_COUNT; c++)
+	{
+		if(ctx->stats[c].ncmds)
+		{
+			p += stats_line(p, len - (p - buf), cwd, context_phase_name(c), &(ctx->stats[c]));
+		}
+	}
+	p += stats_line(p, len - (p - buf), cwd, "total", total);
+	free(cwd);
+	if((fd = open(ctx->statsfile, O_WRONLY|O_APPEND|O_CREAT, 0666)) < 0)
+	{
+		context_msg(ctx, MSG_PERROR, "%s", ctx->statsfile);
+		free(buf);
+		return -1;
+	}
+	r = 0;
+	if(write(fd, buf, p - buf) != p - buf)
+	{
+		context_msg(ctx, MSG_PERROR, "%s", ctx->statsfile);
+		r = -1;
+	}
+	close(fd);
+	free(buf);
+	return r;
+}
+
+int
+stats_report(build_context_t *ctx)
+{
+	build_stats_t total;
+	int c;
+
+	memset(&total, 0, sizeof(total));
+	for(c = 0; c < PH_COUNT; c++)
+	{
+		if(ctx->stats[c].ncmds)
+		{
+			stats_show(ctx, context_phase_name(c), &(ctx->stats[c]));
+			stats_add(&total, &(ctx->stats[c]));
+		}
+	}
+	if(!total.ncmds)
+	{
+		return 0;
+	}
+	stats_show(ctx, NULL, &total);
+	if(ctx->statsfile)
+	{
+		return stats_write(ctx, &total);
+	}
+	return 0;
+}
@@ -0,0 +1,1188 @@
+/* Copyright 2013 Mo McRoberts.
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ */
+
+#ifdef HAVE_CONFIG_H
+# include "config.h"
+#endif
+
+#include <poll.h>
+#include <signal.h>
+#include <sys/uio.h>
+#ifdef HAVE_SYS_EPOLL_H
+# include <sys/epoll.h>
+#endif
+#ifdef HAVE_SYS_SYSCALL_H
+# include <sys/syscall.h>
+#endif
+
+#include "p_build.h"
+
+#if defined(HAVE_SPLICE) && defined(HAVE_TEE) && defined(SPLICE_F_NONBLOCK)
+# define USE_SPLICE                     1
+#endif
+
+/* The child process supervisor.
+ *
+ * A supervisor runs any number of child processes at once, and waits for
+ * events from all of them without blocking on any one: the exit of a
+ * child, output from a child, or (optionally) one other descriptor
+ * becoming readable, such as the jobserver pipe.
+ *
+ * Events are collected with epoll where it's available, and poll()
+ * otherwise. A child's exit is noticed through a pidfd where the kernel
+ * supports them, and otherwise through a SIGCHLD handler which writes to
+ * a pipe; either way, children are reaped individually with wait4(), so
+ * that the supervisor never collects a child belonging to somebody else.
+ *
+ * A job started with a prefix has its standard output and error
+ * captured through pipes, and copied to ours a whole line at a time,
+ * each line preceded by the prefix, so that the output of concurrent jobs
+ * doesn't interleave mid-line. A job started without a prefix simply
+ * shares our standard output and error, unless the supervisor has been
+ * told to capture output, in which case both are sent through a single
+ * pipe into a fixed-size ring buffer, where only the most recent output
+ * is retained.
+ *
+ * If a log file has been given, the output of jobs without a prefix is
+ * also copied to it. Where possible this is done without the data
+ * passing through our address space: tee() duplicates what's waiting in
+ * the job's pipe into a second pipe, and splice() then moves one copy to
+ * the log and the other to our own output. If either destination
+ * doesn't support splicing (as is the case for some devices), the output
+ * is read and written in the ordinary way instead.
+ */
+
+/* The longest line held back waiting for a newline */
+#define SUPERVISOR_LINE_MAX             65536
+
+typedef struct supervisor_src_s supervisor_src_t;
+
+typedef enum
+{
+	SRC_STREAM,
+	SRC_PIDFD,
+	SRC_SIGCHLD,
+	SRC_WATCH
+} supervisor_srctype_t;
+
+/* Something which can be waited upon */
+struct supervisor_src_s
+{
+	supervisor_srctype_t type;
+	int fd;
+	supervisor_job_t *job;
+	/* For streams: the descriptor output is copied to, and the partial
+	 * line received so far.
+	 */
+	int dest;
+	char *buf;
+	size_t len;
+	/* For captured streams: the ring buffer, the position at which the
+	 * next byte will be stored, and the amount of output received.
+	 */
+	char *ring;
+	size_t ringsize;
+	size_t ringpos;
+	unsigned long long bytes;
+	unsigned long lines;
+	/* For logged streams: the log descriptor, and the pipe through
+	 * which the copy to dest passes when splicing.
+	 */
+	int log;
+	int tpipe[2];
+	int nosplice;
+};
+
+struct supervisor_job_s
+{
+	supervisor_t *sup;
+	supervisor_job_t *next;
+	char *prefix;
+	pid_t pid;
+	int reaped;
+	supervisor_src_t pidfd;
+	supervisor_src_t out;
+	supervisor_src_t err;
+	/* Filled in once the job has completed */
+	int status;
+	struct rusage ru;
+	long long start;
+	long long end;
+	void *data;
+};
+
+struct supervisor_s
+{
+	build_context_t *ctx;
+	supervisor_job_t *jobs;
+	size_t running;
+	supervisor_src_t watch;
+	size_t ringsize;
+	int logfd;
+	int epfd;
+	/* Sources registered with poll(), when epoll isn't in use */
+	supervisor_src_t **srcs;
+	size_t nsrcs;
+	size_t srcalloc;
+	struct pollfd *pfd;
+};
+
+/* The SIGCHLD self-pipe, shared by every supervisor in the process */
+static int sigchld[2] = { -1, -1 };
+static pid_t sigchldpid;
+static supervisor_src_t sigchldsrc;
+
+static void
+supervisor_cloexec(int fd)
+{
+	fcntl(fd, F_SETFD, fcntl(fd, F_GETFD) | FD_CLOEXEC);
+}
+
+static void
+supervisor_nonblock(int fd)
+{
+	fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+}
+
+static void
+supervisor_sigchld(int sig)
+{
+	int e;
+
+	(void) sig;
+	e = errno;
+	if(write(sigchld[1], "", 1) < 0)
+	{
+		/* The pipe is full, so a wakeup is already pending */
+	}
+	errno = e;
+}
+
+/* Install the SIGCHLD handler and its pipe, once per process (a forked
+ * child which creates a supervisor gets its own).
+ */
+static int
+supervisor_sigchld_init(build_context_t *ctx)
+{
+	struct sigaction sa;
+
+	if(sigchldpid == getpid())
+	{
+		return 0;
+	}
+	if(sigchld[0] != -1)
+	{
+		close(sigchld[0]);
+		close(sigchld[1]);
+	}
+	if(pipe(sigchld) < 0)
+	{
+		context_msg(ctx, MSG_PERROR, "pipe()");
+		sigchld[0] = sigchld[1] = -1;
+		return -1;
+	}
+	supervisor_cloexec(sigchld[0]);
+	supervisor_cloexec(sigchld[1]);
+	supervisor_nonblock(sigchld[0]);
+	supervisor_nonblock(sigchld[1]);
+	memset(&sa, 0, sizeof(sa));
+	sa.sa_handler = supervisor_sigchld;
+	sa.sa_flags = SA_RESTART|SA_NOCLDSTOP;
+	sigemptyset(&sa.sa_mask);
+	sigaction(SIGCHLD, &sa, NULL);
+	sigchldsrc.type = SRC_SIGCHLD;
+	sigchldsrc.fd = sigchld[0];
+	sigchldpid = getpid();
+	return 0;
+}
+
+static int
+supervisor_pidfd(pid_t pid)
+{
+#if defined(SYS_pidfd_open)
+	int fd;
+
+	if((fd = (int) syscall(SYS_pidfd_open, pid, 0)) >= 0)
+	{
+		supervisor_cloexec(fd);
+	}
+	return fd;
+#else
+	(void) pid;
+	errno = ENOSYS;
+	return -1;
+#endif
+}
+
+static int
+supervisor_add(supervisor_t *sup, supervisor_src_t *src)
+{
+	supervisor_src_t **p;
+#ifdef HAVE_EPOLL_CREATE1
+	struct epoll_event ev;
+
+	if(sup->epfd >= 0)
+	{
+		memset(&ev, 0, sizeof(ev));
+		ev.events = EPOLLIN;
+		ev.data.ptr = src;
+		if(epoll_ctl(sup->epfd, EPOLL_CTL_ADD, src->fd, &ev) < 0)
+		{
+			context_msg(sup->ctx, MSG_PERROR, "epoll_ctl()");
+			return -1;
+		}
+		return 0;
+	}
+#endif
+	if(sup->nsrcs >= sup->srcalloc)
+	{
+		if(!(p = realloc(sup->srcs, sizeof(supervisor_src_t *) * (sup->srcalloc + 16))))
+		{
+			context_msg(sup->ctx, MSG_PERROR, "realloc()");
+			return -1;
+		}
+		sup->srcs = p;
+		sup->srcalloc += 16;
+	}
+	sup->srcs[sup->nsrcs] = src;
+	sup->nsrcs++;
+	return 0;
+}
+
+static void
+supervisor_del(supervisor_t *sup, supervisor_src_t *src)
+{
+	size_t c;
+
+#ifdef HAVE_EPOLL_CREATE1
+	if(sup->epfd >= 0)
+	{
+		epoll_ctl(sup->epfd, EPOLL_CTL_DEL, src->fd, NULL);
+		return;
+	}
+#endif
+	for(c = 0; c < sup->nsrcs; c++)
+	{
+		if(sup->srcs[c] == src)
+		{
+			sup->nsrcs--;
+			sup->srcs[c] = sup->srcs[sup->nsrcs];
+			return;
+		}
+	}
+}
+
+supervisor_t *
+supervisor_create(build_context_t *ctx)
+{
+	supervisor_t *sup;
+
+	if(!(sup = calloc(1, sizeof(supervisor_t))))
+	{
+		context_msg(ctx, MSG_PERROR, "calloc(1, %u)", (unsigned) sizeof(supervisor_t));
+		return NULL;
+	}
+	sup->ctx = ctx;
+	sup->watch.type = SRC_WATCH;
+	sup->watch.fd = -1;
+	sup->logfd = -1;
+	sup->epfd = -1;
+#ifdef HAVE_EPOLL_CREATE1
+	if((sup->epfd = epoll_create1(EPOLL_CLOEXEC)) < 0)
+	{
+		context_msg(ctx, MSG_DEBUG, "epoll unavailable (%s); using poll()\n", strerror(errno));
+	}
+#endif
+	if(supervisor_sigchld_init(ctx) || supervisor_add(sup, &sigchldsrc))
+	{
+		supervisor_destroy(sup);
+		return NULL;
+	}
+	return sup;
+}
+
+/* Release a supervisor. Any jobs still running are left to run. */
+void
+supervisor_destroy(supervisor_t *sup)
+{
+	if(!sup)
+	{
+		return;
+	}
+	if(sup->epfd >= 0)
+	{
+		close(sup->epfd);
+	}
+	free(sup->srcs);
+	free(sup->pfd);
+	free(sup);
+}
+
+/* Also wait for fd (or nothing, if fd is -1) to become readable */
+int
+supervisor_watch(supervisor_t *sup, int fd)
+{
+	if(sup->watch.fd == fd)
+	{
+		return 0;
+	}
+	if(sup->watch.fd >= 0)
+	{
+		supervisor_del(sup, &(sup->watch));
+	}
+	sup->watch.fd = fd;
+	if(fd >= 0)
+	{
+		return supervisor_add(sup, &(sup->watch));
+	}
+	return 0;
+}
+
+/* Capture the output of subsequent jobs without a prefix, retaining the
+ * last size bytes of each (or stop doing so, if size is zero).
+ */
+void
+supervisor_capture(supervisor_t *sup, size_t size)
+{
+	sup->ringsize = size;
+}
+
+/* Also copy the output of subsequent jobs without a prefix to fd (or
+ * stop doing so, if fd is -1).
+ */
+void
+supervisor_log(supervisor_t *sup, int fd)
+{
+	sup->logfd = fd;
+}
+
+size_t
+supervisor_running(supervisor_t *sup)
+{
+	return sup->running;
+}
+
+pid_t
+supervisor_job_pid(supervisor_job_t *job)
+{
+	return job->pid;
+}
+
+int
+supervisor_job_status(supervisor_job_t *job)
+{
+	return job->status;
+}
+
+const struct rusage *
+supervisor_job_rusage(supervisor_job_t *job)
+{
+	return &(job->ru);
+}
+
+long long
+supervisor_job_started(supervisor_job_t *job)
+{
+	return job->start;
+}
+
+long long
+supervisor_job_elapsed(supervisor_job_t *job)
+{
+	return job->end - job->start;
+}
+
+void *
+supervisor_job_data(supervisor_job_t *job)
+{
+	return job->data;
+}
+
+/* Copy the captured output of a job, which ends with the most recent
+ * output and starts with the first complete line retained, into buf,
+ * which must be at least as large as the ring buffer. Returns the number
+ * of bytes copied.
+ */
+size_t
+supervisor_job_output(supervisor_job_t *job, char *buf)
+{
+	supervisor_src_t *src;
+	size_t len;
+	char *p;
+
+	src = &(job->out);
+	if(!src->ring)
+	{
+		return 0;
+	}
+	if(src->bytes < src->ringsize)
+	{
+		memcpy(buf, src->ring, src->ringpos);
+		return src->ringpos;
+	}
+	len = src->ringsize - src->ringpos;
+	memcpy(buf, src->ring + src->ringpos, len);
+	memcpy(buf + len, src->ring, src->ringpos);
+	len = src->ringsize;
+	if(src->bytes > src->ringsize && (p = memchr(buf, '\n', len)) && p + 1 < buf + len)
+	{
+		len -= (p + 1) - buf;
+		memmove(buf, p + 1, len);
+	}
+	return len;
+}
+
+/* Return the amount of output a job produced, if it was captured */
+unsigned long long
+supervisor_job_outbytes(supervisor_job_t *job, unsigned long *lines)
+{
+	if(lines)
+	{
+		*lines = job->out.lines;
+	}
+	return job->out.bytes;
+}
+
+void
+supervisor_job_free(supervisor_job_t *job)
+{
+	if(!job)
+	{
+		return;
+	}
+	free(job->prefix);
+	free(job->out.ring);
+	free(job->out.buf);
+	free(job->err.buf);
+	free(job);
+}
+
+/* Create the pipes through which a job's output is captured. If shared
+ * is set, standard output and error share a single pipe, so that the
+ * order in which they were written is preserved.
+ */
+static int
+supervisor_pipes(supervisor_t *sup, int *out, int *err, int shared)
+{
+	if(pipe(out) < 0 || (shared ? (err[1] = dup(out[1])) < 0 : pipe(err) < 0))
+	{
+		context_msg(sup->ctx, MSG_PERROR, "pipe()");
+		if(out[0] != -1)
+		{
+			close(out[0]);
+			close(out[1]);
+		}
+		out[0] = out[1] = err[0] = err[1] = -1;
+		return -1;
+	}
+	supervisor_cloexec(out[0]);
+	supervisor_cloexec(out[1]);
+	supervisor_cloexec(err[1]);
+	supervisor_nonblock(out[0]);
+	if(!shared)
+	{
+		supervisor_cloexec(err[0]);
+		supervisor_nonblock(err[0]);
+	}
+	return 0;
+}
+
+/* Create a job and, if its output is to be captured, the pipes to do
+ * so.
+ */
+static supervisor_job_t *
+supervisor_job_create(supervisor_t *sup, const char *prefix, void *data, int *out, int *err)
+{
+	supervisor_job_t *job;
+
+	if(!(job = calloc(1, sizeof(supervisor_job_t))))
+	{
+		context_msg(sup->ctx, MSG_PERROR, "calloc(1, %u)", (unsigned) sizeof(supervisor_job_t));
+		return NULL;
+	}
+	job->sup = sup;
+	job->data = data;
+	job->pidfd.type = SRC_PIDFD;
+	job->pidfd.fd = -1;
+	job->pidfd.job = job;
+	job->out.type = job->err.type = SRC_STREAM;
+	job->out.fd = job->err.fd = -1;
+	job->out.job = job->err.job = job;
+	job->out.dest = 1;
+	job->err.dest = 2;
+	job->out.log = job->err.log = -1;
+	job->out.tpipe[0] = job->out.tpipe[1] = job->err.tpipe[0] = job->err.tpipe[1] = -1;
+	out[0] = out[1] = err[0] = err[1] = -1;
+	if(prefix)
+	{
+		if(!(job->prefix = malloc(strlen(prefix) + 4)))
+		{
+			context_msg(sup->ctx, MSG_PERROR, "malloc(%u)", (unsigned) (strlen(prefix) + 4));
+			free(job);
+			return NULL;
+		}
+		sprintf(job->prefix, "[%s] ", prefix);
+		if(supervisor_pipes(sup, out, err, 0))
+		{
+			supervisor_job_free(job);
+			return NULL;
+		}
+		return job;
+	}
+	job->out.log = job->err.log = sup->logfd;
+	if(sup->ringsize)
+	{
+		if(!(job->out.ring = malloc(sup->ringsize)))
+		{
+			context_msg(sup->ctx, MSG_PERROR, "malloc(%u)", (unsigned) sup->ringsize);
+			free(job);
+			return NULL;
+		}
+		job->out.ringsize = sup->ringsize;
+		if(supervisor_pipes(sup, out, err, 1))
+		{
+			supervisor_job_free(job);
+			return NULL;
+		}
+		return job;
+	}
+	if(sup->logfd >= 0 && supervisor_pipes(sup, out, err, 0))
+	{
+		supervisor_job_free(job);
+		return NULL;
+	}
+	return job;
+}
+
+/* Register a newly-started job with the supervisor */
+static supervisor_job_t *
+supervisor_job_start(supervisor_t *sup, supervisor_job_t *job, int *out, int *err)
+{
+	if(out[1] != -1)
+	{
+		close(out[1]);
+		close(err[1]);
+		job->out.fd = out[0];
+		supervisor_add(sup, &(job->out));
+	}
+	if(err[0] != -1)
+	{
+		job->err.fd = err[0];
+		supervisor_add(sup, &(job->err));
+	}
+	if((job->pidfd.fd = supervisor_pidfd(job->pid)) >= 0)
+	{
+		supervisor_add(sup, &(job->pidfd));
+	}
+	job->next = sup->jobs;
+	sup->jobs = job;
+	sup->running++;
+	return job;
+}
+
+static void
+supervisor_job_abort(supervisor_job_t *job, int *out, int *err)
+{
+	if(out[0] != -1)
+	{
+		close(out[0]);
+		close(out[1]);
+	}
+	if(err[1] != -1)
+	{
+		close(err[1]);
+	}
+	if(err[0] != -1)
+	{
+		close(err[0]);
+	}
+	supervisor_job_free(job);
+}
+
+/* Start argv[0] (searching PATH) as a new job */
+supervisor_job_t *
+supervisor_spawn(supervisor_t *sup, const char *prefix, char *const *argv, void *data)
+{
+	posix_spawn_file_actions_t fa;
+	supervisor_job_t *job;
+	int out[2], err[2], r;
+
+	if(!(job = supervisor_job_create(sup, prefix, data, out, err)))
+	{
+		return NULL;
+	}
+	posix_spawn_file_actions_init(&fa);
+	if(out[1] != -1)
+	{
+		posix_spawn_file_actions_adddup2(&fa, out[1], 1);
+		posix_spawn_file_actions_adddup2(&fa, err[1], 2);
+	}
+	job->start = trace_now();
+	r = posix_spawnp(&(job->pid), argv[0], &fa, NULL, argv, environ);
+	posix_spawn_file_actions_destroy(&fa);
+	if(r)
+	{
+		errno = r;
+		context_msg(sup->ctx, MSG_PERROR, "%s", argv[0]);
+		supervisor_job_abort(job, out, err);
+		return NULL;
+	}
+	return supervisor_job_start(sup, job, out, err);
+}
+
+/* Start a new job which runs fn(data) in a child process */
+supervisor_job_t *
+supervisor_fork(supervisor_t *sup, const char *prefix, int (*fn)(void *data), void *data)
+{
+	supervisor_job_t *job, *p;
+	int out[2], err[2];
+
+	if(!(job = supervisor_job_create(sup, prefix, data, out, err)))
+	{
+		return NULL;
+	}
+	fflush(stdout);
+	fflush(stderr);
+	job->start = trace_now();
+	if((job->pid = fork()) < 0)
+	{
+		context_msg(sup->ctx, MSG_PERROR, "fork()");
+		supervisor_job_abort(job, out, err);
+		return NULL;
+	}
+	if(!job->pid)
+	{
+		/* The child has no use for the supervisor's descriptors */
+		if(out[1] != -1)
+		{
+			dup2(out[1], 1);
+			dup2(err[1], 2);
+		}
+		for(p = sup->jobs; p; p = p->next)
+		{
+			close(p->out.fd);
+			close(p->err.fd);
+			close(p->pidfd.fd);
+		}
+		if(sup->epfd >= 0)
+		{
+			close(sup->epfd);
+		}
+		signal(SIGCHLD, SIG_DFL);
+		_exit(fn(data));
+	}
+	return supervisor_job_start(sup, job, out, err);
+}
+
+static void
+supervisor_write(int fd, const char *p, size_t len)
+{
+	ssize_t r;
+
+	while(len)
+	{
+		if((r = write(fd, p, len)) < 0)
+		{
+			if(errno == EINTR)
+			{
+				continue;
+			}
+			return;
+		}
+		p += r;
+		len -= r;
+	}
+}
+
+/* Add output to a stream's ring buffer */
+static void
+supervisor_keep(supervisor_src_t *src, const char *p, size_t len)
+{
+	size_t n;
+
+	src->bytes += len;
+	for(n = 0; n < len; n++)
+	{
+		if(p[n] == '\n')
+		{
+			src->lines++;
+		}
+	}
+	if(len > src->ringsize)
+	{
+		p += len - src->ringsize;
+		len = src->ringsize;
+	}
+	n = src->ringsize - src->ringpos;
+	if(n > len)
+	{
+		n = len;
+	}
+	memcpy(src->ring + src->ringpos, p, n);
+	memcpy(src->ring, p + n, len - n);
+	src->ringpos = (src->ringpos + len) % src->ringsize;
+}
+
+/* Copy whatever a job has written to a stream to its destination, a
+ * line at a time. At EOF (or if flush is set), any partial line is
+ * written out too.
+ */
+static void
+supervisor_emit(supervisor_job_t *job, supervisor_src_t *src, int flush)
+{
+	struct iovec iov[3];
+	char *p, *nl;
+	size_t len;
+	ssize_t r;
+
+	p = src->buf;
+	len = src->len;
+	if(!job->prefix)
+	{
+		if(src->log >= 0)
+		{
+			supervisor_write(src->log, p, len);
+		}
+		if(src->ring)
+		{
+			supervisor_keep(src, p, len);
+		}
+		else
+		{
+			supervisor_write(src->dest, p, len);
+		}
+		src->len = 0;
+		return;
+	}
+	while(len)
+	{
+		if(!(nl = memchr(p, '\n', len)))
+		{
+			if(!flush && len < SUPERVISOR_LINE_MAX)
+			{
+				break;
+			}
+			nl = p + len - 1;
+		}
+		iov[0].iov_base = job->prefix;
+		iov[0].iov_len = strlen(job->prefix);
+		iov[1].iov_base = p;
+		iov[1].iov_len = nl - p + 1;
+		iov[2].iov_base = "\n";
+		iov[2].iov_len = (*nl == '\n' ? 0 : 1);
+		do
+		{
+			r = writev(src->dest, iov, 3);
+		}
+		while(r < 0 && errno == EINTR);
+		len -= nl - p + 1;
+		p = nl + 1;
+	}
+	if(len && p != src->buf)
+	{
+		memmove(src->buf, p, len);
+	}
+	src->len = len;
+}
+
+static void
+supervisor_close(supervisor_t *sup, supervisor_src_t *src)
+{
+	supervisor_del(sup, src);
+	close(src->fd);
+	src->fd = -1;
+	if(src->tpipe[0] != -1)
+	{
+		close(src->tpipe[0]);
+		close(src->tpipe[1]);
+		src->tpipe[0] = src->tpipe[1] = -1;
+	}
+}
+
+#ifdef USE_SPLICE
+/* Move len bytes from the pipe in to out, returning the number which
+ * couldn't be.
+ */
+static size_t
+supervisor_splice_all(int in, int out, size_t len)
+{
+	ssize_t r;
+
+	while(len)
+	{
+		if((r = splice(in, NULL, out, NULL, len, SPLICE_F_MOVE)) <= 0)
+		{
+			if(r < 0 && (errno == EINTR || errno == EAGAIN))
+			{
+				continue;
+			}
+			break;
+		}
+		len -= r;
+	}
+	return len;
+}
+
+/* Copy len bytes from in to out the ordinary way */
+static void
+supervisor_copy(int in, int out, size_t len)
+{
+	char buf[4096];
+	ssize_t r;
+
+	while(len)
+	{
+		if((r = read(in, buf, (len < sizeof(buf) ? len : sizeof(buf)))) < 0 && (errno == EINTR || errno == EAGAIN))
+		{
+			continue;
+		}
+		if(r <= 0)
+		{
+			break;
+		}
+		supervisor_write(out, buf, r);
+		len -= r;
+	}
+}
+
+/* Copy whatever is waiting in a logged stream's pipe to the log and to
+ * its destination, using tee() and splice(). Returns 0 once the pipe is
+ * empty, -1 at EOF, and 1 if splicing isn't possible and the output must
+ * be read instead.
+ */
+static int
+supervisor_splice(supervisor_t *sup, supervisor_src_t *src)
+{
+	ssize_t r;
+	size_t n;
+
+	if(src->tpipe[0] == -1)
+	{
+		if(pipe(src->tpipe) < 0)
+		{
+			src->nosplice = 1;
+			return 1;
+		}
+		supervisor_cloexec(src->tpipe[0]);
+		supervisor_cloexec(src->tpipe[1]);
+	}
+	while(!src->nosplice)
+	{
+		if((r = tee(src->fd, src->tpipe[1], SUPERVISOR_LINE_MAX, SPLICE_F_NONBLOCK)) < 0)
+		{
+			if(errno == EINTR)
+			{
+				continue;
+			}
+			if(errno == EAGAIN)
+			{
+				return 0;
+			}
+			src->nosplice = 1;
+			break;
+		}
+		if(!r)
+		{
+			supervisor_close(sup, src);
+			return -1;
+		}
+		/* Either destination may refuse to be spliced to, in which case
+		 * the remainder is copied by hand, and we stop trying.
+		 */
+		if((n = supervisor_splice_all(src->fd, src->log, r)))
+		{
+			supervisor_copy(src->fd, src->log, n);
+			src->nosplice = 1;
+		}
+		if((n = supervisor_splice_all(src->tpipe[0], src->dest, r)))
+		{
+			supervisor_copy(src->tpipe[0], src->dest, n);
+			src->nosplice = 1;
+		}
+	}
+	return 1;
+}
+#endif
+
+/* Read from a job's output stream; returns -1 at EOF */
+static int
+supervisor_read(supervisor_t *sup, supervisor_src_t *src)
+{
+	ssize_t r;
+	char *p;
+
+#ifdef USE_SPLICE
+	if(src->log >= 0 && !src->ring && !src->nosplice && (r = supervisor_splice(sup, src)) <= 0)
+	{
+		return (int) r;
+	}
+#endif
+	for(;;)
+	{
+		if(!src->buf)
+		{
+			if(!(src->buf = malloc(SUPERVISOR_LINE_MAX)))
+			{
+				context_msg(sup->ctx, MSG_PERROR, "malloc(%u)", (unsigned) SUPERVISOR_LINE_MAX);
+				return -1;
+			}
+		}
+		p = src->buf + src->len;
+		r = read(src->fd, p, SUPERVISOR_LINE_MAX - src->len);
+		if(r < 0 && errno == EINTR)
+		{
+			continue;
+		}
+		if(r < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+		{
+			return 0;
+		}
+		if(r <= 0)
+		{
+			supervisor_emit(src->job, src, 1);
+			supervisor_close(sup, src);
+			return -1;
+		}
+		src->len += r;
+		supervisor_emit(src->job, src, 0);
+	}
+}
+
+/* Collect a job if it has exited */
+static void
+supervisor_reap(supervisor_t *sup, supervisor_job_t *job)
+{
+	pid_t r;
+
+	if(job->reaped)
+	{
+		return;
+	}
+	do
+	{
+		r = wait4(job->pid, &(job->status), WNOHANG, &(job->ru));
+	}
+	while(r < 0 && errno == EINTR);
+	if(r == 0)
+	{
+		return;
+	}
+	if(r < 0)
+	{
+		context_msg(sup->ctx, MSG_PERROR, "wait4(%ld)", (long) job->pid);
+		job->status = 127 << 8;
+	}
+	job->end = trace_now();
+	job->reaped = 1;
+	if(job->pidfd.fd >= 0)
+	{
+		supervisor_del(sup, &(job->pidfd));
+		close(job->pidfd.fd);
+		job->pidfd.fd = -1;
+	}
+}
+
+/* Remove and return a job which has exited and whose output has all been
+ * copied. Output still buffered in the pipes when the job exits is
+ * drained first; a descendant which holds the pipes open after the job
+ * itself has exited doesn't keep it from completing.
+ */
+static supervisor_job_t *
+supervisor_finished(supervisor_t *sup)
+{
+	supervisor_job_t **jp, *job;
+
+	for(jp = &(sup->jobs); *jp; jp = &((*jp)->next))
+	{
+		job = *jp;
+		if(!job->reaped)
+		{
+			continue;
+		}
+		if(job->out.fd >= 0 && supervisor_read(sup, &(job->out)) == 0)
+		{
+			supervisor_emit(job, &(job->out), 1);
+			supervisor_close(sup, &(job->out));
+		}
+		if(job->err.fd >= 0 && supervisor_read(sup, &(job->err)) == 0)
+		{
+			supervisor_emit(job, &(job->err), 1);
+			supervisor_close(sup, &(job->err));
+		}
+		*jp = job->next;
+		job->next = NULL;
+		sup->running--;
+		return job;
+	}
+	return NULL;
+}
+
+static void
+supervisor_event(supervisor_t *sup, supervisor_src_t *src, int *watched)
+{
+	supervisor_job_t *job;
+	char buf[64];
+
+	switch(src->type)
+	{
+	case SRC_STREAM:
+		supervisor_read(sup, src);
+		break;
+	case SRC_PIDFD:
+		supervisor_reap(sup, src->job);
+		break;
+	case SRC_SIGCHLD:
+		while(read(src->fd, buf, sizeof(buf)) > 0)
+		{
+		}
+		for(job = sup->jobs; job; job = job->next)
+		{
+			if(job->pidfd.fd < 0)
+			{
+				supervisor_reap(sup, job);
+			}
+		}
+		break;
+	case SRC_WATCH:
+		*watched = 1;
+		break;
+	}
+}
+
+/* Kill and collect any jobs which are still running, and discard them
+ * along with any which have completed; for when waiting for them has
+ * failed.
+ */
+void
+supervisor_kill(supervisor_t *sup)
+{
+	supervisor_job_t *job;
+
+	while((job = sup->jobs))
+	{
+		sup->jobs = job->next;
+		if(!job->reaped)
+		{
+			kill(job->pid, SIGKILL);
+			while(waitpid(job->pid, NULL, 0) < 0 && errno == EINTR)
+			{
+			}
+			job->reaped = 1;
+		}
+		if(job->pidfd.fd >= 0)
+		{
+			supervisor_del(sup, &(job->pidfd));
+			close(job->pidfd.fd);
+		}
+		if(job->out.fd >= 0)
+		{
+			supervisor_close(sup, &(job->out));
+		}
+		if(job->err.fd >= 0)
+		{
+			supervisor_close(sup, &(job->err));
+		}
+		sup->running--;
+		supervisor_job_free(job);
+	}
+}
+
+/* Wait for events for up to timeout milliseconds (or indefinitely, if
+ * timeout is negative). Returns a job which has completed, which the
+ * caller must free with supervisor_job_free(); or NULL if the timeout
+ * expired, the watched descriptor became readable, or there are no jobs
+ * to wait for.
+ */
+supervisor_job_t *
+supervisor_wait(supervisor_t *sup, int timeout)
+{
+	supervisor_job_t *job;
+	struct pollfd *pfd;
+	int n, c, watched;
+#ifdef HAVE_EPOLL_CREATE1
+	struct epoll_event ev[16];
+#endif
+
+	for(;;)
+	{
+		if((job = supervisor_finished(sup)))
+		{
+			return job;
+		}
+		if(!sup->running && sup->watch.fd < 0)
+		{
+			return NULL;
+		}
+		watched = 0;
+#ifdef HAVE_EPOLL_CREATE1
+		if(sup->epfd >= 0)
+		{
+			if((n = epoll_wait(sup->epfd, ev, 16, timeout)) < 0)
+			{
+				if(errno == EINTR)
+				{
+					continue;
+				}
+				context_msg(sup->ctx, MSG_PERROR, "epoll_wait()");
+				return NULL;
+			}
+			for(c = 0; c < n; c++)
+			{
+				supervisor_event(sup, (supervisor_src_t *) ev[c].data.ptr, &watched);
+			}
+			if(watched || !n)
+			{
+				return supervisor_finished(sup);
+			}
+			continue;
+		}
+#endif
+		if(!(pfd = realloc(sup->pfd, sizeof(struct pollfd) * (sup->nsrcs + 1))))
+		{
+			context_msg(sup->ctx, MSG_PERROR, "realloc()");
+			return NULL;
+		}
+		sup->pfd = pfd;
+		for(c = 0; (size_t) c < sup->nsrcs; c++)
+		{
+			pfd[c].fd = sup->srcs[c]->fd;
+			pfd[c].events = POLLIN;
+			pfd[c].revents = 0;
+		}
+		if((n = poll(pfd, sup->nsrcs, timeout)) < 0)
+		{
+			if(errno == EINTR)
+			{
+				continue;
+			}
+			context_msg(sup->ctx, MSG_PERROR, "poll()");
+			return NULL;
+		}
+		/* Sources may be removed as events are processed, so walk a
+		 * snapshot in reverse.
+		 */
+		for(c = (int) sup->nsrcs - 1; c >= 0; c--)
+		{
+			if(pfd[c].revents && (size_t) c < sup->nsrcs && sup->srcs[c]->fd == pfd[c].fd)
+			{
+				supervisor_event(sup, sup->srcs[c], &watched);
+			}
+		}
+		if(watched || !n)
+		{
+			return supervisor_finished(sup);
+		}
+	}
+}
@@ -0,0 +1,1127 @@
+/* Copyright 2013 Mo McRoberts.
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ */
+
+#ifdef HAVE_CONFIG_H
+# include "config.h"
+#endif
+
+#include <dirent.h>
+#include <sys/time.h>
+
+#include "p_build.h"
+
+/* Source synchronisation for remote builds.
+ *
+ * With --sync, the client copies the tree below its working directory
+ * to the worker before the build is run, and the worker builds in its
+ * own copy (kept in its cache directory) rather than at the client's
+ * path.
+ *
+ * Files are split into chunks at content-defined boundaries, found with
+ * a gear hash, so that an edit only changes the chunks around it; each
+ * chunk is identified by its digest. The client sends a manifest of the
+ * tree, listing the chunks which make up each file ('M'); the worker
+ * replies with the chunks missing from its store ('N'), which the client
+ * then sends ('C', terminated by 'D'). The worker keeps the manifest
+ * from the previous sync, and only rewrites the files which differ, and
+ * removes those which have gone.
+ *
+ * A manifest is a sequence of NUL-terminated fields: for a directory,
+ * "D", its mode and path; for a symbolic link, "L", its path and target;
+ * and for a file, "F", its mode, modification time, path and number of
+ * chunks, followed by the digest and length of each chunk. Modes are
+ * octal, and the modification time is in seconds.
+ *
+ * So that an unchanged tree doesn't need to be read in full each time,
+ * the client keeps the chunks of each file, along with the attributes
+ * which tell whether it has changed, in .build/sync.
+ */
+
+#define SYNC_CHUNK_MIN                  2048
+#define SYNC_CHUNK_MAX                  65536
+/* Boundaries occur every 8KiB on average */
+#define SYNC_CHUNK_MASK                 0x1fffULL
+#define SYNC_INDEX                      "sync"
+
+typedef struct sync_chunk_s sync_chunk_t;
+
+/* A chunk known to the client: where it can be found, so that it can
+ * be sent if needed. The worker uses the same structure, without the
+ * location, to list chunks it wants.
+ */
+struct sync_chunk_s
+{
+	char hex[DIGEST_HEXLEN + 1];
+	char *path;
+	off_t offset;
+	size_t len;
+	UT_hash_handle hh;
+};
+
+typedef struct sync_walk_s sync_walk_t;
+
+struct sync_walk_s
+{
+	build_context_t *ctx;
+	FILE *manifest;
+	build_defn_t *oldindex;
+	build_defn_t *index;
+	sync_chunk_t *chunks;
+	unsigned long files;
+	unsigned long long bytes;
+	int err;
+};
+
+static uint64_t gear[256];
+
+static void
+sync_gear_init(void)
+{
+	uint64_t x, z;
+	size_t c;
+
+	if(gear[0])
+	{
+		return;
+	}
+	/* The table must be the same everywhere, so it's generated from a
+	 * fixed seed (with splitmix64) rather than being random
+	 */
+	x = 0x6275696c64ULL;
+	for(c = 0; c < 256; c++)
+	{
+		z = (x += 0x9e3779b97f4a7c15ULL);
+		z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+		z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+		gear[c] = z ^ (z >> 31);
+	}
+}
+
+/* Return the length of the chunk at the start of p, which holds len
+ * bytes: either SYNC_CHUNK_MAX or more, or the remainder of the file
+ */
+static size_t
+sync_cut(const unsigned char *p, size_t len)
+{
+	uint64_t h;
+	size_t c;
+
+	if(len <= SYNC_CHUNK_MIN)
+	{
+		return len;
+	}
+	h = 0;
+	for(c = SYNC_CHUNK_MIN; c < len && c < SYNC_CHUNK_MAX; c++)
+	{
+		h = (h << 1) + gear[p[c]];
+		if(!(h & SYNC_CHUNK_MASK))
+		{
+			return c + 1;
+		}
+	}
+	return c;
+}
+
+/* Write a NUL-terminated field to a manifest */
+static void
+sync_field(FILE *f, const char *fmt, ...)
+{
+	va_list ap;
+
+	va_start(ap, fmt);
+	vfprintf(f, fmt, ap);
+	va_end(ap);
+	fputc(0, f);
+}
+
+static void
+sync_chunk_add(sync_walk_t *w, const char *hex, const char *path, off_t offset, size_t len)
+{
+	sync_chunk_t *c;
+
+	HASH_FIND_STR(w->chunks, hex, c);
+	if(c)
+	{
+		return;
+	}
+	if(!(c = calloc(1, sizeof(sync_chunk_t))) || !(c->path = strdup(path)))
+	{
+		free(c);
+		w->err = 1;
+		return;
+	}
+	strcpy(c->hex, hex);
+	c->offset = offset;
+	c->len = len;
+	HASH_ADD_STR(w->chunks, hex, c);
+}
+
+/* Split a file into chunks; returns the list of them, as "HEX/LEN"
+ * separated by spaces
+ */
+static char *
+sync_chunk_file(sync_walk_t *w, const char *path)
+{
+	unsigned char *buf;
+	char hex[DIGEST_HEXLEN + 1], *list, *p;
+	size_t len, n, alloc, used;
+	digest_t d;
+	ssize_t r;
+	int fd, eof;
+
+	if((fd = open(path, O_RDONLY)) < 0)
+	{
+		context_msg(w->ctx, MSG_PERROR, "%s", path);
+		return NULL;
+	}
+	if(!(buf = malloc(SYNC_CHUNK_MAX)))
+	{
+		context_msg(w->ctx, MSG_PERROR, "malloc(%u)", (unsigned) SYNC_CHUNK_MAX);
+		close(fd);
+		return NULL;
+	}
+	list = NULL;
+	alloc = used = 0;
+	len = 0;
+	eof = 0;
+	for(;;)
+	{
+		while(!eof && len < SYNC_CHUNK_MAX)
+		{
+			if((r = read(fd, buf + len, SYNC_CHUNK_MAX - len)) < 0)
+			{
+				if(errno == EINTR)
+				{
+					continue;
+				}
+				context_msg(w->ctx, MSG_PERROR, "%s", path);
+				free(list);
+				list = NULL;
+				goto done;
+			}
+			if(!r)
+			{
+				eof = 1;
+			}
+			len += r;
+		}
+		if(!len && list)
+		{
+			break;
+		}
+		n = sync_cut(buf, len);
+		digest_init(&d);
+		digest_update(&d, buf, n);
+		digest_final(&d, hex);
+		if(used + DIGEST_HEXLEN + 24 > alloc)
+		{
+			alloc = (alloc ? alloc * 2 : 256);
+			if(!(p = realloc(list, alloc)))
+			{
+				context_msg(w->ctx, MSG_PERROR, "realloc(..., %u)", (unsigned) alloc);
+				free(list);
+				list = NULL;
+				goto done;
+			}
+			list = p;
+		}
+		used += sprintf(list + used, "%s%s/%lu", (used ? " " : ""), hex, (unsigned long) n);
+		w->bytes += n;
+		memmove(buf, buf + n, len - n);
+		len -= n;
+		if(!len && eof)
+		{
+			break;
+		}
+	}
+done:
+	free(buf);
+	close(fd);
+	return list;
+}
+
+/* Add a file's entry to the manifest, chunking it if it's not in the
+ * index or has changed since it was added
+ */
+static void
+sync_file(sync_walk_t *w, const char *path, struct stat *st)
+{
+	char attrs[128], *list, *p, *s, *value;
+	const char *v;
+	unsigned long n;
+	off_t offset;
+	size_t len;
+
+	sprintf(attrs, "%llu:%llu:%lld:%lld", (unsigned long long) st->st_ino, (unsigned long long) st->st_size,
+			(long long) st->st_mtime, (long long) st->st_ctime);
+	list = NULL;
+	if((v = state_get(w->oldindex, path)) && !strncmp(v, attrs, strlen(attrs)) && v[strlen(attrs)] == ' ')
+	{
+		list = strdup(v + strlen(attrs) + 1);
+	}
+	else if(!(list = sync_chunk_file(w, path)))
+	{
+		w->err = 1;
+		return;
+	}
+	if(!list)
+	{
+		w->err = 1;
+		return;
+	}
+	/* Paths which can't be represented in the index are chunked anew
+	 * every time
+	 */
+	if(!strpbrk(path, "=\n") && (value = malloc(strlen(attrs) + strlen(list) + 2)))
+	{
+		sprintf(value, "%s %s", attrs, list);
+		state_set(w->ctx, &(w->index), path, value);
+		free(value);
+	}
+	for(n = 0, p = list; *p; p++)
+	{
+		if(*p == ' ')
+		{
+			n++;
+		}
+	}
+	sync_field(w->manifest, "F");
+	sync_field(w->manifest, "%o", (unsigned) (st->st_mode & 07777));
+	sync_field(w->manifest, "%lld", (long long) st->st_mtime);
+	sync_field(w->manifest, "%s", path);
+	sync_field(w->manifest, "%lu", n + 1);
+	offset = 0;
+	for(p = strtok(list, " "); p; p = strtok(NULL, " "))
+	{
+		if(!(s = strchr(p, '/')))
+		{
+			break;
+		}
+		*s = 0;
+		len = strtoul(s + 1, NULL, 10);
+		sync_field(w->manifest, "%s", p);
+		sync_field(w->manifest, "%lu", (unsigned long) len);
+		sync_chunk_add(w, p, path, offset, len);
+		offset += len;
+	}
+	w->files++;
+	free(list);
+}
+
+static void
+sync_walk(sync_walk_t *w, const char *dir)
+{
+	struct dirent *de;
+	struct stat st;
+	char *path, target[4096];
+	ssize_t r;
+	DIR *d;
+
+	if(!(d = opendir(dir[0] ? dir : ".")))
+	{
+		context_msg(w->ctx, MSG_PERROR, "%s", (dir[0] ? dir : "."));
+		w->err = 1;
+		return;
+	}
+	while((de = readdir(d)))
+	{
+		if(!strcmp(de->d_name, ".") || !strcmp(de->d_name, "..") || (!dir[0] && !strcmp(de->d_name, ".build")))
+		{
+			continue;
+		}
+		if(!(path = malloc(strlen(dir) + strlen(de->d_name) + 2)))
+		{
+			w->err = 1;
+			break;
+		}
+		sprintf(path, "%s%s%s", dir, (dir[0] ? "/" : ""), de->d_name);
+		if(lstat(path, &st) < 0)
+		{
+			context_msg(w->ctx, MSG_PERROR, "%s", path);
+			w->err = 1;
+		}
+		else if(S_ISDIR(st.st_mode))
+		{
+			sync_field(w->manifest, "D");
+			sync_field(w->manifest, "%o", (unsigned) (st.st_mode & 07777));
+			sync_field(w->manifest, "%s", path);
+			sync_walk(w, path);
+		}
+		else if(S_ISLNK(st.st_mode))
+		{
+			if((r = readlink(path, target, sizeof(target) - 1)) >= 0)
+			{
+				target[r] = 0;
+				sync_field(w->manifest, "L");
+				sync_field(w->manifest, "%s", path);
+				sync_field(w->manifest, "%s", target);
+			}
+		}
+		else if(S_ISREG(st.st_mode))
+		{
+			sync_file(w, path, &st);
+		}
+		free(path);
+	}
+	closedir(d);
+}
+
+/* Copy the tree below the working directory to the worker at the other
+ * end of rfd and wfd
+ */
+int
+sync_client(build_context_t *ctx, int rfd, int wfd)
+{
+	sync_walk_t w;
+	sync_chunk_t *c, *tmp;
+	char *manifest, *buf, *p, *data, *cwd, host[256], type;
+	size_t mlen, len;
+	unsigned long nsent;
+	unsigned long long sent;
+	ssize_t r;
+	int fd, err;
+
+	sync_gear_init();
+	memset(&w, 0, sizeof(w));
+	w.ctx = ctx;
+	if(!(w.manifest = open_memstream(&manifest, &mlen)))
+	{
+		context_msg(ctx, MSG_PERROR, "open_memstream()");
+		return -1;
+	}
+	/* The worker keeps a copy for each client host and directory */
+	if(gethostname(host, sizeof(host) - 1) < 0 || !(cwd = getcwd(NULL, 0)))
+	{
+		context_msg(ctx, MSG_PERROR, "getcwd()");
+		fclose(w.manifest);
+		free(manifest);
+		return -1;
+	}
+	host[sizeof(host) - 1] = 0;
+	sync_field(w.manifest, "%s:%s", host, cwd);
+	free(cwd);
+	w.oldindex = state_load_dir(ctx, ".build", SYNC_INDEX);
+	sync_walk(&w, "");
+	fclose(w.manifest);
+	state_free(w.oldindex);
+	if(w.err)
+	{
+		free(manifest);
+		state_free(w.index);
+		HASH_ITER(hh, w.chunks, c, tmp)
+		{
+			HASH_DEL(w.chunks, c);
+			free(c->path);
+			free(c);
+		}
+		return -1;
+	}
+	state_save_dir(ctx, ".build", SYNC_INDEX, w.index);
+	state_free(w.index);
+	context_msg(ctx, MSG_DEBUG, "sending manifest of %lu files (%lu bytes; %llu bytes of changed files read)\n",
+				w.files, (unsigned long) mlen, w.bytes);
+	err = remote_send(wfd, 'M', manifest, mlen);
+	free(manifest);
+	buf = NULL;
+	if(err || remote_recv(rfd, &type, &buf, &len) || type != 'N')
+	{
+		context_msg(ctx, MSG_ERROR, "failed to send manifest to %s\n", ctx->remote);
+		free(buf);
+		err = -1;
+		goto done;
+	}
+	nsent = 0;
+	sent = 0;
+	data = NULL;
+	if(!(data = malloc(DIGEST_HEXLEN + SYNC_CHUNK_MAX)))
+	{
+		err = -1;
+	}
+	for(p = buf; !err && p < buf + len; p += strlen(p) + 1)
+	{
+		HASH_FIND_STR(w.chunks, p, c);
+		if(!c)
+		{
+			context_msg(ctx, MSG_ERROR, "worker asked for unknown chunk %s\n", p);
+			err = -1;
+			break;
+		}
+		memcpy(data, c->hex, DIGEST_HEXLEN);
+		if((fd = open(c->path, O_RDONLY)) < 0 || (r = pread(fd, data + DIGEST_HEXLEN, c->len, c->offset)) != (ssize_t) c->len)
+		{
+			context_msg(ctx, MSG_PERROR, "%s", c->path);
+			if(fd >= 0)
+			{
+				close(fd);
+			}
+			err = -1;
+			break;
+		}
+		close(fd);
+		if(remote_send(wfd, 'C', data, DIGEST_HEXLEN + c->len))
+		{
+			err = -1;
+			break;
+		}
+		nsent++;
+		sent += c->len;
+	}
+	free(data);
+	free(buf);
+	if(!err)
+	{
+		err = remote_send(wfd, 'D', NULL, 0);
+	}
+	context_msg(ctx, MSG_INFO, "synchronised %lu files with %s: sent %lu of %lu chunks (%llu bytes)\n",
+				w.files, ctx->remote, nsent, (unsigned long) HASH_COUNT(w.chunks), sent);
+done:
+	HASH_ITER(hh, w.chunks, c, tmp)
+	{
+		HASH_DEL(w.chunks, c);
+		free(c->path);
+		free(c);
+	}
+	return err;
+}
+
+/* Check that a chunk id is a digest, as generated by digest_final(),
+ * and so can safely be made into a path within the store
+ */
+static int
+sync_chunk_valid(const char *hex)
+{
+	size_t c;
+
+	for(c = 0; c < DIGEST_HEXLEN; c++)
+	{
+		if(!((hex[c] >= '0' && hex[c] <= '9') || (hex[c] >= 'a' && hex[c] <= 'f')))
+		{
+			return 0;
+		}
+	}
+	return !hex[c];
+}
+
+/* Return the path of a chunk within the worker's store */
+static const char *
+sync_chunk_path(build_context_t *ctx, const char *hex)
+{
+	char sub[16];
+	const char *dir;
+
+	if(!sync_chunk_valid(hex))
+	{
+		return NULL;
+	}
+	sprintf(sub, "chunks/%.2s", hex);
+	if(!(dir = state_cachedir(ctx, sub)))
+	{
+		return NULL;
+	}
+	return state_path_in(ctx, dir, hex + 2);
+}
+
+/* Receive a chunk from the client into the store, once its digest has
+ * been checked
+ */
+static int
+sync_store(build_context_t *ctx, const char *data, size_t len)
+{
+	char hex[DIGEST_HEXLEN + 1], *tmp;
+	const char *path;
+	digest_t d;
+	FILE *f;
+	int r;
+
+	if(len < DIGEST_HEXLEN)
+	{
+		return -1;
+	}
+	digest_init(&d);
+	digest_update(&d, data + DIGEST_HEXLEN, len - DIGEST_HEXLEN);
+	digest_final(&d, hex);
+	if(memcmp(hex, data, DIGEST_HEXLEN))
+	{
+		context_msg(ctx, MSG_ERROR, "received a corrupt chunk (%.32s)\n", data);
+		return -1;
+	}
+	if(!(path = sync_chunk_path(ctx, hex)) || !(tmp = malloc(strlen(path) + 32)))
+	{
+		return -1;
+	}
+	sprintf(tmp, "%s.%ld.tmp", path, (long) getpid());
+	if(!(f = fopen(tmp, "wb")))
+	{
+		context_msg(ctx, MSG_PERROR, "%s", tmp);
+		free(tmp);
+		return -1;
+	}
+	r = (fwrite(data + DIGEST_HEXLEN, 1, len - DIGEST_HEXLEN, f) != len - DIGEST_HEXLEN);
+	if(fclose(f) || r || rename(tmp, path) < 0)
+	{
+		context_msg(ctx, MSG_PERROR, "%s", path);
+		unlink(tmp);
+		r = -1;
+	}
+	free(tmp);
+	return r;
+}
+
+typedef struct sync_entry_s sync_entry_t;
+
+/* An entry in a manifest, as parsed by the worker */
+struct sync_entry_s
+{
+	char type;
+	const char *path;
+	/* The entry's fields, including its chunk list, for comparing with
+	 * the previous manifest
+	 */
+	const char *fields;
+	size_t len;
+	unsigned mode;
+	time_t mtime;
+	const char *target;
+	unsigned long nchunks;
+	const char *chunks;
+	UT_hash_handle hh;
+};
+
+/* Check that a path in a manifest stays within the copy: that it's
+ * relative, has no empty, '.' or '..' components, and that whatever
+ * contains it is a directory listed earlier in the manifest (and so not
+ * a symbolic link)
+ */
+static int
+sync_path_valid(sync_entry_t *entries, const char *path)
+{
+	const char *s, *t;
+	sync_entry_t *parent;
+
+	for(s = path; ; s = t + 1)
+	{
+		if(!(t = strchr(s, '/')))
+		{
+			t = s + strlen(s);
+		}
+		if(t == s || (t - s == 1 && s[0] == '.') || (t - s == 2 && s[0] == '.' && s[1] == '.'))
+		{
+			return 0;
+		}
+		if(!*t)
+		{
+			break;
+		}
+	}
+	if(!(t = strrchr(path, '/')))
+	{
+		return 1;
+	}
+	HASH_FIND(hh, entries, path, t - path, parent);
+	return (parent && parent->type == 'D');
+}
+
+/* Check that each directory leading to path within the copy in dir is
+ * really a directory, so that nothing is written (or removed) through a
+ * symbolic link left by an earlier sync
+ */
+static int
+sync_path_contained(const char *dir, const char *path)
+{
+	struct stat st;
+	char *buf, *s;
+	int r;
+
+	if(!(buf = malloc(strlen(dir) + strlen(path) + 2)))
+	{
+		return 0;
+	}
+	sprintf(buf, "%s/%s", dir, path);
+	r = 1;
+	for(s = buf + strlen(dir) + 1; r && (s = strchr(s, '/')); s++)
+	{
+		*s = 0;
+		if(lstat(buf, &st) < 0 || !S_ISDIR(st.st_mode))
+		{
+			r = 0;
+		}
+		*s = '/';
+	}
+	free(buf);
+	return r;
+}
+
+/* Parse a manifest into a table of entries, which point into it; the
+ * order of entries is preserved
+ */
+static int
+sync_parse(build_context_t *ctx, const char *buf, size_t len, sync_entry_t **entries)
+{
+	const char *p, *end, *f[5];
+	sync_entry_t *e;
+	unsigned long c;
+	size_t n, nf;
+
+	*entries = NULL;
+	p = buf;
+	end = buf + len;
+	while(p < end)
+	{
+		if(!(e = calloc(1, sizeof(sync_entry_t))))
+		{
+			return -1;
+		}
+		e->type = *p;
+		e->fields = p;
+		nf = (*p == 'F' ? 5 : 3);
+		for(n = 0; n < nf && p < end; n++)
+		{
+			f[n] = p;
+			p += strlen(p) + 1;
+		}
+		if(n < nf || (e->type != 'D' && e->type != 'L' && e->type != 'F'))
+		{
+			free(e);
+			context_msg(ctx, MSG_ERROR, "malformed manifest\n");
+			return -1;
+		}
+		if(e->type == 'L')
+		{
+			e->path = f[1];
+			e->target = f[2];
+		}
+		else
+		{
+			e->mode = (unsigned) strtoul(f[1], NULL, 8) & 07777;
+			e->path = f[nf == 5 ? 3 : 2];
+		}
+		if(e->type == 'F')
+		{
+			e->mtime = (time_t) strtoll(f[2], NULL, 10);
+			e->nchunks = strtoul(f[4], NULL, 10);
+			e->chunks = p;
+			for(c = 0; c < e->nchunks * 2 && p < end; c++)
+			{
+				/* Chunk ids become paths within the store */
+				if(!(c % 2) && !sync_chunk_valid(p))
+				{
+					free(e);
+					context_msg(ctx, MSG_ERROR, "malformed chunk id in manifest\n");
+					return -1;
+				}
+				p += strlen(p) + 1;
+			}
+			if(c < e->nchunks * 2)
+			{
+				free(e);
+				context_msg(ctx, MSG_ERROR, "malformed manifest\n");
+				return -1;
+			}
+		}
+		e->len = p - e->fields;
+		/* Nothing may be written outside the copy of the tree */
+		if(!sync_path_valid(*entries, e->path))
+		{
+			context_msg(ctx, MSG_ERROR, "refusing to write to `%s'\n", e->path);
+			free(e);
+			return -1;
+		}
+		HASH_ADD_KEYPTR(hh, *entries, e->path, strlen(e->path), e);
+	}
+	return 0;
+}
+
+static void
+sync_entries_free(sync_entry_t *entries)
+{
+	sync_entry_t *e, *tmp;
+
+	HASH_ITER(hh, entries, e, tmp)
+	{
+		HASH_DEL(entries, e);
+		free(e);
+	}
+}
+
+/* Assemble a file from its chunks */
+static int
+sync_assemble(build_context_t *ctx, const char *dir, sync_entry_t *e)
+{
+	char *path, *tmp, buf[65536];
+	const char *p, *chunk;
+	struct timeval tv[2];
+	unsigned long c;
+	ssize_t r;
+	int fd, out, err;
+
+	if(!(path = malloc(strlen(dir) + strlen(e->path) + 2)) || !(tmp = malloc(strlen(dir) + strlen(e->path) + 32)))
+	{
+		free(path);
+		return -1;
+	}
+	sprintf(path, "%s/%s", dir, e->path);
+	sprintf(tmp, "%s.%ld.tmp", path, (long) getpid());
+	if((out = open(tmp, O_WRONLY|O_CREAT|O_TRUNC, 0600)) < 0)
+	{
+		context_msg(ctx, MSG_PERROR, "%s", tmp);
+		free(tmp);
+		free(path);
+		return -1;
+	}
+	err = 0;
+	for(c = 0, p = e->chunks; !err && c < e->nchunks; c++)
+	{
+		if(!(chunk = sync_chunk_path(ctx, p)) || (fd = open(chunk, O_RDONLY)) < 0)
+		{
+			context_msg(ctx, MSG_ERROR, "chunk %s of %s is missing\n", p, e->path);
+			err = -1;
+			break;
+		}
+		while((r = read(fd, buf, sizeof(buf))) > 0)
+		{
+			if(daemon_writeall(out, buf, r))
+			{
+				context_msg(ctx, MSG_PERROR, "%s", tmp);
+				err = -1;
+				break;
+			}
+		}
+		close(fd);
+		p += strlen(p) + 1;
+		p += strlen(p) + 1;
+	}
+	if(close(out) < 0)
+	{
+		err = -1;
+	}
+	tv[0].tv_sec = tv[1].tv_sec = e->mtime;
+	tv[0].tv_usec = tv[1].tv_usec = 0;
+	if(!err && (chmod(tmp, e->mode) < 0 || utimes(tmp, tv) < 0 || rename(tmp, path) < 0))
+	{
+		context_msg(ctx, MSG_PERROR, "%s", path);
+		err = -1;
+	}
+	if(err)
+	{
+		unlink(tmp);
+	}
+	free(tmp);
+	free(path);
+	return err;
+}
+
+static int
+sync_unchanged(const char *dir, sync_entry_t *e, sync_entry_t *old)
+{
+	struct stat st;
+	sync_entry_t *o;
+	char *path;
+	int r;
+
+	HASH_FIND_STR(old, e->path, o);
+	if(!o || o->len != e->len || memcmp(o->fields, e->fields, e->len))
+	{
+		return 0;
+	}
+	if(!(path = malloc(strlen(dir) + strlen(e->path) + 2)))
+	{
+		return 0;
+	}
+	sprintf(path, "%s/%s", dir, e->path);
+	r = (lstat(path, &st) == 0);
+	free(path);
+	return r;
+}
+
+/* Apply a single (new or changed) manifest entry to the copy in dir */
+static int
+sync_apply(build_context_t *ctx, const char *dir, sync_entry_t *e)
+{
+	struct stat st;
+	char *path;
+	int r;
+
+	if(!sync_path_contained(dir, e->path))
+	{
+		context_msg(ctx, MSG_ERROR, "refusing to write to `%s', which is not within the copy\n", e->path);
+		return -1;
+	}
+	if(e->type == 'F')
+	{
+		return sync_assemble(ctx, dir, e);
+	}
+	if(!(path = malloc(strlen(dir) + strlen(e->path) + 2)))
+	{
+		return -1;
+	}
+	sprintf(path, "%s/%s", dir, e->path);
+	r = 0;
+	if(e->type == 'D')
+	{
+		if(lstat(path, &st) == 0 && !S_ISDIR(st.st_mode))
+		{
+			unlink(path);
+		}
+		if((mkdir(path, 0777) < 0 && errno != EEXIST) || chmod(path, e->mode | 0700) < 0)
+		{
+			context_msg(ctx, MSG_PERROR, "%s", path);
+			r = -1;
+		}
+	}
+	else
+	{
+		unlink(path);
+		if(symlink(e->target, path) < 0)
+		{
+			context_msg(ctx, MSG_PERROR, "%s", path);
+			r = -1;
+		}
+	}
+	free(path);
+	return r;
+}
+
+/* Read the manifest saved after the previous sync */
+static char *
+sync_load(const char *path, size_t *len)
+{
+	struct stat st;
+	char *buf;
+	int fd;
+
+	*len = 0;
+	if((fd = open(path, O_RDONLY)) < 0)
+	{
+		return NULL;
+	}
+	if(fstat(fd, &st) < 0 || !(buf = malloc(st.st_size + 1)))
+	{
+		close(fd);
+		return NULL;
+	}
+	if(daemon_readall(fd, buf, st.st_size))
+	{
+		free(buf);
+		close(fd);
+		return NULL;
+	}
+	close(fd);
+	*len = st.st_size;
+	return buf;
+}
+
+static int
+sync_save(build_context_t *ctx, const char *path, const char *buf, size_t len)
+{
+	char *tmp;
+	FILE *f;
+	int r;
+
+	if(!(tmp = malloc(strlen(path) + 32)))
+	{
+		return -1;
+	}
+	sprintf(tmp, "%s.%ld.tmp", path, (long) getpid());
+	if(!(f = fopen(tmp, "wb")))
+	{
+		context_msg(ctx, MSG_PERROR, "%s", tmp);
+		free(tmp);
+		return -1;
+	}
+	r = (fwrite(buf, 1, len, f) != len);
+	if(fclose(f) || r || rename(tmp, path) < 0)
+	{
+		context_msg(ctx, MSG_PERROR, "%s", path);
+		unlink(tmp);
+		r = -1;
+	}
+	free(tmp);
+	return r;
+}
+
+/* Bring the worker's copy of a client's tree up to date with the
+ * manifest received from it, fetching any chunks which are missing from
+ * the store. The manifest is preceded by a string identifying the tree,
+ * from which the location of the copy is derived. Returns the path of
+ * the copy.
+ */
+char *
+sync_worker(build_context_t *ctx, int rfd, int wfd, const char *payload, size_t plen)
+{
+	sync_entry_t *entries, *old, *e, **list;
+	sync_chunk_t *want, *c, *tmp;
+	char hex[DIGEST_HEXLEN + 1], *dir, *mpath, *oldbuf, *buf, *wbuf, type;
+	const char *s, *manifest, *p;
+	size_t mlen, oldlen, len, wlen, n, count;
+	unsigned long k, nwritten;
+	FILE *wf;
+	digest_t d;
+	int err;
+
+	if(!(p = memchr(payload, 0, plen)))
+	{
+		context_msg(ctx, MSG_ERROR, "malformed manifest\n");
+		return NULL;
+	}
+	manifest = p + 1;
+	mlen = plen - (manifest - payload);
+	digest_init(&d);
+	digest_str(&d, payload);
+	digest_final(&d, hex);
+	if(!(s = state_cachedir(ctx, "worker")) || !(dir = malloc(strlen(s) + DIGEST_HEXLEN + 2)) ||
+	   !(mpath = malloc(strlen(s) + DIGEST_HEXLEN + 16)))
+	{
+		return NULL;
+	}
+	sprintf(dir, "%s/%s", s, hex);
+	sprintf(mpath, "%s/%s.manifest", s, hex);
+	if(mkdir(dir, 0777) < 0 && errno != EEXIST)
+	{
+		context_msg(ctx, MSG_PERROR, "%s", dir);
+		free(mpath);
+		free(dir);
+		return NULL;
+	}
+	old = NULL;
+	if(sync_parse(ctx, manifest, mlen, &entries))
+	{
+		sync_entries_free(entries);
+		free(mpath);
+		free(dir);
+		return NULL;
+	}
+	if((oldbuf = sync_load(mpath, &oldlen)) && sync_parse(ctx, oldbuf, oldlen, &old))
+	{
+		sync_entries_free(old);
+		old = NULL;
+	}
+	/* Ask for the chunks of new and changed files which aren't already
+	 * in the store
+	 */
+	want = NULL;
+	err = 0;
+	wbuf = NULL;
+	if(!(wf = open_memstream(&wbuf, &wlen)))
+	{
+		err = -1;
+	}
+	for(e = entries; !err && e; e = e->hh.next)
+	{
+		if(e->type != 'F' || sync_unchanged(dir, e, old))
+		{
+			continue;
+		}
+		for(k = 0, p = e->chunks; k < e->nchunks; k++)
+		{
+			HASH_FIND_STR(want, p, c);
+			if(!c && (!(s = sync_chunk_path(ctx, p)) || access(s, F_OK) < 0))
+			{
+				if(!(c = calloc(1, sizeof(sync_chunk_t))))
+				{
+					err = -1;
+					break;
+				}
+				snprintf(c->hex, sizeof(c->hex), "%s", p);
+				HASH_ADD_STR(want, hex, c);
+				fwrite(c->hex, 1, strlen(c->hex) + 1, wf);
+			}
+			p += strlen(p) + 1;
+			p += strlen(p) + 1;
+		}
+	}
+	if(wf)
+	{
+		fclose(wf);
+	}
+	if(!err && remote_send(wfd, 'N', wbuf, wlen))
+	{
+		err = -1;
+	}
+	free(wbuf);
+	/* Receive them */
+	while(!err)
+	{
+		if(remote_recv(rfd, &type, &buf, &len))
+		{
+			err = -1;
+			break;
+		}
+		if(type == 'D')
+		{
+			free(buf);
+			break;
+		}
+		if(type != 'C' || sync_store(ctx, buf, len))
+		{
+			err = -1;
+		}
+		free(buf);
+	}
+	/* Apply the changes, then remove whatever has gone, deepest first */
+	nwritten = 0;
+	for(e = entries; !err && e; e = e->hh.next)
+	{
+		if(sync_unchanged(dir, e, old))
+		{
+			continue;
+		}
+		if(sync_apply(ctx, dir, e))
+		{
+			err = -1;
+		}
+		nwritten++;
+	}
+	count = HASH_COUNT(old);
+	if(!err && count && (list = calloc(count, sizeof(sync_entry_t *))))
+	{
+		for(n = 0, e = old; e; e = e->hh.next)
+		{
+			list[n++] = e;
+		}
+		while(n--)
+		{
+			HASH_FIND_STR(entries, list[n]->path, e);
+			if(!e && sync_path_contained(dir, list[n]->path) && (buf = malloc(strlen(dir) + strlen(list[n]->path) + 2)))
+			{
+				sprintf(buf, "%s/%s", dir, list[n]->path);
+				remove(buf);
+				free(buf);
+			}
+		}
+		free(list);
+	}
+	if(!err)
+	{
+		context_msg(ctx, MSG_INFO, "updated %lu of %lu entries in %s (%lu chunks received)\n",
+					nwritten, (unsigned long) HASH_COUNT(entries), dir, (unsigned long) HASH_COUNT(want));
+		sync_save(ctx, mpath, manifest, mlen);
+	}
+	HASH_ITER(hh, want, c, tmp)
+	{
+		HASH_DEL(want, c);
+		free(c);
+	}
+	sync_entries_free(entries);
+	sync_entries_free(old);
+	free(oldbuf);
+	free(mpath);
+	if(err)
+	{
+		context_msg(ctx, MSG_ERROR, "failed to synchronise with the client\n");
+		free(dir);
+		return NULL;
+	}
+	return dir;
+}
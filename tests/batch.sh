@@ -0,0 +1,44 @@
+#! /bin/sh
+## Copyright 2013 Mo McRoberts.
+##
+##  Licensed under the Apache License, Version 2.0 (the "License");
+##  you may not use this file except in compliance with the License.
+##  You may obtain a copy of the License at
+##
+##      http://www.apache.org/licenses/LICENSE-2.0
+##
+##  Unless required by applicable law or agreed to in writing, software
+##  distributed under the License is distributed on an "AS IS" BASIS,
+##  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+##  See the License for the specific language governing permissions and
+##  limitations under the License.
+
+## Batch mode (--batch): every job runs, whatever happens to the others,
+## and a summary lists the outcome of each.
+
+. "`dirname "$0"`/common.sh"
+
+mkdir "$tmp/jobs"
+cd "$tmp/jobs"
+for d in first bad last ; do
+	mkdir $d
+	printf '%s\n' 'all:' '	@touch built$(SUFFIX)' > $d/Makefile
+done
+printf '%s\n' '	@false' >> bad/Makefile
+printf '%s\n' '# The failing job comes first' bad first 'last build SUFFIX=-again' > list
+
+if "$BUILD" -j1 --batch=list > "$tmp/out" 2>&1 ; then
+	fail "a batch with a failed job succeeded"
+fi
+test -f first/built || fail "the job after a failed one wasn't run"
+test -f last/built-again || fail "the definitions given for a job weren't used"
+grep 'ok .* first$' "$tmp/out" > /dev/null || fail "the summary doesn't show 'first' succeeding: `cat "$tmp/out"`"
+grep 'FAILED .* bad$' "$tmp/out" > /dev/null || fail "the summary doesn't show 'bad' failing: `cat "$tmp/out"`"
+grep '1 of 3 job(s) failed' "$tmp/out" > /dev/null || fail "the summary doesn't count the failure: `cat "$tmp/out"`"
+
+## The list may be read from standard input, and several jobs run at once
+rm -f first/built last/built-again
+printf '%s\n' first 'last build SUFFIX=-again' | "$BUILD" -j2 --batch > "$tmp/out" 2>&1 || fail "batch from standard input failed: `cat "$tmp/out"`"
+test -f first/built && test -f last/built-again || fail "not every job read from standard input was run"
+grep 'all 2 job(s) succeeded' "$tmp/out" > /dev/null || fail "the summary doesn't show every job succeeding: `cat "$tmp/out"`"
+exit 0
@@ -0,0 +1,66 @@
+## Copyright 2013 Mo McRoberts.
+##
+##  Licensed under the Apache License, Version 2.0 (the "License");
+##  you may not use this file except in compliance with the License.
+##  You may obtain a copy of the License at
+##
+##      http://www.apache.org/licenses/LICENSE-2.0
+##
+##  Unless required by applicable law or agreed to in writing, software
+##  distributed under the License is distributed on an "AS IS" BASIS,
+##  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+##  See the License for the specific language governing permissions and
+##  limitations under the License.
+
+## Sourced by each of the scripts run by 'make check'. $BUILD names the
+## build binary under test; everything is done in a scratch directory
+## (with its own cache directory), which is removed afterwards.
+
+BUILD="${BUILD:-`pwd`/build}"
+test -x "$BUILD" || { echo "$0: $BUILD is not executable" >&2 ; exit 99 ; }
+
+tmp=`mktemp -d "${TMPDIR:-/tmp}/build-test.XXXXXX"` || exit 99
+BUILD_CACHE_DIR="$tmp/cache"
+export BUILD_CACHE_DIR
+unset BUILD_RSH MAKEFLAGS MFLAGS DESTDIR
+
+cleanup()
+{
+	test -z "$pids" || kill $pids 2>/dev/null
+	rm -rf "$tmp"
+}
+pids=
+trap cleanup 0
+trap 'exit 1' 1 2 15
+
+fail()
+{
+	echo "$0: FAIL: $*" >&2
+	exit 1
+}
+
+## frame TYPE FILE: write a protocol frame (as used between 'build --at'
+## and 'build --worker') whose payload is the contents of FILE
+frame()
+{
+	n=`wc -c < "$2"`
+	printf "$1\\`printf %03o $((n >> 24 & 255))`\\`printf %03o $((n >> 16 & 255))`\\`printf %03o $((n >> 8 & 255))`\\`printf %03o $((n & 255))`"
+	cat "$2"
+}
+
+## project DIR: create a minimal project, built by make, in DIR
+project()
+{
+	mkdir -p "$1/src"
+	echo 'int main(void) { return 0; }' > "$1/src/a.c"
+	printf '%s\n' \
+		'all: out/prog' \
+		'	@echo made all' \
+		'out/prog: src/a.c' \
+		'	@echo compiling in $(CURDIR); mkdir -p out; cp src/a.c out/prog' \
+		'	@test -z "$(FAIL)"' \
+		'install:' \
+		'	@echo installing; mkdir -p $(DESTDIR)/bin; cp out/prog $(DESTDIR)/bin/' \
+		'clean:' \
+		'	rm -rf out' > "$1/Makefile"
+}
@@ -0,0 +1,36 @@
+#! /bin/sh
+## Copyright 2013 Mo McRoberts.
+##
+##  Licensed under the Apache License, Version 2.0 (the "License");
+##  you may not use this file except in compliance with the License.
+##  You may obtain a copy of the License at
+##
+##      http://www.apache.org/licenses/LICENSE-2.0
+##
+##  Unless required by applicable law or agreed to in writing, software
+##  distributed under the License is distributed on an "AS IS" BASIS,
+##  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+##  See the License for the specific language governing permissions and
+##  limitations under the License.
+
+## Configuration matrix builds: each combination of --host and --config
+## runs as a job of its own, and one failing doesn't stop the others.
+
+. "`dirname "$0"`/common.sh"
+
+mkdir "$tmp/proj"
+cd "$tmp/proj"
+printf '%s\n' 'all:' '	@touch built-$(HOST_SYSTEM)' '	@test "$(HOST_SYSTEM)" != aarch64-linux-gnu' > Makefile
+
+if "$BUILD" -j2 -H aarch64-linux-gnu,x86_64-linux-gnu -c debug,release > "$tmp/out" 2>&1 ; then
+	fail "a matrix with failed combinations succeeded"
+fi
+test -f built-aarch64-linux-gnu && test -f built-x86_64-linux-gnu || fail "not every combination was built"
+for job in x86_64-linux-gnu/debug x86_64-linux-gnu/release ; do
+	grep "ok .* $job\$" "$tmp/out" > /dev/null || fail "the summary doesn't show $job succeeding: `cat "$tmp/out"`"
+done
+for job in aarch64-linux-gnu/debug aarch64-linux-gnu/release ; do
+	grep "FAILED .* $job\$" "$tmp/out" > /dev/null || fail "the summary doesn't show $job failing: `cat "$tmp/out"`"
+done
+grep '2 of 4 job(s) failed' "$tmp/out" > /dev/null || fail "the summary doesn't count the failures: `cat "$tmp/out"`"
+exit 0
@@ -0,0 +1,54 @@
+#! /bin/sh
+## Copyright 2013 Mo McRoberts.
+##
+##  Licensed under the Apache License, Version 2.0 (the "License");
+##  you may not use this file except in compliance with the License.
+##  You may obtain a copy of the License at
+##
+##      http://www.apache.org/licenses/LICENSE-2.0
+##
+##  Unless required by applicable law or agreed to in writing, software
+##  distributed under the License is distributed on an "AS IS" BASIS,
+##  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+##  See the License for the specific language governing permissions and
+##  limitations under the License.
+
+## Phases recorded in .build/phases: a completed phase isn't performed
+## again as a prerequisite, until its inputs or the options change.
+
+. "`dirname "$0"`/common.sh"
+
+project "$tmp/proj"
+cd "$tmp/proj"
+"$BUILD" > "$tmp/out" 2>&1 || fail "build failed: `cat "$tmp/out"`"
+grep "compiling" "$tmp/out" > /dev/null || fail "nothing was compiled"
+grep '^build\.' .build/phases > /dev/null || fail "the build phase wasn't recorded"
+
+## 'install' doesn't build again
+"$BUILD" install DESTDIR="$tmp/dest" > "$tmp/out" 2>&1 || fail "install failed: `cat "$tmp/out"`"
+grep "made all" "$tmp/out" > /dev/null && fail "the build phase was performed again"
+test -f "$tmp/dest/bin/prog" || fail "nothing was installed"
+grep '^install\.' .build/phases > /dev/null || fail "the install phase wasn't recorded"
+
+## ...unless a source file changes
+sleep 1
+echo '/* changed */' >> src/a.c
+"$BUILD" install DESTDIR="$tmp/dest" > "$tmp/out" 2>&1 || fail "install failed: `cat "$tmp/out"`"
+grep "compiling" "$tmp/out" > /dev/null || fail "a changed source file wasn't rebuilt"
+"$BUILD" install DESTDIR="$tmp/dest" > "$tmp/out" 2>&1 || fail "install failed: `cat "$tmp/out"`"
+grep "made all" "$tmp/out" > /dev/null && fail "the build phase wasn't recorded after rebuilding"
+
+## ...or the options do
+"$BUILD" install DESTDIR="$tmp/dest" FOO=1 > "$tmp/out" 2>&1 || fail "install failed: `cat "$tmp/out"`"
+grep "made all" "$tmp/out" > /dev/null || fail "the build phase was skipped despite a new definition"
+
+## ...or it has been cleaned away
+"$BUILD" clean > "$tmp/out" 2>&1 || fail "clean failed: `cat "$tmp/out"`"
+"$BUILD" install DESTDIR="$tmp/dest" > "$tmp/out" 2>&1 || fail "install failed: `cat "$tmp/out"`"
+grep "compiling" "$tmp/out" > /dev/null || fail "the build phase was skipped after 'clean'"
+test -f out/prog || fail "nothing was built after 'clean'"
+
+## A phase named on the command-line is always performed
+"$BUILD" build > "$tmp/out" 2>&1 || fail "build failed: `cat "$tmp/out"`"
+grep "made all" "$tmp/out" > /dev/null || fail "an explicit build was skipped"
+exit 0
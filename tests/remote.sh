@@ -0,0 +1,44 @@
+#! /bin/sh
+## Copyright 2013 Mo McRoberts.
+##
+##  Licensed under the Apache License, Version 2.0 (the "License");
+##  you may not use this file except in compliance with the License.
+##  You may obtain a copy of the License at
+##
+##      http://www.apache.org/licenses/LICENSE-2.0
+##
+##  Unless required by applicable law or agreed to in writing, software
+##  distributed under the License is distributed on an "AS IS" BASIS,
+##  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+##  See the License for the specific language governing permissions and
+##  limitations under the License.
+
+## Remote builds (--at) against a worker listening on a local socket
+## (--worker=PATH): output and exit status must come back to the client.
+
+. "`dirname "$0"`/common.sh"
+
+project "$tmp/proj"
+"$BUILD" --worker="$tmp/w.sock" 2>"$tmp/worker.log" &
+pids=$!
+n=0
+while ! test -S "$tmp/w.sock" ; do
+	n=$((n + 1))
+	test $n -lt 50 || fail "the worker didn't start listening"
+	sleep 0.1
+done
+
+cd "$tmp/proj"
+"$BUILD" --at=unix:"$tmp/w.sock" build > "$tmp/out" 2>&1 || fail "remote build failed: `cat "$tmp/out"`"
+grep "compiling in $tmp/proj" "$tmp/out" >/dev/null || fail "the worker's output wasn't relayed"
+test -f out/prog || fail "the worker didn't build in the same directory"
+
+rm -rf out
+if "$BUILD" --at=unix:"$tmp/w.sock" build FAIL=1 > "$tmp/out" 2>&1 ; then
+	fail "a failed remote build succeeded"
+fi
+grep "compiling" "$tmp/out" >/dev/null || fail "the output of a failed remote build wasn't relayed"
+
+## The worker carries on after each request
+"$BUILD" --at=unix:"$tmp/w.sock" build > "$tmp/out" 2>&1 || fail "a second remote build failed"
+exit 0
@@ -0,0 +1,92 @@
+#! /bin/sh
+## Copyright 2013 Mo McRoberts.
+##
+##  Licensed under the Apache License, Version 2.0 (the "License");
+##  you may not use this file except in compliance with the License.
+##  You may obtain a copy of the License at
+##
+##      http://www.apache.org/licenses/LICENSE-2.0
+##
+##  Unless required by applicable law or agreed to in writing, software
+##  distributed under the License is distributed on an "AS IS" BASIS,
+##  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+##  See the License for the specific language governing permissions and
+##  limitations under the License.
+
+## Remote builds with --sync: the tree is copied to the worker, which
+## builds in its copy, and a manifest may not write outside of that copy.
+
+. "`dirname "$0"`/common.sh"
+
+project "$tmp/proj"
+ln -s a.c "$tmp/proj/src/link.c"
+echo gone > "$tmp/proj/src/gone.c"
+"$BUILD" --worker="$tmp/w.sock" 2>"$tmp/worker.log" &
+pids=$!
+n=0
+while ! test -S "$tmp/w.sock" ; do
+	n=$((n + 1))
+	test $n -lt 50 || fail "the worker didn't start listening"
+	sleep 0.1
+done
+
+cd "$tmp/proj"
+"$BUILD" --at=unix:"$tmp/w.sock" --sync build > "$tmp/out" 2>&1 || fail "synchronised build failed: `cat "$tmp/out"`"
+test -f out/prog && fail "the build was performed in the client's tree"
+copy=`sed -n "s@^compiling in @@p" "$tmp/out"`
+case "$copy" in
+	"$BUILD_CACHE_DIR"/worker/*)
+		;;
+	*)
+		fail "the build wasn't performed in the worker's copy: `cat "$tmp/out"`"
+		;;
+esac
+test -f "$copy/out/prog" || fail "the worker's copy wasn't built"
+cmp src/a.c "$copy/src/a.c" || fail "src/a.c wasn't copied intact"
+test "`readlink "$copy/src/link.c"`" = a.c || fail "src/link.c wasn't copied as a symbolic link"
+
+## Changes, including removals, are carried across by the next sync
+## (modification times are preserved to the second, so make wouldn't
+## otherwise notice the change)
+sleep 1
+echo '/* changed */' >> src/a.c
+rm src/gone.c
+"$BUILD" --at=unix:"$tmp/w.sock" --sync build > "$tmp/out" 2>&1 || fail "second synchronised build failed: `cat "$tmp/out"`"
+cmp src/a.c "$copy/src/a.c" || fail "a change to src/a.c wasn't copied"
+test -f "$copy/src/gone.c" && fail "src/gone.c wasn't removed from the copy"
+cmp src/a.c "$copy/out/prog" || fail "the copy wasn't rebuilt"
+
+## A manifest which writes through a symbolic link, or to a path which
+## leads out of the copy, must be refused. The chunk is put in the
+## worker's store beforehand, so that it isn't asked for.
+mkdir "$tmp/victim"
+hex=0123456789abcdef0123456789abcdef
+mkdir -p "$BUILD_CACHE_DIR/chunks/01"
+printf 'echo' > "$BUILD_CACHE_DIR/chunks/01/23456789abcdef0123456789abcdef"
+: > "$tmp/empty"
+printf '%s\0' x L evil "$tmp/victim" F 644 0 evil/.profile 1 $hex 4 > "$tmp/manifest"
+{ frame M "$tmp/manifest" ; frame D "$tmp/empty" ; } > "$tmp/request"
+if "$BUILD" --worker < "$tmp/request" > /dev/null 2> "$tmp/err" ; then
+	fail "a manifest writing through a symbolic link was accepted"
+fi
+test -z "`ls -A "$tmp/victim"`" || fail "a file was written through a symbolic link"
+grep "refusing to write" "$tmp/err" > /dev/null || fail "unexpected error: `cat "$tmp/err"`"
+printf '%s\0' x F 644 0 ../escape 1 $hex 4 > "$tmp/manifest"
+{ frame M "$tmp/manifest" ; frame D "$tmp/empty" ; } > "$tmp/request"
+if "$BUILD" --worker < "$tmp/request" > /dev/null 2> "$tmp/err" ; then
+	fail "a manifest writing outside of the copy was accepted"
+fi
+test -f "$BUILD_CACHE_DIR/worker/escape" && fail "a file was written outside of the copy"
+grep "refusing to write" "$tmp/err" > /dev/null || fail "unexpected error: `cat "$tmp/err"`"
+
+## So must one whose chunk ids lead out of the store, which would copy
+## whatever they point at into the copy
+echo secret > "$tmp/secret"
+printf '%s\0' x F 644 0 stolen 1 ../../secret 7 > "$tmp/manifest"
+{ frame M "$tmp/manifest" ; frame D "$tmp/empty" ; } > "$tmp/request"
+if "$BUILD" --worker < "$tmp/request" > /dev/null 2> "$tmp/err" ; then
+	fail "a manifest with a chunk id outside of the store was accepted"
+fi
+test -n "`find "$BUILD_CACHE_DIR/worker" -name stolen`" && fail "a file outside of the store was copied"
+grep "malformed chunk id" "$tmp/err" > /dev/null || fail "unexpected error: `cat "$tmp/err"`"
+exit 0
@@ -0,0 +1,194 @@
+/* Copyright 2013 Mo McRoberts.
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ */
+
+#ifdef HAVE_CONFIG_H
+# include "config.h"
+#endif
+
+#include <math.h>
+
+#include "p_build.h"
+
+/* Recorded timings.
+ *
+ * The time taken by each phase performed successfully, and by each
+ * command run, is kept in '.build/timings', so that the duration of a
+ * later build can be predicted before it starts (see plan.c), and so
+ * that the longest work can be started first (see workspace.c). Phases
+ * are recorded as 'phase.NAME.OPTIONS', where OPTIONS is the digest of
+ * the options given (so that each configuration has its own), commands
+ * as 'cmd.DIGEST', where DIGEST is that of the command's arguments, and
+ * the projects in a workspace as 'job.DIGEST', in the workspace's own
+ * state directory.
+ *
+ * Rather than a history of every run, each entry holds rolling
+ * statistics: the number of runs recorded, a moving average and
+ * variance which favour recent runs, and the most recent duration, all
+ * in microseconds. The first few runs are weighted equally, so that a
+ * single unusual run doesn't linger.
+ */
+
+#define TIMING_FILE                     "timings"
+/* Once this many runs have been recorded, each new one has a weight of
+ * 1/TIMING_WINDOW
+ */
+#define TIMING_WINDOW                   4
+
+typedef struct timing_stats_s timing_stats_t;
+
+struct timing_stats_s
+{
+	unsigned long n;
+	double mean;
+	double var;
+	long long last;
+};
+
+static build_defn_t *timings;
+static char *timingdir;
+static int timingdirty;
+
+/* Load the timings for the project in the current directory, if they
+ * aren't already loaded
+ */
+static void
+timing_load(build_context_t *ctx)
+{
+	if(!ctx->statedir || (timingdir && !strcmp(timingdir, ctx->statedir)))
+	{
+		return;
+	}
+	state_free(timings);
+	free(timingdir);
+	timings = state_load(ctx, TIMING_FILE);
+	timingdir = strdup(ctx->statedir);
+	timingdirty = 0;
+}
+
+/* Return the name under which the timing of a command is recorded */
+const char *
+timing_cmdkey(cmd_t *cmd)
+{
+	static char key[DIGEST_HEXLEN + 8];
+	digest_t d;
+	size_t c;
+
+	digest_init(&d);
+	for(c = 0; c < cmd->argc; c++)
+	{
+		digest_str(&d, cmd->argv[c]);
+	}
+	strcpy(key, "cmd.");
+	digest_final(&d, key + 4);
+	return key;
+}
+
+/* Return the name under which the timing of a phase is recorded, for
+ * the current configuration
+ */
+const char *
+timing_phasekey(build_context_t *ctx, build_phase_t phase)
+{
+	static char key[DIGEST_HEXLEN + 32];
+	char hex[DIGEST_HEXLEN + 1];
+	digest_t d;
+
+	digest_init(&d);
+	context_digest_options(ctx, &d);
+	digest_final(&d, hex);
+	snprintf(key, sizeof(key), "phase.%s.%s", context_phase_name(phase), hex);
+	return key;
+}
+
+static int
+timing_get(const char *key, timing_stats_t *stats)
+{
+	const char *value;
+
+	memset(stats, 0, sizeof(timing_stats_t));
+	if(!(value = state_get(timings, key)) || sscanf(value, "%lu %lf %lf %lld", &(stats->n), &(stats->mean), &(stats->var), &(stats->last)) != 4)
+	{
+		return -1;
+	}
+	return 0;
+}
+
+/* Return the predicted duration of whatever key refers to, in
+ * microseconds, or -1 if there's no telling
+ */
+long long
+timing_predict(build_context_t *ctx, const char *key)
+{
+	timing_stats_t stats;
+
+	timing_load(ctx);
+	if(timing_get(key, &stats) || !stats.n)
+	{
+		return -1;
+	}
+	return (long long) stats.mean;
+}
+
+/* Return the standard deviation of the recorded durations, in
+ * microseconds, or -1 if there's no telling
+ */
+long long
+timing_deviation(build_context_t *ctx, const char *key)
+{
+	timing_stats_t stats;
+
+	timing_load(ctx);
+	if(timing_get(key, &stats) || stats.n < 2)
+	{
+		return -1;
+	}
+	return (long long) sqrt(stats.var);
+}
+
+void
+timing_record(build_context_t *ctx, const char *key, long long usec)
+{
+	timing_stats_t stats;
+	double alpha, delta;
+
+	if(ctx->dryrun)
+	{
+		return;
+	}
+	timing_load(ctx);
+	if(timing_get(key, &stats))
+	{
+		stats.n = 0;
+	}
+	stats.n++;
+	alpha = (stats.n < TIMING_WINDOW ? 1.0 / stats.n : 1.0 / TIMING_WINDOW);
+	delta = usec - stats.mean;
+	stats.mean += alpha * delta;
+	stats.var = (1.0 - alpha) * (stats.var + alpha * delta * delta);
+	stats.last = usec;
+	state_setf(ctx, &timings, key, "%lu %.0f %.0f %lld", stats.n, stats.mean, stats.var, stats.last);
+	timingdirty = 1;
+}
+
+int
+timing_save(build_context_t *ctx)
+{
+	if(!timingdirty || !timingdir || !ctx->statedir || strcmp(timingdir, ctx->statedir))
+	{
+		return 0;
+	}
+	timingdirty = 0;
+	return state_save(ctx, TIMING_FILE, timings);
+}
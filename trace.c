@@ -0,0 +1,159 @@
+/* Copyright 2013 Mo McRoberts.
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ */
+
+#ifdef HAVE_CONFIG_H
+# include "config.h"
+#endif
+
+#include "p_build.h"
+
+/* Trace output.
+ *
+ * With --trace=FILE, a span is recorded for each phase performed and for
+ * each command spawned, in the Trace Event format understood by
+ * chrome://tracing and Perfetto. The file is a JSON array which is never
+ * closed (which both permit), so that any number of processes can
+ * append complete events to it: the trace file is passed to nested
+ * invocations of build through $BUILD_TRACE, and each event is written
+ * with a single append. Timestamps are taken from the real-time clock so
+ * that events from different processes line up.
+ */
+
+static int tracefd = -1;
+static pid_t tracepid;
+
+/* Return the current time in microseconds */
+long long
+trace_now(void)
+{
+	struct timeval tv;
+
+	gettimeofday(&tv, NULL);
+	return tv.tv_sec * 1000000LL + tv.tv_usec;
+}
+
+/* Write a JSON string literal to buf, which must have room for six
+ * times the length of str, plus the quotes
+ */
+static size_t
+trace_quote(char *buf, const char *str)
+{
+	size_t n;
+
+	n = 0;
+	buf[n++] = '"';
+	for(; *str; str++)
+	{
+		if(*str == '"' || *str == '\\')
+		{
+			buf[n++] = '\\';
+			buf[n++] = *str;
+		}
+		else if((unsigned char) *str < 0x20)
+		{
+			n += sprintf(&(buf[n]), "\\u%04x", (unsigned) (unsigned char) *str);
+		}
+		else
+		{
+			buf[n++] = *str;
+		}
+	}
+	buf[n++] = '"';
+	return n;
+}
+
+/* Open the trace file, if there is one. If it was named on our own
+ * command-line, any existing file is replaced.
+ */
+int
+trace_init(build_context_t *ctx, int create)
+{
+	int flags;
+
+	if(!ctx->tracefile || tracefd >= 0)
+	{
+		return 0;
+	}
+	flags = O_WRONLY|O_APPEND|O_CREAT;
+	if(create)
+	{
+		flags |= O_TRUNC;
+	}
+	if((tracefd = open(ctx->tracefile, flags, 0666)) < 0)
+	{
+		context_msg(ctx, MSG_PERROR, "%s", ctx->tracefile);
+		ctx->tracefile = NULL;
+		return -1;
+	}
+	fcntl(tracefd, F_SETFD, fcntl(tracefd, F_GETFD) | FD_CLOEXEC);
+	if(create && write(tracefd, "[\n", 2) != 2)
+	{
+		context_msg(ctx, MSG_PERROR, "%s", ctx->tracefile);
+	}
+	return 0;
+}
+
+/* Record a complete event spanning start to end (as returned by
+ * trace_now()). detail, if not NULL, is recorded as the event's
+ * argument.
+ */
+void
+trace_event(build_context_t *ctx, const char *cat, const char *name, long long start, long long end, const char *detail, int status)
+{
+	char *buf, *cwd;
+	size_t len, n;
+
+	if(tracefd < 0)
+	{
+		return;
+	}
+	cwd = getcwd(NULL, 0);
+	len = 512 + (strlen(name) + (detail ? strlen(detail) : 0) + (cwd ? strlen(cwd) * 2 : 0)) * 6;
+	if(!(buf = malloc(len)))
+	{
+		free(cwd);
+		return;
+	}
+	n = 0;
+	/* Name the track for each process (including the projects in a
+	 * workspace, which are forked) after its level and directory.
+	 */
+	if(tracepid != getpid())
+	{
+		tracepid = getpid();
+		n += sprintf(buf, "{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":%ld,\"tid\":%ld,\"args\":{\"name\":",
+					 (long) tracepid, (long) tracepid);
+		n += trace_quote(&(buf[n]), (cwd ? cwd : ""));
+		n += sprintf(&(buf[n]), "}},\n{\"name\":\"process_sort_index\",\"ph\":\"M\",\"pid\":%ld,\"tid\":%ld,\"args\":{\"sort_index\":%d}},\n",
+					 (long) tracepid, (long) tracepid, ctx->level);
+	}
+	n += sprintf(&(buf[n]), "{\"name\":");
+	n += trace_quote(&(buf[n]), name);
+	n += sprintf(&(buf[n]), ",\"cat\":\"%s\",\"ph\":\"X\",\"ts\":%lld,\"dur\":%lld,\"pid\":%ld,\"tid\":%ld,\"args\":{\"dir\":",
+				 cat, start, end - start, (long) getpid(), (long) getpid());
+	n += trace_quote(&(buf[n]), (cwd ? cwd : ""));
+	if(detail)
+	{
+		n += sprintf(&(buf[n]), ",\"detail\":");
+		n += trace_quote(&(buf[n]), detail);
+	}
+	n += sprintf(&(buf[n]), ",\"status\":%d}},\n", status);
+	if(write(tracefd, buf, n) != (ssize_t) n)
+	{
+		context_msg(ctx, MSG_PERROR, "%s", ctx->tracefile);
+	}
+	free(buf);
+	free(cwd);
+}
@@ -0,0 +1,566 @@
+/* Copyright 2013 Mo McRoberts.
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ */
+
+#ifdef HAVE_CONFIG_H
+# include "config.h"
+#endif
+
+#include <pthread.h>
+#include <sys/mman.h>
+
+#include "p_build.h"
+
+/* Tree fingerprinting.
+ *
+ * tree_scan() lists every file and symbolic link beneath a directory,
+ * along with a stamp describing its current state (inode, size,
+ * modification and change times) and, if requested, a digest of its
+ * contents (or of the target, for a link). Directories are read by a
+ * pool of threads, each of which takes the next unread directory from a
+ * shared queue, so that a large tree is read with several requests in
+ * flight at once; everything is opened relative to the directory
+ * containing it, so that paths are never resolved twice.
+ *
+ * With TREE_INDEX, the stamps and digests are kept in '.build/tree'
+ * beneath the root, and a file whose stamp hasn't changed since the
+ * last scan isn't read again: once the index is warm, a scan costs one
+ * stat() per file.
+ */
+
+#define TREE_INDEX_NAME                 "tree"
+#define TREE_THREADS_MAX                16
+/* Files at least this large are mapped rather than read */
+#define TREE_MMAP_MIN                   (256 * 1024)
+/* Files modified this recently (in seconds) aren't added to the index,
+ * because they could change again without their stamp doing so
+ */
+#define TREE_RACY                       2
+
+typedef struct tree_dir_s tree_dir_t;
+typedef struct tree_scan_s tree_scan_t;
+typedef struct tree_worker_s tree_worker_t;
+
+struct tree_dir_s
+{
+	char *rel;
+	tree_dir_t *next;
+};
+
+/* State shared by all of the threads performing a scan */
+struct tree_scan_s
+{
+	build_context_t *ctx;
+	const char *root;
+	int rootfd;
+	int flags;
+	const char *const *ignore;
+	build_defn_t *index;
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	/* Directories waiting to be read */
+	tree_dir_t *queue;
+	/* Directories either queued or being read */
+	size_t pending;
+	int err;
+};
+
+/* Each thread collects its own entries, which are merged afterwards */
+struct tree_worker_s
+{
+	tree_scan_t *scan;
+	pthread_t thread;
+	tree_entry_t *entries;
+	size_t count;
+	size_t alloc;
+	unsigned long long bytes;
+	unsigned long long hashbytes;
+	size_t hashed;
+};
+
+void
+tree_stamp(const struct stat *st, char *buf, size_t len)
+{
+#ifdef __APPLE__
+	const struct timespec *mt = &(st->st_mtimespec), *ct = &(st->st_ctimespec);
+#else
+	const struct timespec *mt = &(st->st_mtim), *ct = &(st->st_ctim);
+#endif
+
+	snprintf(buf, len, "%llu:%llu:%lld.%09ld:%lld.%09ld", (unsigned long long) st->st_ino, (unsigned long long) st->st_size,
+			 (long long) mt->tv_sec, (long) mt->tv_nsec, (long long) ct->tv_sec, (long) ct->tv_nsec);
+}
+
+static int
+tree_ignored(tree_scan_t *scan, const char *name)
+{
+	size_t c;
+
+	if(!strcmp(name, ".") || !strcmp(name, ".."))
+	{
+		return 1;
+	}
+	for(c = 0; scan->ignore && scan->ignore[c]; c++)
+	{
+		if(!strcmp(name, scan->ignore[c]))
+		{
+			return 1;
+		}
+	}
+	return 0;
+}
+
+/* Report an error and cause the scan to stop */
+static void
+tree_fail(tree_scan_t *scan, const char *rel, const char *name)
+{
+	int e;
+
+	e = errno;
+	pthread_mutex_lock(&(scan->lock));
+	if(!scan->err)
+	{
+		errno = e;
+		context_msg(scan->ctx, MSG_PERROR, "%s/%s%s%s", scan->root, rel, (rel[0] && name[0] ? "/" : ""), name);
+		scan->err = -1;
+	}
+	pthread_cond_broadcast(&(scan->cond));
+	pthread_mutex_unlock(&(scan->lock));
+}
+
+static int
+tree_enqueue(tree_scan_t *scan, const char *rel)
+{
+	tree_dir_t *dir;
+
+	if(!(dir = (tree_dir_t *) calloc(1, sizeof(tree_dir_t))) || !(dir->rel = strdup(rel)))
+	{
+		free(dir);
+		return -1;
+	}
+	pthread_mutex_lock(&(scan->lock));
+	dir->next = scan->queue;
+	scan->queue = dir;
+	scan->pending++;
+	pthread_cond_signal(&(scan->cond));
+	pthread_mutex_unlock(&(scan->lock));
+	return 0;
+}
+
+/* Digest the contents of a file, mapping it if it's large enough for
+ * that to be worthwhile
+ */
+static int
+tree_digest_file(tree_worker_t *w, int fd, const struct stat *st, char *hex)
+{
+	unsigned char buf[65536];
+	digest_t d;
+	void *map;
+	ssize_t r;
+
+	digest_init(&d);
+	if(st->st_size >= TREE_MMAP_MIN && (map = mmap(NULL, st->st_size, PROT_READ, MAP_PRIVATE, fd, 0)) != MAP_FAILED)
+	{
+#ifdef MADV_SEQUENTIAL
+		madvise(map, st->st_size, MADV_SEQUENTIAL);
+#endif
+		digest_update(&d, map, st->st_size);
+		munmap(map, st->st_size);
+		w->hashbytes += st->st_size;
+	}
+	else
+	{
+		while((r = read(fd, buf, sizeof(buf))) != 0)
+		{
+			if(r < 0)
+			{
+				if(errno == EINTR)
+				{
+					continue;
+				}
+				return -1;
+			}
+			digest_update(&d, buf, r);
+			w->hashbytes += r;
+		}
+	}
+	digest_final(&d, hex);
+	w->hashed++;
+	return 0;
+}
+
+static tree_entry_t *
+tree_entry_add(tree_worker_t *w, const char *rel, const char *name)
+{
+	tree_entry_t *p;
+	size_t len;
+
+	if(w->count >= w->alloc)
+	{
+		if(!(p = (tree_entry_t *) realloc(w->entries, sizeof(tree_entry_t) * (w->alloc + 1024))))
+		{
+			return NULL;
+		}
+		w->entries = p;
+		w->alloc += 1024;
+	}
+	p = &(w->entries[w->count]);
+	memset(p, 0, sizeof(tree_entry_t));
+	len = strlen(rel);
+	if(!(p->path = (char *) malloc(len + strlen(name) + 2)))
+	{
+		return NULL;
+	}
+	sprintf(p->path, "%s%s%s", rel, (len ? "/" : ""), name);
+	w->count++;
+	return p;
+}
+
+/* Read a single directory, queueing its subdirectories */
+static int
+tree_read_dir(tree_worker_t *w, const char *rel)
+{
+	tree_scan_t *scan;
+	tree_entry_t *e;
+	struct dirent *de;
+	struct stat st;
+	char target[4096], sub[4096];
+	const char *prev;
+	digest_t d;
+	ssize_t r;
+	DIR *dir;
+	int dfd, fd;
+
+	scan = w->scan;
+	if((dfd = openat(scan->rootfd, (rel[0] ? rel : "."), O_RDONLY|O_DIRECTORY|O_NOFOLLOW|O_CLOEXEC)) < 0 || !(dir = fdopendir(dfd)))
+	{
+		if(dfd >= 0)
+		{
+			close(dfd);
+		}
+		tree_fail(scan, rel, "");
+		return -1;
+	}
+	while((de = readdir(dir)) && !scan->err)
+	{
+		if(tree_ignored(scan, de->d_name))
+		{
+			continue;
+		}
+		if(fstatat(dfd, de->d_name, &st, AT_SYMLINK_NOFOLLOW) < 0)
+		{
+			if(errno == ENOENT)
+			{
+				/* Removed while we were looking */
+				continue;
+			}
+			tree_fail(scan, rel, de->d_name);
+			break;
+		}
+		if(S_ISDIR(st.st_mode))
+		{
+			snprintf(sub, sizeof(sub), "%s%s%s", rel, (rel[0] ? "/" : ""), de->d_name);
+			if(tree_enqueue(scan, sub))
+			{
+				tree_fail(scan, rel, de->d_name);
+				break;
+			}
+			continue;
+		}
+		if(!S_ISREG(st.st_mode) && !S_ISLNK(st.st_mode))
+		{
+			continue;
+		}
+		if(!(e = tree_entry_add(w, rel, de->d_name)))
+		{
+			tree_fail(scan, rel, de->d_name);
+			break;
+		}
+		e->mode = st.st_mode;
+		e->mtime = st.st_mtime;
+		tree_stamp(&st, e->stamp, sizeof(e->stamp));
+		w->bytes += st.st_size;
+		if(!(scan->flags & TREE_DIGEST))
+		{
+			continue;
+		}
+		/* An index entry is the stamp, a space, and the digest */
+		if((prev = state_get(scan->index, e->path)) && strlen(prev) == strlen(e->stamp) + 1 + DIGEST_HEXLEN &&
+		   !strncmp(prev, e->stamp, strlen(e->stamp)) && prev[strlen(e->stamp)] == ' ')
+		{
+			strcpy(e->digest, prev + strlen(e->stamp) + 1);
+			continue;
+		}
+		if(S_ISLNK(st.st_mode))
+		{
+			if((r = readlinkat(dfd, de->d_name, target, sizeof(target) - 1)) < 0)
+			{
+				tree_fail(scan, rel, de->d_name);
+				break;
+			}
+			target[r] = 0;
+			digest_init(&d);
+			digest_str(&d, target);
+			digest_final(&d, e->digest);
+			continue;
+		}
+		if((fd = openat(dfd, de->d_name, O_RDONLY|O_NOFOLLOW|O_CLOEXEC)) < 0)
+		{
+			tree_fail(scan, rel, de->d_name);
+			break;
+		}
+		if(tree_digest_file(w, fd, &st, e->digest))
+		{
+			tree_fail(scan, rel, de->d_name);
+			close(fd);
+			break;
+		}
+		close(fd);
+	}
+	closedir(dir);
+	return scan->err;
+}
+
+static void *
+tree_worker(void *arg)
+{
+	tree_worker_t *w;
+	tree_scan_t *scan;
+	tree_dir_t *dir;
+
+	w = (tree_worker_t *) arg;
+	scan = w->scan;
+	for(;;)
+	{
+		pthread_mutex_lock(&(scan->lock));
+		while(!scan->queue && scan->pending && !scan->err)
+		{
+			pthread_cond_wait(&(scan->cond), &(scan->lock));
+		}
+		if(!scan->queue || scan->err)
+		{
+			pthread_mutex_unlock(&(scan->lock));
+			break;
+		}
+		dir = scan->queue;
+		scan->queue = dir->next;
+		pthread_mutex_unlock(&(scan->lock));
+		tree_read_dir(w, dir->rel);
+		free(dir->rel);
+		free(dir);
+		pthread_mutex_lock(&(scan->lock));
+		scan->pending--;
+		if(!scan->pending)
+		{
+			pthread_cond_broadcast(&(scan->cond));
+		}
+		pthread_mutex_unlock(&(scan->lock));
+	}
+	return NULL;
+}
+
+static int
+tree_entcmp(const void *a, const void *b)
+{
+	return strcmp(((const tree_entry_t *) a)->path, ((const tree_entry_t *) b)->path);
+}
+
+static int
+tree_index_save(tree_scan_t *scan, tree_t *tree)
+{
+	build_defn_t *kv;
+	char *dir, value[DIGEST_HEXLEN + 128];
+	time_t now;
+	size_t c;
+	int r;
+
+	if(!(dir = (char *) malloc(strlen(scan->root) + 8)))
+	{
+		return -1;
+	}
+	sprintf(dir, "%s/.build", scan->root);
+	now = time(NULL);
+	kv = NULL;
+	for(c = 0; c < tree->count; c++)
+	{
+		if(tree->entries[c].mtime + TREE_RACY > now || strpbrk(tree->entries[c].path, "=\n"))
+		{
+			continue;
+		}
+		snprintf(value, sizeof(value), "%s %s", tree->entries[c].stamp, tree->entries[c].digest);
+		state_set(scan->ctx, &kv, tree->entries[c].path, value);
+	}
+	r = state_save_dir(scan->ctx, dir, TREE_INDEX_NAME, kv);
+	state_free(kv);
+	free(dir);
+	return r;
+}
+
+/* Scan the tree beneath root, using up to nthreads threads (or a number
+ * appropriate to the system, if zero). If root doesn't exist, the tree
+ * is empty. The entries of the result are sorted by path.
+ */
+tree_t *
+tree_scan(build_context_t *ctx, const char *root, const char *const *ignore, int flags, int nthreads)
+{
+	tree_scan_t scan;
+	tree_worker_t *workers;
+	tree_dir_t *q;
+	tree_t *tree;
+	char *dir;
+	int c, started;
+	size_t n, indexed;
+
+	if(!(tree = (tree_t *) calloc(1, sizeof(tree_t))))
+	{
+		context_msg(ctx, MSG_PERROR, "calloc(1, %u)", (unsigned) sizeof(tree_t));
+		return NULL;
+	}
+	memset(&scan, 0, sizeof(scan));
+	scan.ctx = ctx;
+	scan.root = root;
+	scan.flags = flags;
+	scan.ignore = ignore;
+	if((scan.rootfd = open(root, O_RDONLY|O_DIRECTORY|O_CLOEXEC)) < 0)
+	{
+		if(errno == ENOENT)
+		{
+			return tree;
+		}
+		context_msg(ctx, MSG_PERROR, "%s", root);
+		free(tree);
+		return NULL;
+	}
+	if((flags & TREE_INDEX) && (flags & TREE_DIGEST) && (dir = (char *) malloc(strlen(root) + 8)))
+	{
+		sprintf(dir, "%s/.build", root);
+		scan.index = state_load_dir(ctx, dir, TREE_INDEX_NAME);
+		free(dir);
+	}
+	if(nthreads < 1)
+	{
+		nthreads = (int) resource_cpus(ctx);
+	}
+	if(nthreads > TREE_THREADS_MAX)
+	{
+		nthreads = TREE_THREADS_MAX;
+	}
+	if(!(workers = (tree_worker_t *) calloc(nthreads, sizeof(tree_worker_t))))
+	{
+		context_msg(ctx, MSG_PERROR, "calloc(%d, %u)", nthreads, (unsigned) sizeof(tree_worker_t));
+		close(scan.rootfd);
+		state_free(scan.index);
+		free(tree);
+		return NULL;
+	}
+	pthread_mutex_init(&(scan.lock), NULL);
+	pthread_cond_init(&(scan.cond), NULL);
+	if(tree_enqueue(&scan, ""))
+	{
+		scan.err = -1;
+	}
+	/* The calling thread is the first worker; if further threads can't
+	 * be started, the scan proceeds with those that could
+	 */
+	started = 1;
+	for(c = 0; c < nthreads; c++)
+	{
+		workers[c].scan = &scan;
+		if(c && !scan.err && !pthread_create(&(workers[c].thread), NULL, tree_worker, &(workers[c])))
+		{
+			started = c + 1;
+		}
+		else if(c)
+		{
+			break;
+		}
+	}
+	tree_worker(&(workers[0]));
+	for(c = 1; c < started; c++)
+	{
+		pthread_join(workers[c].thread, NULL);
+	}
+	/* Anything still queued was abandoned because of an error */
+	while((q = scan.queue))
+	{
+		scan.queue = q->next;
+		free(q->rel);
+		free(q);
+	}
+	pthread_cond_destroy(&(scan.cond));
+	pthread_mutex_destroy(&(scan.lock));
+	close(scan.rootfd);
+	indexed = HASH_COUNT(scan.index);
+	state_free(scan.index);
+	/* Gather the results */
+	for(c = 0, n = 0; c < nthreads; c++)
+	{
+		n += workers[c].count;
+	}
+	if(!scan.err && n && !(tree->entries = (tree_entry_t *) malloc(sizeof(tree_entry_t) * n)))
+	{
+		context_msg(ctx, MSG_PERROR, "malloc(%u)", (unsigned) (sizeof(tree_entry_t) * n));
+		scan.err = -1;
+	}
+	for(c = 0; c < nthreads; c++)
+	{
+		if(!scan.err)
+		{
+			memcpy(&(tree->entries[tree->count]), workers[c].entries, sizeof(tree_entry_t) * workers[c].count);
+			tree->count += workers[c].count;
+		}
+		else
+		{
+			for(n = 0; n < workers[c].count; n++)
+			{
+				free(workers[c].entries[n].path);
+			}
+		}
+		tree->bytes += workers[c].bytes;
+		tree->hashbytes += workers[c].hashbytes;
+		tree->hashed += workers[c].hashed;
+		free(workers[c].entries);
+	}
+	free(workers);
+	if(scan.err)
+	{
+		tree_free(tree);
+		return NULL;
+	}
+	qsort(tree->entries, tree->count, sizeof(tree_entry_t), tree_entcmp);
+	/* The index only needs rewriting if a file was read, or one has gone */
+	if((flags & TREE_INDEX) && (flags & TREE_DIGEST) && !ctx->dryrun && (tree->hashed || tree->count != indexed))
+	{
+		tree_index_save(&scan, tree);
+	}
+	context_msg(ctx, MSG_DEBUG, "scanned %lu file(s) beneath %s using %d thread(s); %lu read\n", (unsigned long) tree->count, root, started, (unsigned long) tree->hashed);
+	return tree;
+}
+
+void
+tree_free(tree_t *tree)
+{
+	size_t c;
+
+	if(!tree)
+	{
+		return;
+	}
+	for(c = 0; c < tree->count; c++)
+	{
+		free(tree->entries[c].path);
+	}
+	free(tree->entries);
+	free(tree);
+}
@@ -0,0 +1,663 @@
+/* Copyright 2013 Mo McRoberts.
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ */
+
+#ifdef HAVE_CONFIG_H
+# include "config.h"
+#endif
+
+#include <poll.h>
+#ifdef HAVE_SYS_INOTIFY_H
+# include <sys/inotify.h>
+#endif
+
+#include "p_build.h"
+
+/* Watch mode.
+ *
+ * 'build watch [PHASE...]' performs the requested phases, then waits
+ * for something in the project to change and performs them again, for
+ * as long as it's left running. Each changed path is mapped to the
+ * earliest phase which it invalidates: the inputs to autoconf and
+ * aclocal to 'prepare', automake inputs and other templates to
+ * 'config', and anything else to 'build'. Only that phase and those
+ * after it are performed again, using the same context, so that
+ * nothing which has already been discovered (such as the handler for
+ * the project) is discovered afresh.
+ *
+ * Changes are noticed with inotify where it's available, or otherwise
+ * by scanning the tree once a second. If inotify's queue overflows, the
+ * tree is scanned too, and compared with the stamps of what's in it as
+ * of the events seen so far. Either way, a burst of changes (such as a
+ * save from an editor, or a checkout) is collected together until
+ * things have been quiet for a moment.
+ *
+ * Most of what changes while a build is in progress is the build's own
+ * output, but a file saved in the meantime mustn't be missed, so the
+ * outputs are told apart by path, and learned as we go. A path which
+ * changes while no build is in progress is an input. Anything which
+ * changes during a build, other than a known output, counts as a change
+ * once the build has finished. If performing the phases again because
+ * of those changes alone does no further work, or the build changes
+ * them all over again, those which aren't known to be inputs are
+ * outputs, and are disregarded during builds from then on. Files which
+ * come and go during a build, and aren't known to be inputs, are
+ * disregarded too.
+ */
+
+/* How long things must be quiet before building, in milliseconds */
+#define WATCH_DEBOUNCE                  250
+/* How often the tree is scanned without inotify, in milliseconds */
+#define WATCH_POLL                      1000
+
+#ifdef HAVE_SYS_INOTIFY_H
+# define WATCH_EVENTS                   (IN_CLOSE_WRITE|IN_ATTRIB|IN_CREATE|IN_DELETE|IN_MOVED_FROM|IN_MOVED_TO)
+#endif
+
+typedef struct watch_s watch_t;
+typedef struct watch_dir_s watch_dir_t;
+
+struct watch_dir_s
+{
+	int wd;
+	char *rel;
+};
+
+struct watch_s
+{
+	build_context_t *ctx;
+	int fd;
+	/* The directories being watched, with inotify */
+	watch_dir_t *dirs;
+	size_t ndirs;
+	size_t alloc;
+	/* The stamps of everything in the tree; with inotify, kept up to
+	 * date as events arrive, in case the tree has to be scanned
+	 */
+	build_defn_t *snap;
+	/* Set if inotify's queue overflowed, so that what changed can only
+	 * be found by scanning the tree
+	 */
+	int rescan;
+	/* What has changed since the last build */
+	build_phase_t earliest;
+	unsigned long nchanged;
+	char first[4096];
+	int others;
+	/* Set while collecting, and then sorting out, what changed during
+	 * a build
+	 */
+	int building;
+	int settling;
+	build_defn_t *during;
+	/* What changed during the last build, and the known inputs and
+	 * outputs
+	 */
+	build_defn_t *suspects;
+	build_defn_t *inputs;
+	build_defn_t *outputs;
+};
+
+static const char *const watch_ignore[] = { ".build", ".git", ".hg", ".svn", "autom4te.cache", NULL };
+
+static void
+watch_changed(watch_t *w, const char *path)
+{
+	build_phase_t phase;
+
+	if(w->building)
+	{
+		state_set(w->ctx, &(w->during), path, "");
+		return;
+	}
+	if(!w->settling)
+	{
+		state_set(w->ctx, &(w->inputs), path, "");
+		if(state_find(w->outputs, path))
+		{
+			state_unset(&(w->outputs), path);
+		}
+	}
+	phase = context_path_phase(path);
+	context_msg(w->ctx, MSG_DEBUG, "`%s' changed (invalidating phase '%s')\n", path, context_phase_name(phase));
+	if(!w->nchanged || phase < w->earliest)
+	{
+		w->earliest = phase;
+	}
+	if(!w->nchanged)
+	{
+		snprintf(w->first, sizeof(w->first), "%s", path);
+	}
+	else if(strcmp(path, w->first))
+	{
+		w->others = 1;
+	}
+	w->nchanged++;
+}
+
+/* Editors' backup, swap and lock files, and the like */
+static int
+watch_ignored(const char *name)
+{
+	size_t c, l;
+
+	for(c = 0; watch_ignore[c]; c++)
+	{
+		if(!strcmp(name, watch_ignore[c]))
+		{
+			return 1;
+		}
+	}
+	l = strlen(name);
+	return (!l || name[0] == '.' || name[0] == '#' || name[l - 1] == '~' ||
+			(l > 4 && (!strcmp(name + l - 4, ".swp") || !strcmp(name + l - 4, ".swx"))));
+}
+
+/* Check whether any component of a path is ignored */
+static int
+watch_ignored_path(const char *path)
+{
+	char name[4096];
+	const char *s, *t;
+
+	for(s = path; ; s = t + 1)
+	{
+		if(!(t = strchr(s, '/')))
+		{
+			t = s + strlen(s);
+		}
+		snprintf(name, sizeof(name), "%.*s", (int) (t - s), s);
+		if(watch_ignored(name))
+		{
+			return 1;
+		}
+		if(!*t)
+		{
+			return 0;
+		}
+	}
+}
+
+/* Scan the tree, comparing the stamp of everything in it with the last
+ * scan if record is set
+ */
+static int
+watch_scan(watch_t *w, int record)
+{
+	build_defn_t *snap, *p;
+	const char *prev;
+	tree_t *tree;
+	size_t c;
+
+	if(!(tree = tree_scan(w->ctx, ".", watch_ignore, 0, 0)))
+	{
+		return -1;
+	}
+	snap = NULL;
+	for(c = 0; c < tree->count; c++)
+	{
+		if(watch_ignored_path(tree->entries[c].path))
+		{
+			continue;
+		}
+		state_set(w->ctx, &snap, tree->entries[c].path, tree->entries[c].stamp);
+		if(record && (!(prev = state_get(w->snap, tree->entries[c].path)) || strcmp(prev, tree->entries[c].stamp)))
+		{
+			watch_changed(w, tree->entries[c].path);
+		}
+	}
+	tree_free(tree);
+	for(p = w->snap; record && p; p = p->hh.next)
+	{
+		if(!state_find(snap, p->name))
+		{
+			watch_changed(w, p->name);
+		}
+	}
+	state_free(w->snap);
+	w->snap = snap;
+	return 0;
+}
+
+#ifdef HAVE_SYS_INOTIFY_H
+
+static const char *
+watch_dir(watch_t *w, int wd)
+{
+	size_t c;
+
+	for(c = 0; c < w->ndirs; c++)
+	{
+		if(w->dirs[c].wd == wd)
+		{
+			return w->dirs[c].rel;
+		}
+	}
+	return NULL;
+}
+
+/* Watch a directory, and everything beneath it; directories which are
+ * already being watched are only descended into
+ */
+static int
+watch_add(watch_t *w, const char *rel)
+{
+	struct dirent **list;
+	struct stat sbuf;
+	watch_dir_t *p;
+	char path[4096];
+	int wd, n, c, err;
+
+	if((wd = inotify_add_watch(w->fd, (rel[0] ? rel : "."), WATCH_EVENTS|IN_ONLYDIR)) < 0)
+	{
+		if(errno == ENOENT || errno == ENOTDIR)
+		{
+			return 0;
+		}
+		context_msg(w->ctx, MSG_PERROR, "%s", (rel[0] ? rel : "."));
+		return -1;
+	}
+	if(!watch_dir(w, wd))
+	{
+		if(w->ndirs >= w->alloc)
+		{
+			if(!(p = (watch_dir_t *) realloc(w->dirs, sizeof(watch_dir_t) * (w->alloc + 64))))
+			{
+				context_msg(w->ctx, MSG_PERROR, "realloc(%u)", (unsigned) (sizeof(watch_dir_t) * (w->alloc + 64)));
+				return -1;
+			}
+			w->dirs = p;
+			w->alloc += 64;
+		}
+		if(!(w->dirs[w->ndirs].rel = strdup(rel)))
+		{
+			return -1;
+		}
+		w->dirs[w->ndirs].wd = wd;
+		w->ndirs++;
+	}
+	if((n = scandir((rel[0] ? rel : "."), &list, NULL, NULL)) < 0)
+	{
+		return 0;
+	}
+	err = 0;
+	for(c = 0; c < n; c++)
+	{
+		if(!err && strcmp(list[c]->d_name, ".") && strcmp(list[c]->d_name, "..") && !watch_ignored(list[c]->d_name))
+		{
+			snprintf(path, sizeof(path), "%s%s%s", rel, (rel[0] ? "/" : ""), list[c]->d_name);
+			if(!lstat(path, &sbuf) && S_ISDIR(sbuf.st_mode))
+			{
+				err = watch_add(w, path);
+			}
+		}
+		free(list[c]);
+	}
+	free(list);
+	return err;
+}
+
+/* Bring the stamp of a path which an event concerns up to date */
+static void
+watch_stamp(watch_t *w, const char *path)
+{
+	struct stat sbuf;
+	char stamp[96];
+
+	if(!lstat(path, &sbuf) && (S_ISREG(sbuf.st_mode) || S_ISLNK(sbuf.st_mode)))
+	{
+		tree_stamp(&sbuf, stamp, sizeof(stamp));
+		state_set(w->ctx, &(w->snap), path, stamp);
+	}
+	else
+	{
+		state_unset(&(w->snap), path);
+	}
+}
+
+/* Read whatever events are pending, noting changes if record is set;
+ * returns 1 if there were any, 0 if not, or -1 on error
+ */
+static int
+watch_read(watch_t *w, int record)
+{
+	char buf[16384], path[4096];
+	const struct inotify_event *ev;
+	const char *dir;
+	ssize_t r, c;
+
+	if((r = read(w->fd, buf, sizeof(buf))) < 0)
+	{
+		if(errno == EAGAIN || errno == EINTR)
+		{
+			return 0;
+		}
+		context_msg(w->ctx, MSG_PERROR, "inotify");
+		return -1;
+	}
+	for(c = 0; c < r; c += sizeof(struct inotify_event) + ev->len)
+	{
+		ev = (const struct inotify_event *) &(buf[c]);
+		if(ev->mask & IN_Q_OVERFLOW)
+		{
+			/* Events were lost, so the tree must be scanned */
+			w->rescan = 1;
+			continue;
+		}
+		if(!ev->len || !(dir = watch_dir(w, ev->wd)) || watch_ignored(ev->name))
+		{
+			continue;
+		}
+		snprintf(path, sizeof(path), "%s%s%s", dir, (dir[0] ? "/" : ""), ev->name);
+		if((ev->mask & IN_ISDIR) && (ev->mask & (IN_CREATE|IN_MOVED_TO)))
+		{
+			if(watch_add(w, path))
+			{
+				return -1;
+			}
+		}
+		if(!(ev->mask & IN_ISDIR))
+		{
+			watch_stamp(w, path);
+		}
+		if(record && (!(ev->mask & IN_ISDIR) || (ev->mask & (IN_MOVED_FROM|IN_MOVED_TO|IN_DELETE))))
+		{
+			watch_changed(w, path);
+		}
+	}
+	return 1;
+}
+
+/* Find what changed by scanning the tree, once events have been lost;
+ * this also watches any directories whose creation was missed
+ */
+static int
+watch_rescan(watch_t *w)
+{
+	w->rescan = 0;
+	context_msg(w->ctx, MSG_DEBUG, "inotify events were lost; scanning the tree\n");
+	if(watch_add(w, ""))
+	{
+		return -1;
+	}
+	return watch_scan(w, 1);
+}
+
+static int
+watch_init(watch_t *w)
+{
+	if((w->fd = inotify_init()) < 0)
+	{
+		context_msg(w->ctx, MSG_PERROR, "inotify_init()");
+		return -1;
+	}
+	fcntl(w->fd, F_SETFD, fcntl(w->fd, F_GETFD) | FD_CLOEXEC);
+	fcntl(w->fd, F_SETFL, fcntl(w->fd, F_GETFL) | O_NONBLOCK);
+	if(watch_add(w, ""))
+	{
+		return -1;
+	}
+	return watch_scan(w, 0);
+}
+
+/* Wait for the next burst of changes */
+static int
+watch_wait(watch_t *w)
+{
+	struct pollfd pfd;
+	int r;
+
+	pfd.fd = w->fd;
+	pfd.events = POLLIN;
+	while(!w->nchanged)
+	{
+		if((r = poll(&pfd, 1, -1)) < 0 && errno != EINTR)
+		{
+			context_msg(w->ctx, MSG_PERROR, "poll()");
+			return -1;
+		}
+		if(r > 0 && (watch_read(w, 1) < 0 || (w->rescan && watch_rescan(w))))
+		{
+			return -1;
+		}
+	}
+	/* Wait for things to settle down */
+	while((r = poll(&pfd, 1, WATCH_DEBOUNCE)) != 0)
+	{
+		if(r < 0 && errno != EINTR)
+		{
+			context_msg(w->ctx, MSG_PERROR, "poll()");
+			return -1;
+		}
+		if(r > 0 && (watch_read(w, 1) < 0 || (w->rescan && watch_rescan(w))))
+		{
+			return -1;
+		}
+	}
+	return 0;
+}
+
+/* Collect whatever happened during a build */
+static int
+watch_collect(watch_t *w)
+{
+	int r;
+
+	while((r = watch_read(w, 1)) > 0)
+	{
+	}
+	if(r >= 0 && w->rescan)
+	{
+		r = watch_rescan(w);
+	}
+	return r;
+}
+
+#else /*HAVE_SYS_INOTIFY_H*/
+
+static int
+watch_init(watch_t *w)
+{
+	w->fd = -1;
+	return watch_scan(w, 0);
+}
+
+static int
+watch_wait(watch_t *w)
+{
+	unsigned long n;
+
+	while(!w->nchanged)
+	{
+		poll(NULL, 0, WATCH_POLL);
+		if(watch_scan(w, 1))
+		{
+			return -1;
+		}
+	}
+	do
+	{
+		n = w->nchanged;
+		poll(NULL, 0, WATCH_DEBOUNCE);
+		if(watch_scan(w, 1))
+		{
+			return -1;
+		}
+	}
+	while(n != w->nchanged);
+	return 0;
+}
+
+static int
+watch_collect(watch_t *w)
+{
+	return watch_scan(w, 1);
+}
+
+#endif /*!HAVE_SYS_INOTIFY_H*/
+
+/* Sort out what changed during the build just performed, which was
+ * performed only because of what changed during the one before it if
+ * pure is set
+ */
+static int
+watch_settle(watch_t *w, int pure)
+{
+	build_defn_t *p;
+	struct stat sbuf;
+	int r, quiet;
+
+	w->building = 1;
+	r = watch_collect(w);
+	w->building = 0;
+	if(r < 0)
+	{
+		return -1;
+	}
+	if(pure)
+	{
+		quiet = 1;
+		for(p = w->during; p; p = p->hh.next)
+		{
+			if(state_find(w->suspects, p->name) && !state_find(w->inputs, p->name))
+			{
+				context_msg(w->ctx, MSG_DEBUG, "`%s' is rewritten by every build; disregarding it during builds\n", p->name);
+				state_set(w->ctx, &(w->outputs), p->name, "");
+			}
+			else if(!state_find(w->outputs, p->name))
+			{
+				quiet = 0;
+			}
+		}
+		for(p = w->suspects; quiet && p; p = p->hh.next)
+		{
+			if(state_find(w->inputs, p->name) || state_find(w->outputs, p->name))
+			{
+				continue;
+			}
+			context_msg(w->ctx, MSG_DEBUG, "`%s' is an output of the build; disregarding it during builds\n", p->name);
+			state_set(w->ctx, &(w->outputs), p->name, "");
+		}
+	}
+	state_free(w->suspects);
+	w->suspects = NULL;
+	w->nchanged = 0;
+	w->others = 0;
+	w->settling = 1;
+	for(p = w->during; p; p = p->hh.next)
+	{
+		/* Temporary files come and go during a build */
+		if(!state_find(w->inputs, p->name) && lstat(p->name, &sbuf) < 0 && errno == ENOENT)
+		{
+			continue;
+		}
+		if(!state_find(w->outputs, p->name))
+		{
+			watch_changed(w, p->name);
+			state_set(w->ctx, &(w->suspects), p->name, "");
+		}
+	}
+	w->settling = 0;
+	state_free(w->during);
+	w->during = NULL;
+	return 0;
+}
+
+/* Forget that the phases from phase onwards have been performed */
+static void
+watch_invalidate(build_context_t *ctx, build_phase_t phase)
+{
+	if(phase <= PH_PREPARE)
+	{
+		ctx->prepared = 0;
+	}
+	if(phase <= PH_CONFIG)
+	{
+		ctx->configured = 0;
+	}
+	if(phase <= PH_BUILD)
+	{
+		ctx->built = 0;
+	}
+	ctx->installed = 0;
+}
+
+/* Perform the requested phases, and then perform them again whenever
+ * the project changes; only returns on error
+ */
+int
+watch_run(build_context_t *ctx, const build_phase_t *phases, size_t nphases)
+{
+	build_phase_t *again;
+	watch_t w;
+	size_t c, n;
+	int pure;
+
+	memset(&w, 0, sizeof(w));
+	w.ctx = ctx;
+	if(!(again = (build_phase_t *) calloc(nphases, sizeof(build_phase_t))))
+	{
+		context_msg(ctx, MSG_PERROR, "calloc(%u, %u)", (unsigned) nphases, (unsigned) sizeof(build_phase_t));
+		return 1;
+	}
+	if(watch_init(&w))
+	{
+		free(again);
+		return 1;
+	}
+	context_run(ctx, phases, nphases);
+	pure = 0;
+	for(;;)
+	{
+		if(watch_settle(&w, pure) < 0)
+		{
+			break;
+		}
+		if(!w.nchanged)
+		{
+			context_msg(ctx, MSG_ECHO, "watching for changes; interrupt to stop.\n");
+		}
+		if(watch_wait(&w))
+		{
+			break;
+		}
+		/* Note whether the phases are to be performed again only
+		 * because of what changed during the last build
+		 */
+		pure = (w.suspects && w.nchanged == HASH_COUNT(w.suspects));
+		context_msg(ctx, MSG_ECHO, "`%s'%s changed; resuming from phase '%s'.\n", w.first, (w.others ? " (and others)" : ""),
+					context_phase_name(w.earliest));
+		/* Phases before the earliest invalidated, such as 'clean',
+		 * aren't performed again
+		 */
+		for(c = 0, n = 0; c < nphases; c++)
+		{
+			if(phases[c] >= w.earliest)
+			{
+				again[n++] = phases[c];
+			}
+		}
+		if(!n)
+		{
+			pure = 0;
+			continue;
+		}
+		watch_invalidate(ctx, w.earliest);
+		objects_reset();
+		memset(ctx->stats, 0, sizeof(ctx->stats));
+		context_run(ctx, again, n);
+	}
+	free(again);
+	return 1;
+}
@@ -0,0 +1,962 @@
+/* Copyright 2013 Mo McRoberts.
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ */
+
+#ifdef HAVE_CONFIG_H
+# include "config.h"
+#endif
+
+#include "p_build.h"
+
+/* A workspace is a set of projects, each living in its own directory,
+ * which may depend upon one another. Projects are built in separate
+ * processes, each with its own build context, and a project is started
+ * as soon as all of the projects it depends upon have completed all of
+ * the requested phases.
+ *
+ * In batch mode, the workspace is instead a list of independent jobs,
+ * each of which may name its own phases and definitions. A failed job
+ * doesn't stop the others, and a summary is shown once all are done.
+ *
+ * The time taken by each project is recorded in the workspace's own
+ * timings (see timing.c), filed under a digest of its directory, phases
+ * and definitions. When more than one project is ready to be started,
+ * the one with the longest predicted path to the end of the build (its
+ * own duration plus the longest chain of projects which depend upon it)
+ * is started first, so that the longest work isn't left until last.
+ * Projects which have never been built are assumed to take the average
+ * of those which have.
+ *
+ * A configuration matrix (--host and --config given as comma-separated
+ * lists) is run as a batch of jobs in the same project, one for each
+ * combination, each built in its own directory (see context_objdir()).
+ * The 'prepare' phase is performed once, beforehand, and shared.
+ */
+
+typedef struct build_project_s build_project_t;
+
+typedef enum
+{
+	PS_PENDING,
+	PS_RUNNING,
+	PS_DONE,
+	PS_FAILED
+} project_state_t;
+
+struct build_project_s
+{
+	char *name;
+	char *dir;
+	char **deps;
+	size_t ndeps;
+	build_project_t **rdeps;
+	size_t nrdeps;
+	size_t waiting;
+	project_state_t state;
+	build_workspace_t *ws;
+	int hastoken;
+	char token;
+	/* For batch jobs: the phases to perform, if not those given on the
+	 * command-line, and any definitions
+	 */
+	build_phase_t *phases;
+	size_t nphases;
+	char **defs;
+	size_t ndefs;
+	/* For the combinations of a matrix: the host triplet and
+	 * configuration
+	 */
+	char *host;
+	char *config;
+	long long elapsed;
+	/* The predicted duration of this project, and of the longest path
+	 * from its start to the end of the build
+	 */
+	long long predicted;
+	long long priority;
+	int ranked;
+	UT_hash_handle hh;
+};
+
+struct build_workspace_s
+{
+	build_context_t *ctx;
+	build_project_t *projects;
+	supervisor_t *sup;
+	const build_phase_t *phases;
+	size_t nphases;
+	int batch;
+	/* Building the combinations of a matrix, which share the detection
+	 * and 'prepare' performed beforehand; if the handler builds in the
+	 * tree, they can only be built one at a time
+	 */
+	int matrix;
+	int prepared;
+	int serial;
+};
+
+static int
+workspace_strlist_add(build_context_t *ctx, char ***list, size_t *count, const char *str)
+{
+	char **p;
+
+	if(!(p = realloc(*list, sizeof(char *) * (*count + 1))))
+	{
+		context_msg(ctx, MSG_PERROR, "realloc(..., %u)", (unsigned) (sizeof(char *) * (*count + 1)));
+		return -1;
+	}
+	*list = p;
+	if(!(p[*count] = strdup(str)))
+	{
+		context_msg(ctx, MSG_PERROR, "strdup(...[%u])", (unsigned) strlen(str));
+		return -1;
+	}
+	(*count)++;
+	return 0;
+}
+
+static build_project_t *
+workspace_project(build_workspace_t *ws, const char *name, const char *dir)
+{
+	build_project_t *p;
+
+	HASH_FIND_STR(ws->projects, name, p);
+	if(p)
+	{
+		return p;
+	}
+	if(!(p = calloc(1, sizeof(build_project_t))))
+	{
+		context_msg(ws->ctx, MSG_PERROR, "calloc(1, %u)", (unsigned) sizeof(build_project_t));
+		return NULL;
+	}
+	if(!(p->name = strdup(name)) || !(p->dir = strdup(dir)))
+	{
+		context_msg(ws->ctx, MSG_PERROR, "strdup(...[%u])", (unsigned) strlen(dir));
+		free(p->name);
+		free(p);
+		return NULL;
+	}
+	p->ws = ws;
+	HASH_ADD_KEYPTR(hh, ws->projects, p->name, strlen(p->name), p);
+	return p;
+}
+
+/* Read a workspace manifest. Each line names a project directory
+ * (relative to the directory containing the manifest, if not absolute),
+ * optionally followed by a colon and the names of the other projects
+ * which must be built first, in the manner of a make rule:
+ *
+ *   libfoo
+ *   libbar: libfoo
+ *   app: libfoo libbar
+ *
+ * Blank lines and anything following a '#' are ignored.
+ */
+static int
+workspace_load(build_workspace_t *ws, const char *path)
+{
+	FILE *f;
+	char buf[4096], dir[4096], *name, *deps, *t;
+	const char *base;
+	build_project_t *p;
+	size_t bl, line;
+
+	if(!strcmp(path, "-"))
+	{
+		f = stdin;
+		base = NULL;
+		bl = 0;
+	}
+	else
+	{
+		if(!(f = fopen(path, "r")))
+		{
+			context_msg(ws->ctx, MSG_PERROR, "%s", path);
+			return -1;
+		}
+		base = path;
+		bl = ((t = strrchr(path, '/')) ? (size_t) (t - path) : 0);
+	}
+	for(line = 1; fgets(buf, sizeof(buf), f); line++)
+	{
+		if((t = strchr(buf, '#')))
+		{
+			*t = 0;
+		}
+		if((deps = strchr(buf, ':')))
+		{
+			*deps = 0;
+			deps++;
+		}
+		if(!(name = strtok(buf, " \t\r\n")))
+		{
+			if(deps)
+			{
+				context_msg(ws->ctx, MSG_ERROR, "%s:%u: missing project name\n", path, (unsigned) line);
+				goto failed;
+			}
+			continue;
+		}
+		if(strtok(NULL, " \t\r\n"))
+		{
+			context_msg(ws->ctx, MSG_ERROR, "%s:%u: expected a single project name before ':'\n", path, (unsigned) line);
+			goto failed;
+		}
+		if(name[0] == '/' || !bl)
+		{
+			snprintf(dir, sizeof(dir), "%s", name);
+		}
+		else
+		{
+			snprintf(dir, sizeof(dir), "%.*s/%s", (int) bl, base, name);
+		}
+		if(!(p = workspace_project(ws, name, dir)))
+		{
+			goto failed;
+		}
+		for(t = (deps ? strtok(deps, " \t\r\n") : NULL); t; t = strtok(NULL, " \t\r\n"))
+		{
+			if(workspace_strlist_add(ws->ctx, &(p->deps), &(p->ndeps), t) < 0)
+			{
+				goto failed;
+			}
+		}
+	}
+	if(f != stdin)
+	{
+		fclose(f);
+	}
+	return 0;
+failed:
+	if(f != stdin)
+	{
+		fclose(f);
+	}
+	return -1;
+}
+
+/* Read a list of batch jobs. Each line names a project directory
+ * (relative to the directory containing the list, if not absolute),
+ * followed by any phases to perform and definitions to apply, either as
+ * -DVAR[=VALUE] or VAR=VALUE:
+ *
+ *   libfoo clean build
+ *   libbar build -DDEBUG CFLAGS=-O0
+ *
+ * Blank lines and anything following a '#' are ignored. The same
+ * directory may appear more than once.
+ */
+int
+workspace_batch(build_workspace_t *ws, const char *path)
+{
+	FILE *f;
+	char buf[4096], dir[4096], name[4200], *t;
+	const char *base;
+	build_project_t *p;
+	build_phase_t *ph;
+	size_t bl, line;
+	int c;
+
+	ws->batch = 1;
+	if(!strcmp(path, "-"))
+	{
+		f = stdin;
+		base = NULL;
+		bl = 0;
+	}
+	else
+	{
+		if(!(f = fopen(path, "r")))
+		{
+			context_msg(ws->ctx, MSG_PERROR, "%s", path);
+			return -1;
+		}
+		base = path;
+		bl = ((t = strrchr(path, '/')) ? (size_t) (t - path) : 0);
+	}
+	for(line = 1; fgets(buf, sizeof(buf), f); line++)
+	{
+		if((t = strchr(buf, '#')))
+		{
+			*t = 0;
+		}
+		if(!(t = strtok(buf, " \t\r\n")))
+		{
+			continue;
+		}
+		if(t[0] == '/' || !bl)
+		{
+			snprintf(dir, sizeof(dir), "%s", t);
+		}
+		else
+		{
+			snprintf(dir, sizeof(dir), "%.*s/%s", (int) bl, base, t);
+		}
+		/* Jobs are named after their directory, and where that's
+		 * ambiguous, their line number too
+		 */
+		snprintf(name, sizeof(name), "%s", t);
+		HASH_FIND_STR(ws->projects, name, p);
+		if(p)
+		{
+			snprintf(name, sizeof(name), "%s#%u", t, (unsigned) line);
+		}
+		if(!(p = workspace_project(ws, name, dir)))
+		{
+			goto failed;
+		}
+		while((t = strtok(NULL, " \t\r\n")))
+		{
+			if(!strncmp(t, "-D", 2) || strchr(t, '='))
+			{
+				if(workspace_strlist_add(ws->ctx, &(p->defs), &(p->ndefs), (t[0] == '-' ? t + 2 : t)) < 0)
+				{
+					goto failed;
+				}
+				continue;
+			}
+			for(c = 0; c < PH_COUNT; c++)
+			{
+				if(!strcmp(t, context_phase_name((build_phase_t) c)))
+				{
+					break;
+				}
+			}
+			if(c == PH_COUNT)
+			{
+				context_msg(ws->ctx, MSG_ERROR, "%s:%u: unrecognized build phase `%s'\n", path, (unsigned) line, t);
+				goto failed;
+			}
+			if(!(ph = realloc(p->phases, sizeof(build_phase_t) * (p->nphases + 1))))
+			{
+				context_msg(ws->ctx, MSG_PERROR, "realloc(..., %u)", (unsigned) (sizeof(build_phase_t) * (p->nphases + 1)));
+				goto failed;
+			}
+			p->phases = ph;
+			p->phases[p->nphases] = (build_phase_t) c;
+			p->nphases++;
+		}
+	}
+	if(f != stdin)
+	{
+		fclose(f);
+	}
+	return 0;
+failed:
+	if(f != stdin)
+	{
+		fclose(f);
+	}
+	return -1;
+}
+
+build_workspace_t *
+workspace_create(build_context_t *ctx)
+{
+	build_workspace_t *ws;
+
+	if(!(ws = calloc(1, sizeof(build_workspace_t))))
+	{
+		context_msg(ctx, MSG_PERROR, "calloc(1, %u)", (unsigned) sizeof(build_workspace_t));
+		return NULL;
+	}
+	ws->ctx = ctx;
+	return ws;
+}
+
+/* Add either a single project directory or the contents of a manifest
+ * to the workspace.
+ */
+int
+workspace_add(build_workspace_t *ws, const char *path)
+{
+	struct stat sbuf;
+
+	if(strcmp(path, "-"))
+	{
+		if(stat(path, &sbuf) < 0)
+		{
+			context_msg(ws->ctx, MSG_PERROR, "%s", path);
+			return -1;
+		}
+		if(S_ISDIR(sbuf.st_mode))
+		{
+			return (workspace_project(ws, path, path) ? 0 : -1);
+		}
+	}
+	return workspace_load(ws, path);
+}
+
+/* Split a comma-separated list, which may be NULL, into its members;
+ * a NULL list has a single NULL member
+ */
+static int
+workspace_list(build_context_t *ctx, const char *list, char ***members, size_t *count)
+{
+	char *buf, *t, *saveptr;
+
+	*members = NULL;
+	*count = 0;
+	if(!list)
+	{
+		if(!(*members = calloc(1, sizeof(char *))))
+		{
+			context_msg(ctx, MSG_PERROR, "calloc(1, %u)", (unsigned) sizeof(char *));
+			return -1;
+		}
+		*count = 1;
+		return 0;
+	}
+	if(!(buf = strdup(list)))
+	{
+		context_msg(ctx, MSG_PERROR, "strdup(...[%u])", (unsigned) strlen(list));
+		return -1;
+	}
+	for(t = strtok_r(buf, ",", &saveptr); t; t = strtok_r(NULL, ",", &saveptr))
+	{
+		if(workspace_strlist_add(ctx, members, count, t) < 0)
+		{
+			free(buf);
+			return -1;
+		}
+	}
+	free(buf);
+	if(!*count)
+	{
+		context_msg(ctx, MSG_FATAL, "`%s' is not a valid list.  Stop.\n", list);
+		return -1;
+	}
+	return 0;
+}
+
+/* Add a job for each combination of the comma-separated host triplets
+ * and configuration names given to the project in the current
+ * directory, which has already been detected, and perform the 'prepare'
+ * phase on behalf of them all, if any of the phases requires it.
+ */
+int
+workspace_matrix(build_workspace_t *ws, const build_phase_t *phases, size_t nphases)
+{
+	build_context_t *ctx;
+	build_project_t *p;
+	const char *host, *config;
+	char **hosts, **configs, name[512], *cwd;
+	size_t nhosts, nconfigs, h, c;
+	int r, needed, isauto;
+
+	ctx = ws->ctx;
+	ws->batch = 1;
+	ws->matrix = 1;
+	hosts = configs = NULL;
+	nhosts = nconfigs = 0;
+	r = -1;
+	if(context_returnwd(ctx) < 0 || !(cwd = getcwd(NULL, 0)))
+	{
+		context_msg(ctx, MSG_PERROR, "getcwd()");
+		return -1;
+	}
+	if(workspace_list(ctx, ctx->host, &hosts, &nhosts) || workspace_list(ctx, ctx->config, &configs, &nconfigs))
+	{
+		goto done;
+	}
+	for(h = 0; h < nhosts; h++)
+	{
+		for(c = 0; c < nconfigs; c++)
+		{
+			if(hosts[h] && configs[c])
+			{
+				snprintf(name, sizeof(name), "%s/%s", hosts[h], configs[c]);
+			}
+			else
+			{
+				snprintf(name, sizeof(name), "%s", (hosts[h] ? hosts[h] : configs[c]));
+			}
+			if(!(p = workspace_project(ws, name, cwd)) ||
+			   (hosts[h] && !(p->host = strdup(hosts[h]))) ||
+			   (configs[c] && !(p->config = strdup(configs[c]))))
+			{
+				goto done;
+			}
+		}
+	}
+	/* Each combination is built in a directory of its own, where the
+	 * handler supports that; otherwise, they'd trample on one another
+	 */
+	ctx->vpath = 1;
+	if(!context_objdir(ctx))
+	{
+		context_msg(ctx, MSG_INFO, "the '%s' handler builds in the tree, so combinations will be built one at a time\n", ctx->vt->name);
+		ctx->vpath = 0;
+		ws->serial = 1;
+	}
+	needed = 0;
+	isauto = 1;
+	for(c = 0; c < nphases; c++)
+	{
+		if(phases[c] >= PH_PREPARE)
+		{
+			needed = 1;
+		}
+		if(phases[c] == PH_PREPARE)
+		{
+			isauto = 0;
+		}
+	}
+	r = 0;
+	if(needed && ctx->vt->prepare)
+	{
+		/* What 'prepare' produces doesn't depend upon the host or the
+		 * configuration
+		 */
+		host = ctx->host;
+		config = ctx->config;
+		ctx->host = ctx->config = NULL;
+		phases_load(ctx);
+		r = context_build(ctx, PH_PREPARE, isauto);
+		ctx->host = host;
+		ctx->config = config;
+		if(r && r != -255)
+		{
+			context_msg(ctx, MSG_FATAL, "failed to prepare the project for the matrix.  Stop.\n");
+			r = -1;
+			goto done;
+		}
+		r = 0;
+		ws->prepared = 1;
+		context_returnwd(ctx);
+	}
+done:
+	for(h = 0; h < nhosts; h++)
+	{
+		free(hosts[h]);
+	}
+	for(c = 0; c < nconfigs; c++)
+	{
+		free(configs[c]);
+	}
+	free(hosts);
+	free(configs);
+	free(cwd);
+	return r;
+}
+
+/* Link each project to the projects which depend upon it, and make sure
+ * that the result is actually buildable.
+ */
+static int
+workspace_resolve(build_workspace_t *ws)
+{
+	build_project_t *p, *d, **rd, **queue;
+	size_t c, head, tail, total;
+
+	total = HASH_COUNT(ws->projects);
+	for(p = ws->projects; p; p = p->hh.next)
+	{
+		for(c = 0; c < p->ndeps; c++)
+		{
+			HASH_FIND_STR(ws->projects, p->deps[c], d);
+			if(!d)
+			{
+				context_msg(ws->ctx, MSG_FATAL, "project `%s' depends upon `%s', which is not part of the workspace.  Stop.\n", p->name, p->deps[c]);
+				return -1;
+			}
+			if(d == p)
+			{
+				context_msg(ws->ctx, MSG_FATAL, "project `%s' depends upon itself.  Stop.\n", p->name);
+				return -1;
+			}
+			if(!(rd = realloc(d->rdeps, sizeof(build_project_t *) * (d->nrdeps + 1))))
+			{
+				context_msg(ws->ctx, MSG_PERROR, "realloc(..., %u)", (unsigned) (sizeof(build_project_t *) * (d->nrdeps + 1)));
+				return -1;
+			}
+			d->rdeps = rd;
+			d->rdeps[d->nrdeps] = p;
+			d->nrdeps++;
+		}
+		p->waiting = p->ndeps;
+	}
+	/* Walk the graph once in dependency order; anything left over is
+	 * part of a cycle.
+	 */
+	if(!(queue = calloc(total + 1, sizeof(build_project_t *))))
+	{
+		context_msg(ws->ctx, MSG_PERROR, "calloc(%u, %u)", (unsigned) (total + 1), (unsigned) sizeof(build_project_t *));
+		return -1;
+	}
+	head = tail = 0;
+	for(p = ws->projects; p; p = p->hh.next)
+	{
+		if(!p->waiting)
+		{
+			queue[tail++] = p;
+		}
+	}
+	while(head < tail)
+	{
+		p = queue[head++];
+		for(c = 0; c < p->nrdeps; c++)
+		{
+			if(!--p->rdeps[c]->waiting)
+			{
+				queue[tail++] = p->rdeps[c];
+			}
+		}
+	}
+	free(queue);
+	for(p = ws->projects; p; p = p->hh.next)
+	{
+		if(p->waiting)
+		{
+			context_msg(ws->ctx, MSG_FATAL, "circular dependency involving project `%s'.  Stop.\n", p->name);
+			return -1;
+		}
+		p->waiting = p->ndeps;
+	}
+	return 0;
+}
+
+static int
+workspace_child(void *data)
+{
+	build_project_t *p;
+	build_workspace_t *ws;
+	build_context_t ctx;
+	char *v;
+	size_t c;
+
+	p = (build_project_t *) data;
+	ws = p->ws;
+	ctx = *(ws->ctx);
+	ctx.wd = p->dir;
+	if(!ws->matrix)
+	{
+		ctx.project = NULL;
+		ctx.vt = NULL;
+	}
+	if(p->host || p->config)
+	{
+		ctx.host = p->host;
+		ctx.config = p->config;
+	}
+	ctx.prepared = ws->prepared;
+	ctx.configured = ctx.built = ctx.installed = 0;
+	for(c = 0; c < p->ndefs; c++)
+	{
+		if((v = strchr(p->defs[c], '=')))
+		{
+			*v = 0;
+			v++;
+		}
+		context_defn_add(&ctx, p->defs[c], v);
+	}
+	if(context_chdir(&ctx) < 0)
+	{
+		return 1;
+	}
+	if(!ctx.vt && NULL == context_detect(&ctx))
+	{
+		context_msg(&ctx, MSG_FATAL, "%s: No suitable project file or directory could be found.  Stop.\n", p->name);
+		return 1;
+	}
+	if(p->nphases)
+	{
+		return context_run(&ctx, p->phases, p->nphases);
+	}
+	return context_run(&ctx, ws->phases, ws->nphases);
+}
+
+/* Start building a project. When projects may run concurrently, their
+ * output is collected and prefixed with the project name a line at a
+ * time so that it remains legible.
+ */
+static int
+workspace_start(build_workspace_t *ws, build_project_t *p)
+{
+	context_msg(ws->ctx, MSG_ECHO, "starting project `%s'.\n", p->name);
+	context_msg(ws->ctx, MSG_DEBUG, "project `%s' is predicted to take %lld.%02llds, with %lld.%02llds of the build ahead of it\n", p->name,
+				p->predicted / 1000000, (p->predicted % 1000000) / 10000, p->priority / 1000000, (p->priority % 1000000) / 10000);
+	if(!supervisor_fork(ws->sup, (ws->ctx->jobs > 1 ? p->name : NULL), workspace_child, p))
+	{
+		return -1;
+	}
+	p->state = PS_RUNNING;
+	return 0;
+}
+
+/* Return the name under which the timing of a project is recorded */
+static const char *
+workspace_jobkey(build_workspace_t *ws, build_project_t *p)
+{
+	static char key[DIGEST_HEXLEN + 8];
+	const build_phase_t *phases;
+	size_t c, nphases;
+	digest_t d;
+
+	phases = (p->nphases ? p->phases : ws->phases);
+	nphases = (p->nphases ? p->nphases : ws->nphases);
+	digest_init(&d);
+	context_digest_options(ws->ctx, &d);
+	digest_str(&d, p->dir);
+	for(c = 0; c < nphases; c++)
+	{
+		digest_str(&d, context_phase_name(phases[c]));
+	}
+	digest_str(&d, NULL);
+	for(c = 0; c < p->ndefs; c++)
+	{
+		digest_str(&d, p->defs[c]);
+	}
+	digest_str(&d, NULL);
+	digest_str(&d, p->host);
+	digest_str(&d, p->config);
+	strcpy(key, "job.");
+	digest_final(&d, key + 4);
+	return key;
+}
+
+/* Determine the longest path from the start of p to the end of the
+ * build; the graph is known to be acyclic by now
+ */
+static long long
+workspace_rank(build_project_t *p)
+{
+	long long longest;
+	size_t c;
+
+	if(p->ranked)
+	{
+		return p->priority;
+	}
+	longest = 0;
+	for(c = 0; c < p->nrdeps; c++)
+	{
+		if(workspace_rank(p->rdeps[c]) > longest)
+		{
+			longest = p->rdeps[c]->priority;
+		}
+	}
+	p->priority = p->predicted + longest;
+	p->ranked = 1;
+	return p->priority;
+}
+
+/* Predict how long each project will take, and rank them accordingly */
+static void
+workspace_prioritise(build_workspace_t *ws)
+{
+	build_project_t *p;
+	long long sum;
+	size_t known;
+
+	sum = 0;
+	known = 0;
+	for(p = ws->projects; p; p = p->hh.next)
+	{
+		if((p->predicted = timing_predict(ws->ctx, workspace_jobkey(ws, p))) >= 0)
+		{
+			sum += p->predicted;
+			known++;
+		}
+	}
+	for(p = ws->projects; p; p = p->hh.next)
+	{
+		if(p->predicted < 0)
+		{
+			/* With nothing to go on, every project counts the same, so
+			 * that the longest chain of dependencies is still favoured
+			 */
+			p->predicted = (known ? sum / known : 1);
+		}
+		p->ranked = 0;
+	}
+	for(p = ws->projects; p; p = p->hh.next)
+	{
+		workspace_rank(p);
+	}
+}
+
+/* Return the project which is ready to be started and has the longest
+ * path ahead of it, or the first such in the manifest if none is known
+ * to be longer than the others
+ */
+static build_project_t *
+workspace_ready(build_workspace_t *ws)
+{
+	build_project_t *p, *best;
+
+	best = NULL;
+	for(p = ws->projects; p; p = p->hh.next)
+	{
+		if(p->state == PS_PENDING && !p->waiting && (!best || p->priority > best->priority))
+		{
+			best = p;
+		}
+	}
+	return best;
+}
+
+/* Show the outcome of each batch job */
+static int
+workspace_summary(build_workspace_t *ws, size_t failed)
+{
+	static const char *states[] = { "skipped", "running", "ok", "FAILED" };
+	build_project_t *p;
+	size_t total;
+
+	total = HASH_COUNT(ws->projects);
+	context_msg(ws->ctx, MSG_ECHO, "summary of %u job(s):\n", (unsigned) total);
+	for(p = ws->projects; p; p = p->hh.next)
+	{
+		context_msg(ws->ctx, MSG_ECHO, "  %-8s %5lld.%02llds  %s\n", states[p->state],
+					p->elapsed / 1000000, (p->elapsed % 1000000) / 10000, p->name);
+	}
+	if(failed)
+	{
+		context_msg(ws->ctx, MSG_ERROR, "%u of %u job(s) failed.\n", (unsigned) failed, (unsigned) total);
+		return 1;
+	}
+	context_msg(ws->ctx, MSG_ECHO, "all %u job(s) succeeded.\n", (unsigned) total);
+	return 0;
+}
+
+/* Build every project in the workspace, running up to ctx->jobs
+ * projects at once. The first project runs in the job slot which we
+ * hold implicitly; each additional concurrent project needs a token
+ * from the jobserver, if there is one.
+ */
+int
+workspace_run(build_workspace_t *ws, const build_phase_t *phases, size_t nphases)
+{
+	build_project_t *p;
+	supervisor_job_t *job;
+	size_t c, running, failed, skipped;
+	int jobs, status, starved;
+
+	if(!ws->projects)
+	{
+		context_msg(ws->ctx, MSG_FATAL, "the workspace contains no projects.  Stop.\n");
+		return 1;
+	}
+	if(workspace_resolve(ws))
+	{
+		return 1;
+	}
+	if((jobs = ws->ctx->jobs) < 1 || ws->serial)
+	{
+		jobs = 1;
+	}
+	if(!(ws->sup = supervisor_create(ws->ctx)))
+	{
+		return 1;
+	}
+	ws->phases = phases;
+	ws->nphases = nphases;
+	workspace_prioritise(ws);
+	context_msg(ws->ctx, MSG_INFO, "building %u projects, up to %d at a time\n", (unsigned) HASH_COUNT(ws->projects), jobs);
+	running = failed = 0;
+	for(;;)
+	{
+		starved = 0;
+		while((!failed || ws->batch) && running < (size_t) jobs && (p = workspace_ready(ws)))
+		{
+			if(running)
+			{
+				if(!jobserver_acquire(ws->ctx, &(p->token)))
+				{
+					starved = 1;
+					break;
+				}
+				p->hastoken = 1;
+			}
+			if(workspace_start(ws, p))
+			{
+				if(p->hastoken)
+				{
+					jobserver_release(ws->ctx, p->token);
+					p->hastoken = 0;
+				}
+				p->state = PS_FAILED;
+				failed++;
+				context_msg(ws->ctx, MSG_FATAL, "project `%s' could not be started.\n", p->name);
+				/* In batch mode, the others carry on regardless */
+				if(ws->batch)
+				{
+					continue;
+				}
+				break;
+			}
+			running++;
+		}
+		if(!running)
+		{
+			break;
+		}
+		/* If a project is waiting for a job slot, wake up when one
+		 * might have become available, as well as when a running
+		 * project finishes.
+		 */
+		supervisor_watch(ws->sup, (starved ? jobserver_fd() : -1));
+		if(!(job = supervisor_wait(ws->sup, -1)))
+		{
+			continue;
+		}
+		p = (build_project_t *) supervisor_job_data(job);
+		status = supervisor_job_status(job);
+		p->elapsed = supervisor_job_elapsed(job);
+		supervisor_job_free(job);
+		running--;
+		if(p->hastoken)
+		{
+			jobserver_release(ws->ctx, p->token);
+			p->hastoken = 0;
+		}
+		if(WIFEXITED(status) && !WEXITSTATUS(status))
+		{
+			p->state = PS_DONE;
+			timing_record(ws->ctx, workspace_jobkey(ws, p), p->elapsed);
+			context_msg(ws->ctx, MSG_ECHO, "project `%s' completed.\n", p->name);
+			for(c = 0; c < p->nrdeps; c++)
+			{
+				p->rdeps[c]->waiting--;
+			}
+			continue;
+		}
+		p->state = PS_FAILED;
+		failed++;
+		context_msg(ws->ctx, MSG_FATAL, "project `%s' failed.\n", p->name);
+	}
+	supervisor_destroy(ws->sup);
+	ws->sup = NULL;
+	timing_save(ws->ctx);
+	if(ws->batch)
+	{
+		return workspace_summary(ws, failed);
+	}
+	if(!failed)
+	{
+		return 0;
+	}
+	skipped = 0;
+	for(p = ws->projects; p; p = p->hh.next)
+	{
+		if(p->state == PS_PENDING)
+		{
+			skipped++;
+		}
+	}
+	context_msg(ws->ctx, MSG_FATAL, "%u project(s) failed; %u project(s) not built because of errors.  Stop.\n", (unsigned) failed, (unsigned) skipped);
+	return 1;
+}
@@ -54,6 +54,7 @@ xcodebuild_detect(build_context_t *ctx)
 		{			
 			/* ctx->project points to a .xcodeproj */
 			fprintf(stderr, "%s found; %s is a valid project\n", pbuf, ctx->project);
+			ctx->detected = pbuf;
 			return 1;
 		}
 		chdir(ctx->project);
@@ -78,7 +79,13 @@ xcodebuild_detect(build_context_t *ctx)
 				{
 					free(pbuf);
 				}
-				match = pbuf = strdup(de->d_name);
+				/* Detection happens within the project directory,
+				 * but the phases run from the working directory.
+				 */
+				if((match = pbuf = malloc((ctx->project ? strlen(ctx->project) + 1 : 0) + strlen(de->d_name) + 1)))
+				{
+					sprintf(pbuf, "%s%s%s", (ctx->project ? ctx->project : ""), (ctx->project ? "/" : ""), de->d_name);
+				}
 			}
 		}		
 	}
@@ -86,6 +93,7 @@ xcodebuild_detect(build_context_t *ctx)
 	if(match)
 	{
 		ctx->project = match;
+		ctx->detected = match;
 		return 1;
 	}
 	context_returnwd(ctx);
@@ -185,6 +193,7 @@ build_handler_t xcodebuild_handler = {
 	xcodebuild_install,
 	xcodebuild_clean,
 	NULL,
+	NULL,
 };
 
 